@@ -1,5 +1,6 @@
 #include "backend.hpp"
 #include "frontend.hpp"
+#include "metrics.hpp"
 #include "util.hpp"
 
 #include <nanomsg/nn.h>
@@ -41,7 +42,8 @@ static bool setup_sockets(const vector<int>& protocols,
 	return true;
 	}
 
-static void handle_nn_error(const string& msg)
+// Takes a plain format string, as it's called on every EAGAIN.
+static void handle_nn_error(const char* msg)
 	{
 	// TODO: not quite sure the right way to handle errors.  None seem
 	// seem suitable to be thrown as exception, the ones not ignored here
@@ -52,7 +54,7 @@ static void handle_nn_error(const string& msg)
 	if ( e == EAGAIN || e == EINTR )
 		return;
 
-	fprintf(stderr, msg.c_str(), nn_strerror(e));
+	fprintf(stderr, msg, nn_strerror(e));
 	exit(1);
 	}
 
@@ -73,17 +75,367 @@ static bool set_nn_fds(int socket, int option, fd_set* fds, int* maxfd)
 	return true;
 	}
 
+template <class T>
+static void set_by_id(vector<T*>* v, uint32_t id, T* val)
+	{
+	if ( id >= v->size() )
+		v->resize(id + 1, nullptr);
+
+	(*v)[id] = val;
+	}
+
+template <class T>
+static T* get_by_id(const vector<T*>& v, uint32_t id)
+	{
+	return id < v.size() ? v[id] : nullptr;
+	}
+
+static bool less_time(timeval t1, timeval t2)
+	{
+	if ( t1.tv_sec < t2.tv_sec )
+		return true;
+	if ( t1.tv_sec == t2.tv_sec )
+		return t1.tv_usec < t2.tv_usec;
+	return false;
+	}
+
+static void min_timeout(unique_ptr<timeval>* timeout, timeval t)
+	{
+	if ( *timeout )
+		{
+		if ( less_time(t, *timeout->get()) )
+			timeout->reset(new timeval(t));
+		}
+	else
+		timeout->reset(new timeval(t));
+	}
+
+// Whether a queue has no room for another message.
+static bool at_limits(const QueueLimits& limits, size_t n, size_t bytes)
+	{
+	return (limits.max_messages && n >= limits.max_messages) ||
+	       (limits.max_bytes && bytes >= limits.max_bytes);
+	}
+
+static bool over_limits(const QueueLimits& limits, size_t n, size_t bytes)
+	{
+	return (limits.max_messages && n > limits.max_messages) ||
+	       (limits.max_bytes && bytes > limits.max_bytes);
+	}
+
+// Runs the backend's IO until the queue isn't full or the timeout passes.
+static bool wait_for_room(Backend* b, const function<bool()>& full,
+                          double timeout)
+	{
+	double deadline = current_time() + timeout;
+
+	while ( full() )
+		{
+		double left = deadline - current_time();
+
+		if ( left <= 0 )
+			return false;
+
+		int nfds = 0;
+		fd_set rfds;
+		fd_set wfds;
+		unique_ptr<timeval> to(nullptr);
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+
+		if ( ! b->GetSelectParams(&nfds, &rfds, &wfds, nullptr, &to) )
+			return false;
+
+		timeval tv = to_timeval(left);
+
+		if ( to && less_time(*to, tv) )
+			tv = *to;
+
+		select(nfds, &rfds, &wfds, nullptr, &tv);
+		b->ProcessIO();
+		}
+
+	return true;
+	}
+
+// Whether a queue takes another message under its policy.  Dropping and
+// conflating make room once the message is queued.
+static bool admit(Backend* b, const QueueLimits& limits,
+                  const function<bool()>& full, MetricsCounter rejects,
+                  MetricsCounter blocks)
+	{
+	if ( ! full() )
+		return true;
+
+	switch ( limits.policy ) {
+	case QUEUE_DROP_OLDEST:
+	case QUEUE_CONFLATE:
+		return true;
+	case QUEUE_BLOCK:
+		if ( ! b->ProcessingIO() )
+			{
+			Metrics::Add(blocks);
+
+			if ( wait_for_room(b, full, limits.block_timeout) )
+				return true;
+			}
+		break;
+	case QUEUE_REJECT:
+		break;
+	}
+
+	Metrics::Add(rejects);
+	return false;
+	}
+
+// Sends the response to the last request a REP socket received, if there's
+// one waiting, with the server's stamps in front for a traced request.
+static void send_response(int socket, unique_ptr<Response>* response,
+                          bool* traced, RequestTrace* trace)
+	{
+	if ( ! *response )
+		return;
+
+	const string* msg = &(*response)->Msg();
+	string traced_msg;
+
+	if ( *traced )
+		{
+		trace->reply_sent = current_time();
+		traced_msg = encode_traced_response(*msg, *trace);
+		msg = &traced_msg;
+		}
+
+	int n = nn_send(socket, msg->data(), msg->size(), NN_DONTWAIT);
+
+	if ( n < 0 )
+		handle_nn_error("Failed sending response: %s\n");
+	else
+		{
+		Metrics::Add(METRIC_BYTES_SENT, n);
+		*response = nullptr;
+		*traced = false;
+		}
+	}
+
+// Receives a request on a REP socket, if there's one, and has 'answer' make
+// the response to send, or one for each request of a batch.  Traced requests
+// start with '!'.
+static void receive_request(int socket, unique_ptr<Response>* response,
+                            bool* traced, RequestTrace* trace,
+                            const function<unique_ptr<Response>(
+                                    const Request*)>& answer)
+	{
+	char* buf = nullptr;
+	int n = nn_recv(socket, &buf, NN_MSG, NN_DONTWAIT);
+
+	if ( n < 0 )
+		{
+		handle_nn_error("Failed to receive request: %s\n");
+		return;
+		}
+
+	Metrics::Add(METRIC_BYTES_RECEIVED, n);
+	bool is_traced = n > 0 && buf[0] == '!';
+	double received = is_traced ? current_time() : 0;
+	auto request = Request::Parse(buf + is_traced, n - is_traced);
+
+	auto batch = message_cast<BatchRequest>(request.get());
+
+	if ( batch )
+		{
+		vector<unique_ptr<Response>> parts;
+
+		for ( const auto& r : batch->Requests() )
+			parts.push_back(answer(r.get()));
+
+		*response = unique_ptr<Response>(new BatchResponse(move(parts)));
+		}
+	else if ( request )
+		*response = answer(request.get());
+	else
+		*response = unique_ptr<Response>(new InvalidRequestResponse());
+
+	if ( is_traced )
+		{
+		*traced = true;
+		*trace = RequestTrace();
+		trace->server_received = received;
+		trace->processed = current_time();
+		}
+
+	nn_freemsg(buf);
+	}
+
+// Publication rates are measured between samples at least this far apart.
+static const double rate_sample_interval = 1;
+
+// Subscription prefix of published stats.  Publications proper start with '#'.
+static const string stats_prefix = "STATS ";
+
 bool nnc::AuthoritativeBackend::AddFrontend(AuthoritativeFrontend* frontend)
 	{
 	using vt = decltype(frontends)::value_type;
-	return frontends.insert(vt(frontend->Topic(), frontend)).second;
+
+	if ( ! frontends.insert(vt(frontend->Topic(), frontend)).second )
+		return false;
+
+	set_by_id(&frontends_by_id, frontend->TopicId(), frontend);
+	return true;
+	}
+
+AuthoritativeFrontend*
+nnc::AuthoritativeBackend::FindFrontend(const string& topic,
+                                        uint32_t topic_id) const
+	{
+	if ( topic_id )
+		return get_by_id(frontends_by_id, topic_id);
+
+	auto it = frontends.find(topic);
+	return it == frontends.end() ? nullptr : it->second;
 	}
 
 bool nnc::AuthoritativeBackend::RemFrontend(AuthoritativeFrontend* frontend)
 	{
+	snapshot_cache.erase(frontend->Topic());
+
+	if ( get_by_id(frontends_by_id, frontend->TopicId()) == frontend )
+		frontends_by_id[frontend->TopicId()] = nullptr;
+
+	topic_counters.erase(frontend->Topic());
+	prefix_counts.erase(frontend->Topic());
+
 	return frontends.erase(frontend->Topic()) == 1;
 	}
 
+unique_ptr<Response>
+nnc::AuthoritativeBackend::SnapshotReply(const AuthoritativeFrontend* fe,
+                                         const SnapshotRequest& request)
+	{
+	const key_type& key_prefix = request.KeyPrefix();
+	uint64_t first_buffered = request.FirstBuffered();
+	double t = current_time();
+	TopicStats& ts = topic_counters[fe->Topic()].stats;
+	++ts.snapshots_served;
+
+	// The requester counts on heartbeats to notice missed publications.
+	if ( ! key_prefix.empty() )
+		{
+		auto& counts = prefix_counts[fe->Topic()];
+
+		if ( counts.size() < max_tracked_prefixes )
+			counts.emplace(key_prefix, 0);
+		}
+
+	auto it = key_prefix.empty() ? snapshot_cache.find(fe->Topic())
+	                             : snapshot_cache.end();
+
+	if ( it != snapshot_cache.end() )
+		{
+		const CachedSnapshot& cs = it->second;
+
+		// An older snapshot would leave the requester missing whatever
+		// was published between it and the buffered publications.
+		if ( cs.sequence == fe->Sequence() ||
+		     (t - cs.creation_time <= snapshot_cache_window &&
+		      first_buffered && cs.sequence + 1 >= first_buffered) )
+			{
+			++ts.snapshot_cache_hits;
+			ts.snapshot_bytes += cs.msg->size();
+			Metrics::Add(METRIC_SNAPSHOTS_SERVED);
+			Metrics::Add(METRIC_SNAPSHOT_CACHE_HITS);
+			return unique_ptr<Response>(new EncodedResponse(cs.msg));
+			}
+		}
+
+	auto snapshot = fe->Snapshot(key_prefix);
+	auto msg = snapshot->SharedMsg();
+
+	if ( key_prefix.empty() )
+		{
+		CachedSnapshot& cs = snapshot_cache[fe->Topic()];
+		cs.sequence = fe->Sequence();
+		cs.creation_time = t;
+		cs.msg = msg;
+		}
+
+	double encode_time = current_time() - t;
+	ts.snapshot_bytes += msg->size();
+	ts.snapshot_seconds += encode_time;
+	Metrics::Add(METRIC_SNAPSHOTS_SERVED);
+	Metrics::Record(HIST_SNAPSHOT_ENCODE_NS, encode_time * 1e9);
+	Metrics::Record(HIST_SNAPSHOT_BYTES, msg->size());
+	return snapshot;
+	}
+
+TopicStats
+nnc::AuthoritativeBackend::StatsFor(const AuthoritativeFrontend* fe) const
+	{
+	auto it = topic_counters.find(fe->Topic());
+	TopicStats rval = it == topic_counters.end() ? TopicStats()
+	                                             : it->second.stats;
+	rval.topic = fe->Topic();
+	rval.topic_id = fe->TopicId();
+	rval.keys = fe->SizeSync();
+	rval.sequence = fe->Sequence();
+	return rval;
+	}
+
+BackendStats
+nnc::AuthoritativeBackend::Stats(const AuthoritativeFrontend* frontend) const
+	{
+	BackendStats rval;
+	rval.publications_queued = publications.size();
+
+	if ( listening )
+		{
+		rval.uptime = current_time() - listen_time;
+		uint64_t c = nn_get_statistic(pub_socket,
+		                              NN_STAT_CURRENT_CONNECTIONS);
+
+		if ( c != uint64_t(-1) )
+			rval.connections = c;
+		}
+
+	if ( frontend )
+		rval.topics.push_back(StatsFor(frontend));
+	else
+		{
+		for ( const auto& f : frontends )
+			rval.topics.push_back(StatsFor(f.second));
+
+		sort(rval.topics.begin(), rval.topics.end(),
+		     [](const TopicStats& a, const TopicStats& b)
+		         { return a.topic < b.topic; });
+		}
+
+	return rval;
+	}
+
+void nnc::AuthoritativeBackend::SampleRates(double now)
+	{
+	if ( now < next_rate_sample )
+		return;
+
+	next_rate_sample = now + rate_sample_interval;
+
+	for ( const auto& f : frontends )
+		{
+		TopicCounters& tc = topic_counters[f.first];
+		uint64_t seq = f.second->Sequence();
+
+		if ( tc.sampled_time > 0 )
+			{
+			uint64_t n = seq > tc.sampled_sequence ? seq - tc.sampled_sequence
+			                                       : 0;
+			tc.stats.publication_rate = n / (now - tc.sampled_time);
+			}
+
+		tc.sampled_sequence = seq;
+		tc.sampled_time = now;
+		}
+	}
+
 bool nnc::AuthoritativeBackend::Listen(const string& reply_addr,
                                        const string& pub_addr,
                                        const string& pull_addr)
@@ -98,17 +450,141 @@ bool nnc::AuthoritativeBackend::Listen(const string& reply_addr,
 		return false;
 
 	listening = true;
+	listen_time = current_time();
+	return true;
+	}
+
+nnc::AuthoritativeBackend::~AuthoritativeBackend()
+	{
+	Metrics::AddGauge(GAUGE_PUBLICATIONS_QUEUED, -int64_t(publications.size()));
+	Metrics::AddGauge(GAUGE_PUBLICATIONS_QUEUED_BYTES,
+	                  -int64_t(publication_bytes));
+	}
+
+bool nnc::AuthoritativeBackend::SetPublicationLimits(const QueueLimits& limits)
+	{
+	if ( limits.policy == QUEUE_CONFLATE )
+		return false;
+
+	publication_limits = limits;
 	return true;
 	}
 
+bool nnc::AuthoritativeBackend::AdmitPublication()
+	{
+	if ( applying_update )
+		return true;
+
+	auto full = [this]()
+		{ return at_limits(publication_limits, publications.size(),
+		                   publication_bytes); };
+
+	return admit(this, publication_limits, full,
+	             METRIC_PUBLICATION_QUEUE_REJECTS,
+	             METRIC_PUBLICATION_QUEUE_BLOCKS);
+	}
+
 bool nnc::AuthoritativeBackend::Publish(shared_ptr<Publication> publication)
 	{
+	size_t size = publication->Msg().size();
 	publications.push(publication);
+	publication_bytes += size;
+	Metrics::AddGauge(GAUGE_PUBLICATIONS_QUEUED, 1);
+	Metrics::AddGauge(GAUGE_PUBLICATIONS_QUEUED_BYTES, size);
+
+	if ( ! prefix_counts.empty() )
+		CountForPrefixes(*publication);
+
+	// A marker will follow for replicas that can't notice the gap.
+	if ( publication_limits.policy == QUEUE_DROP_OLDEST )
+		{
+		while ( publications.size() > 1 &&
+		        over_limits(publication_limits, publications.size(),
+		                    publication_bytes) )
+			{
+			dropped_topics.insert(publications.front()->Topic());
+			PopPublication();
+			Metrics::Add(METRIC_PUBLICATION_QUEUE_DROPS);
+			}
+		}
+
 	return true;
 	}
 
+// Publications about several keys are topic-wide, so only those about a
+// single key can be filtered out by a prefix.
+void nnc::AuthoritativeBackend::CountForPrefixes(const Publication& publication)
+	{
+	auto vp = message_cast<ValUpdatePublication>(&publication);
+
+	if ( ! vp )
+		return;
+
+	auto it = prefix_counts.find(publication.Topic());
+
+	if ( it == prefix_counts.end() )
+		return;
+
+	for ( auto& pc : it->second )
+		if ( vp->Key().compare(0, pc.first.size(), pc.first) == 0 )
+			++pc.second;
+	}
+
+void nnc::AuthoritativeBackend::PublishHeartbeats()
+	{
+	for ( const auto& tc : prefix_counts )
+		{
+		auto fe = FindFrontend(tc.first, 0);
+
+		if ( ! fe )
+			continue;
+
+		auto hb = make_pooled<HeartbeatPublication>(tc.first, fe->Sequence());
+		hb->SetTopicId(fe->TopicId());
+
+		for ( const auto& pc : tc.second )
+			hb->Add(pc.first, pc.second);
+
+		// Queued behind the publications it counts.
+		Publish(hb);
+		}
+	}
+
+// At most one marker per topic each round, however many publications
+// were dropped.  Markers dropped in turn are published again next round.
+void nnc::AuthoritativeBackend::PublishDropMarkers()
+	{
+	unordered_set<string> topics;
+	topics.swap(dropped_topics);
+
+	for ( const auto& topic : topics )
+		{
+		auto fe = FindFrontend(topic, 0);
+
+		if ( ! fe )
+			continue;
+
+		auto dp = make_pooled<DropPublication>(topic, fe->Sequence());
+		dp->SetTopicId(fe->TopicId());
+		Publish(dp);
+		}
+	}
+
+void nnc::AuthoritativeBackend::PopPublication()
+	{
+	size_t size = publications.front()->Msg().size();
+	publication_bytes -= size;
+	Metrics::AddGauge(GAUGE_PUBLICATIONS_QUEUED, -1);
+	Metrics::AddGauge(GAUGE_PUBLICATIONS_QUEUED_BYTES, -int64_t(size));
+	publications.pop();
+	}
+
 bool nnc::AuthoritativeBackend::DoProcessIO()
 	{
+	MetricsTimer timer(HIST_PROCESS_IO_NS);
+	double now = current_time();
+	SampleRates(now);
+
 	// Try to read an update and process it.
 	char* buf = nullptr;
 	int n = nn_recv(pul_socket, &buf, NN_MSG, NN_DONTWAIT);
@@ -117,55 +593,65 @@ bool nnc::AuthoritativeBackend::DoProcessIO()
 		handle_nn_error("Failed to pull and update: %s\n");
 	else
 		{
+		Metrics::Add(METRIC_BYTES_RECEIVED, n);
 		auto update = Update::Parse(buf, n);
-		decltype(frontends)::const_iterator it;
-		it = update ? frontends.find(update->Topic()) : frontends.end();
+		auto fe = update ? FindFrontend(update->Topic(), update->TopicId())
+		                 : nullptr;
 
-		if ( it != frontends.end() )
-			update->Process(it->second);
+		if ( fe )
+			{
+			applying_update = true;
+			bool applied = update->Process(fe);
+			applying_update = false;
+			Metrics::Add(applied ? METRIC_UPDATES_APPLIED
+			                     : METRIC_UPDATES_REJECTED);
+			}
 
 		nn_freemsg(buf);
 		}
 
 	// Try to handle requests.
-	if ( pending_response )
-		{
-		const string& msg = pending_response->Msg();
-		int n = nn_send(rep_socket, msg.data(), msg.size(), NN_DONTWAIT);
-
-		if ( n < 0 )
-			handle_nn_error("Failed sending response: %s\n");
-		else
-			pending_response = nullptr;
-		}
+	send_response(rep_socket, &pending_response, &pending_traced,
+	              &pending_trace);
 
 	if ( ! pending_response )
-		{
-		char* buf = nullptr;
-		int n = nn_recv(rep_socket, &buf, NN_MSG, NN_DONTWAIT);
-
-		if ( n < 0 )
-			handle_nn_error("Failed to receive request: %s\n");
-		else
+		receive_request(rep_socket, &pending_response, &pending_traced,
+		                &pending_trace, [this](const Request* request)
 			{
-			auto request = Request::Parse(buf, n);
+			auto fe = FindFrontend(request->Topic(), request->TopicId());
+			bool all_topics = request->Topic().empty() &&
+			                  ! request->TopicId();
 
-			if ( ! request )
-				pending_response =
-				        unique_ptr<Response>(new InvalidRequestResponse());
-			else
-				{
-				decltype(frontends)::const_iterator it;
-				it = frontends.find(request->Topic());
+			if ( message_cast<StatsRequest>(request) &&
+			     (fe || all_topics) )
+				return unique_ptr<Response>(new StatsResponse(Stats(fe)));
 
-				if ( it != frontends.end() )
-					pending_response = request->Process(it->second);
-				}
+			if ( ! fe )
+				return unique_ptr<Response>(
+				        new InvalidRequestResponse("unknown topic"));
 
-			nn_freemsg(buf);
-			}
+			// Snapshots are answered from a cache so a burst of
+			// resyncing subscribers doesn't re-encode the store.
+			auto sr = message_cast<SnapshotRequest>(request);
+
+			if ( sr )
+				return SnapshotReply(fe, *sr);
+
+			if ( message_cast<TopicIdRequest>(request) )
+				++topic_counters[fe->Topic()].stats.joins;
+
+			return request->Process(fe);
+			});
+
+	if ( heartbeat_interval > 0 && now >= next_heartbeat )
+		{
+		next_heartbeat = now + heartbeat_interval;
+		PublishHeartbeats();
 		}
 
+	if ( ! dropped_topics.empty() )
+		PublishDropMarkers();
+
 	// Try to write all publications.
 	while ( ! publications.empty() )
 		{
@@ -178,7 +664,29 @@ bool nnc::AuthoritativeBackend::DoProcessIO()
 			break;
 			}
 
-		publications.pop();
+		Metrics::Add(METRIC_BYTES_SENT, n);
+		PopPublication();
+		}
+
+	// Stats wait behind publications, a newer one replacing any left unsent.
+	if ( stats_interval > 0 && now >= next_stats )
+		{
+		next_stats = now + stats_interval;
+		pending_stats = StatsResponse(Stats()).SharedMsg();
+		}
+
+	if ( pending_stats && publications.empty() )
+		{
+		int n = nn_send(pub_socket, pending_stats->data(),
+		                pending_stats->size(), NN_DONTWAIT);
+
+		if ( n < 0 )
+			handle_nn_error("Failed to publish stats: %s\n");
+		else
+			{
+			Metrics::Add(METRIC_BYTES_SENT, n);
+			pending_stats = nullptr;
+			}
 		}
 
 	return HasPendingOutput();
@@ -186,7 +694,7 @@ bool nnc::AuthoritativeBackend::DoProcessIO()
 
 bool nnc::AuthoritativeBackend::DoHasPendingOutput() const
 	{
-	return ! publications.empty() || pending_response;
+	return ! publications.empty() || pending_response || pending_stats;
 	}
 
 bool nnc::AuthoritativeBackend::DoGetSelectParams(
@@ -209,7 +717,7 @@ bool nnc::AuthoritativeBackend::DoGetSelectParams(
 
 	if ( writefds )
 		{
-		if ( ! publications.empty() )
+		if ( ! publications.empty() || pending_stats )
 			{
 			if ( ! set_nn_fds(pub_socket, NN_SNDFD, writefds, &maxfd) )
 				return false;
@@ -222,6 +730,12 @@ bool nnc::AuthoritativeBackend::DoGetSelectParams(
 			}
 		}
 
+	if ( timeout && stats_interval > 0 )
+		min_timeout(timeout, to_timeval(next_stats - current_time()));
+
+	if ( timeout && heartbeat_interval > 0 && ! prefix_counts.empty() )
+		min_timeout(timeout, to_timeval(next_heartbeat - current_time()));
+
 	if ( maxfd >= 0 )
 		*nfds = maxfd + 1;
 
@@ -243,16 +757,70 @@ bool nnc::NonAuthoritativeBackend::AddFrontend(NonAuthoritativeFrontend* fe)
 	{
 	using vt = decltype(frontends)::value_type;
 	string t = fe->Topic();
-	nn_setsockopt(sub_socket, NN_SUB, NN_SUB_SUBSCRIBE, t.c_str(), t.size());
-	SendRequest(new SnapshotRequest(t));
-	return frontends.insert(vt(t, fe)).second;
+
+	if ( ! frontends.insert(vt(t, fe)).second )
+		return false;
+
+	// Subscribing and requesting a snapshot wait on the topic's ID.
+	SendRequest(new TopicIdRequest(t));
+	return true;
 	}
 
 bool nnc::NonAuthoritativeBackend::RemFrontend(NonAuthoritativeFrontend* fe)
 	{
-	string t = fe->Topic();
-	nn_setsockopt(sub_socket, NN_SUB, NN_SUB_UNSUBSCRIBE, t.c_str(), t.size());
-	return frontends.erase(t) == 1;
+	uint32_t id = fe->TopicId();
+
+	if ( id && get_by_id(frontends_by_id, id) == fe )
+		{
+		for ( const auto& s : fe->Subscriptions(id) )
+			nn_setsockopt(sub_socket, NN_SUB, NN_SUB_UNSUBSCRIBE, s.data(),
+			              s.size());
+
+		frontends_by_id[id] = nullptr;
+		}
+
+	snapshot_cache.erase(fe->Topic());
+	return frontends.erase(fe->Topic()) == 1;
+	}
+
+bool nnc::NonAuthoritativeBackend::Resubscribe(NonAuthoritativeFrontend* fe,
+                                               uint32_t old_id)
+	{
+	if ( old_id && get_by_id(frontends_by_id, old_id) == fe )
+		{
+		for ( const auto& s : fe->Subscriptions(old_id) )
+			nn_setsockopt(sub_socket, NN_SUB, NN_SUB_UNSUBSCRIBE, s.data(),
+			              s.size());
+
+		frontends_by_id[old_id] = nullptr;
+		}
+
+	// Cached snapshots carry the old ID.
+	snapshot_cache.erase(fe->Topic());
+	uint32_t id = fe->TopicId();
+
+	if ( ! id )
+		return false;
+
+	for ( const auto& s : fe->Subscriptions(id) )
+		nn_setsockopt(sub_socket, NN_SUB, NN_SUB_SUBSCRIBE, s.data(), s.size());
+
+	set_by_id(&frontends_by_id, id, fe);
+	return true;
+	}
+
+bool nnc::NonAuthoritativeBackend::SubscribeKey(
+        const NonAuthoritativeFrontend* fe, const key_type& key, bool subscribe)
+	{
+	uint32_t id = fe->TopicId();
+
+	// Until subscribed under an ID, Resubscribe() covers the key.
+	if ( ! id || get_by_id(frontends_by_id, id) != fe )
+		return false;
+
+	string s = Publication::KeySubscription(id, key);
+	int opt = subscribe ? NN_SUB_SUBSCRIBE : NN_SUB_UNSUBSCRIBE;
+	return nn_setsockopt(sub_socket, NN_SUB, opt, s.data(), s.size()) == 0;
 	}
 
 bool nnc::NonAuthoritativeBackend::Connect(const string& request_addr,
@@ -272,20 +840,294 @@ bool nnc::NonAuthoritativeBackend::Connect(const string& request_addr,
 	return true;
 	}
 
-bool nnc::NonAuthoritativeBackend::SendRequest(Request* request)
+bool nnc::NonAuthoritativeBackend::ServeReads(const string& reply_addr)
+	{
+	if ( rep_socket >= 0 )
+		return false;
+
+	return setup_sockets({NN_REP}, {reply_addr}, {&rep_socket}, nn_bind);
+	}
+
+bool nnc::NonAuthoritativeBackend::Relay(const string& pub_addr)
+	{
+	if ( rel_socket >= 0 )
+		return false;
+
+	return setup_sockets({NN_PUB}, {pub_addr}, {&rel_socket}, nn_bind);
+	}
+
+unique_ptr<Response>
+nnc::NonAuthoritativeBackend::SnapshotReply(const NonAuthoritativeFrontend* fe,
+                                            const key_type& key_prefix)
 	{
-	requests.push_back(unique_ptr<Request>(request));
+	Metrics::Add(METRIC_SNAPSHOTS_SERVED);
+
+	// While no publication arrives, resyncing requesters share one encoding.
+	auto it = key_prefix.empty() ? snapshot_cache.find(fe->Topic())
+	                             : snapshot_cache.end();
+
+	if ( it != snapshot_cache.end() && it->second.sequence == fe->Sequence() )
+		{
+		Metrics::Add(METRIC_SNAPSHOT_CACHE_HITS);
+		return unique_ptr<Response>(new EncodedResponse(it->second.msg));
+		}
+
+	double t = current_time();
+	auto snapshot = fe->Snapshot(key_prefix);
+	auto msg = snapshot->SharedMsg();
+
+	if ( key_prefix.empty() )
+		{
+		CachedSnapshot& cs = snapshot_cache[fe->Topic()];
+		cs.sequence = fe->Sequence();
+		cs.creation_time = t;
+		cs.msg = msg;
+		}
+
+	Metrics::Record(HIST_SNAPSHOT_ENCODE_NS, (current_time() - t) * 1e9);
+	Metrics::Record(HIST_SNAPSHOT_BYTES, msg->size());
+	return snapshot;
+	}
+
+unique_ptr<Response>
+nnc::NonAuthoritativeBackend::ReadReply(const Request* request)
+	{
+	// Topic IDs are the authoritative side's, as are the frontends'.
+	NonAuthoritativeFrontend* fe = nullptr;
+
+	if ( request->TopicId() )
+		fe = get_by_id(frontends_by_id, request->TopicId());
+	else
+		{
+		auto it = frontends.find(request->Topic());
+
+		if ( it != frontends.end() )
+			fe = it->second;
+		}
+
+	const char* error = nullptr;
+
+	if ( ! fe )
+		error = "unknown topic";
+	else if ( ! fe->KeyPrefix().empty() || fe->CounterMode() ||
+	          fe->PartialReplica() )
+		error = "partial replica";
+	else if ( ! fe->Synchronized() )
+		// Requesters retry snapshots and topic IDs later.
+		error = "replica not synchronized";
+
+	unique_ptr<Response> response;
+
+	if ( ! error )
+		{
+		auto sr = message_cast<SnapshotRequest>(request);
+		response = sr ? SnapshotReply(fe, sr->KeyPrefix())
+		              : request->ProcessRead(fe);
+
+		if ( ! response )
+			error = "not served by read replicas";
+		}
+
+	if ( error )
+		{
+		Metrics::Add(METRIC_REPLICA_READS_REJECTED);
+		return unique_ptr<Response>(new InvalidRequestResponse(error));
+		}
+
+	Metrics::Add(METRIC_REPLICA_READS);
+	return response;
+	}
+
+nnc::NonAuthoritativeBackend::~NonAuthoritativeBackend()
+	{
+	Metrics::AddGauge(GAUGE_REQUESTS_QUEUED, -int64_t(requests.size()));
+	Metrics::AddGauge(GAUGE_REQUESTS_QUEUED_BYTES, -int64_t(request_bytes));
+	Metrics::AddGauge(GAUGE_UPDATES_QUEUED, -int64_t(updates.size()));
+	Metrics::AddGauge(GAUGE_UPDATES_QUEUED_BYTES, -int64_t(update_bytes));
+	}
+
+bool nnc::NonAuthoritativeBackend::SetUpdateLimits(const QueueLimits& limits)
+	{
+	update_limits = limits;
+
+	if ( limits.policy != QUEUE_CONFLATE )
+		conflatable.clear();
+
+	return true;
+	}
+
+bool nnc::NonAuthoritativeBackend::SetRequestLimits(const QueueLimits& limits)
+	{
+	if ( limits.policy != QUEUE_REJECT && limits.policy != QUEUE_BLOCK )
+		return false;
+
+	request_limits = limits;
 	return true;
 	}
 
-bool nnc::NonAuthoritativeBackend::SendUpdate(Update* update)
+bool nnc::NonAuthoritativeBackend::SendRequest(Request* arg_request)
 	{
-	updates.push(unique_ptr<Update>(update));
+	unique_ptr<Request> request(arg_request);
+	auto full = [this]()
+		{ return at_limits(request_limits, requests.size(), request_bytes); };
+
+	if ( request->Expires() &&
+	     ! admit(this, request_limits, full, METRIC_REQUEST_QUEUE_REJECTS,
+	             METRIC_REQUEST_QUEUE_BLOCKS) )
+		return false;
+
+	if ( trace_sink )
+		{
+		request->SetTraced(true);
+		request->Trace().created = request->CreationTime();
+		}
+
+	size_t size = request->Msg().size();
+	requests.push_back(move(request));
+	request_bytes += size;
+	Metrics::AddGauge(GAUGE_REQUESTS_QUEUED, 1);
+	Metrics::AddGauge(GAUGE_REQUESTS_QUEUED_BYTES, size);
+	return true;
+	}
+
+NonAuthoritativeBackend::request_list::iterator
+nnc::NonAuthoritativeBackend::EraseRequest(request_list::iterator it)
+	{
+	size_t size = (*it)->Msg().size();
+	request_bytes -= size;
+	Metrics::AddGauge(GAUGE_REQUESTS_QUEUED, -1);
+	Metrics::AddGauge(GAUGE_REQUESTS_QUEUED_BYTES, -int64_t(size));
+	return requests.erase(it);
+	}
+
+void nnc::NonAuthoritativeBackend::BatchRequests()
+	{
+	// Only the run at the front, so no request overtakes an earlier one.
+	auto end = find_if(requests.begin(), requests.end(),
+	                   [](const unique_ptr<Request>& r)
+		{ return ! r->Batchable(); });
+
+	if ( distance(requests.begin(), end) < 2 )
+		return;
+
+	// None has been sent, as only the front request ever is.
+	unique_ptr<BatchRequest> batch(new BatchRequest());
+	size_t n = 0;
+	size_t bytes = 0;
+
+	for ( auto it = requests.begin(); it != end; ++it )
+		{
+		++n;
+		bytes += (*it)->Msg().size();
+		batch->Add(move(*it));
+		}
+
+	requests.erase(requests.begin(), end);
+
+	if ( trace_sink )
+		{
+		batch->SetTraced(true);
+		batch->Trace().created = batch->CreationTime();
+		}
+
+	size_t size = batch->Msg().size();
+	request_bytes = request_bytes - bytes + size;
+	Metrics::AddGauge(GAUGE_REQUESTS_QUEUED, 1 - int64_t(n));
+	Metrics::AddGauge(GAUGE_REQUESTS_QUEUED_BYTES,
+	                  int64_t(size) - int64_t(bytes));
+	requests.push_front(move(batch));
+	}
+
+bool nnc::NonAuthoritativeBackend::SendUpdate(Update* arg_update)
+	{
+	unique_ptr<Update> update(arg_update);
+	const key_type* key = update_limits.policy == QUEUE_CONFLATE ?
+	                      update->OverwrittenKey() : nullptr;
+	string conflation_key;
+
+	// A later write of a key's whole state makes a queued one redundant.
+	if ( key )
+		{
+		conflation_key = update->Topic() + " " + *key;
+		auto it = conflatable.find(conflation_key);
+
+		if ( it != conflatable.end() )
+			{
+			EraseUpdate(it->second);
+			Metrics::Add(METRIC_UPDATE_QUEUE_CONFLATIONS);
+			}
+		}
+
+	auto full = [this]()
+		{ return at_limits(update_limits, updates.size(), update_bytes); };
+
+	if ( ! admit(this, update_limits, full, METRIC_UPDATE_QUEUE_REJECTS,
+	             METRIC_UPDATE_QUEUE_BLOCKS) )
+		return false;
+
+	size_t size = update->Msg().size();
+	updates.push_back(move(update));
+	update_bytes += size;
+	Metrics::AddGauge(GAUGE_UPDATES_QUEUED, 1);
+	Metrics::AddGauge(GAUGE_UPDATES_QUEUED_BYTES, size);
+
+	if ( key )
+		conflatable[conflation_key] = prev(updates.end());
+
+	if ( update_limits.policy == QUEUE_DROP_OLDEST ||
+	     update_limits.policy == QUEUE_CONFLATE )
+		{
+		while ( updates.size() > 1 &&
+		        over_limits(update_limits, updates.size(), update_bytes) )
+			{
+			EraseUpdate(updates.begin());
+			Metrics::Add(METRIC_UPDATE_QUEUE_DROPS);
+			}
+		}
+
+	return true;
+	}
+
+NonAuthoritativeBackend::update_list::iterator
+nnc::NonAuthoritativeBackend::EraseUpdate(update_list::iterator it)
+	{
+	const Update& u = **it;
+	size_t size = (*it)->Msg().size();
+	update_bytes -= size;
+	Metrics::AddGauge(GAUGE_UPDATES_QUEUED, -1);
+	Metrics::AddGauge(GAUGE_UPDATES_QUEUED_BYTES, -int64_t(size));
+
+	if ( ! conflatable.empty() && u.OverwrittenKey() )
+		{
+		auto c = conflatable.find(u.Topic() + " " + *u.OverwrittenKey());
+
+		if ( c != conflatable.end() && c->second == it )
+			conflatable.erase(c);
+		}
+
+	return updates.erase(it);
+	}
+
+bool nnc::NonAuthoritativeBackend::SubscribeStats(stats_cb cb)
+	{
+	if ( ! connected )
+		return false;
+
+	if ( cb && ! stats_callback )
+		nn_setsockopt(sub_socket, NN_SUB, NN_SUB_SUBSCRIBE,
+		              stats_prefix.data(), stats_prefix.size());
+	else if ( ! cb && stats_callback )
+		nn_setsockopt(sub_socket, NN_SUB, NN_SUB_UNSUBSCRIBE,
+		              stats_prefix.data(), stats_prefix.size());
+
+	stats_callback = cb;
 	return true;
 	}
 
 bool nnc::NonAuthoritativeBackend::DoProcessIO()
 	{
+	MetricsTimer timer(HIST_PROCESS_IO_NS);
+
 	// Try to send all updates.
 	while ( ! updates.empty() )
 		{
@@ -298,14 +1140,24 @@ bool nnc::NonAuthoritativeBackend::DoProcessIO()
 			break;
 			}
 
-		updates.pop();
+		Metrics::Add(METRIC_BYTES_SENT, n);
+		EraseUpdate(updates.begin());
 		}
 
 	// Drop any requests that have timed out.
 	for ( auto it = requests.begin(); it != requests.end(); )
 		{
 		if ( (*it)->TimedOut() )
-			it = requests.erase(it);
+			{
+			if ( (*it)->Traced() && trace_sink )
+				trace_sink(**it, (*it)->Trace());
+
+			if ( it == requests.begin() )
+				last_dequeue = current_time();
+
+			Metrics::Add(METRIC_REQUEST_TIMEOUTS);
+			it = EraseRequest(it);
+			}
 		else
 			++it;
 		}
@@ -322,34 +1174,69 @@ bool nnc::NonAuthoritativeBackend::DoProcessIO()
 				handle_nn_error("Failed to receive response: %s\n");
 			else
 				{
-				auto response = Response::Parse(buf, n);
-
-				if ( response )
+				Metrics::Add(METRIC_BYTES_RECEIVED, n);
+				Request* request = requests.front().get();
+				RequestTrace& trace = request->Trace();
+				trace.received = current_time();
+				const char* msg = buf;
+				size_t size = n;
+				unique_ptr<Response> response;
+
+				// Requests report a response that failed to parse.
+				if ( decode_traced_response(&msg, &size, &trace) )
+					response = Response::Parse(msg, size);
+
+				auto find = [this](const string& topic)
 					{
-					NonAuthoritativeFrontend* frontend = nullptr;
-					decltype(frontends)::const_iterator it;
-					it = frontends.find(requests.front()->Topic());
+					auto it = frontends.find(topic);
+					return it == frontends.end() ? nullptr : it->second;
+					};
+
+				auto batch = message_cast<BatchRequest>(request);
 
-					if ( it != frontends.end() )
-						frontend = it->second;
+				if ( batch )
+					batch->ProcessEach(move(response), find);
+				else
+					request->Process(move(response), find(request->Topic()));
 
-					requests.front()->Process(move(response), frontend);
-					}
+				if ( request->Traced() && trace_sink )
+					trace_sink(*request, trace);
 
-				requests.pop_front();
+				last_dequeue = trace.received;
+				EraseRequest(requests.begin());
 				nn_freemsg(buf);
 				}
 			}
 		else
 			{
 			// Try to send a request.
-			const string& msg = requests.front()->Msg();
-			int n = nn_send(req_socket, msg.data(), msg.size(), NN_DONTWAIT);
+			if ( requests.front()->Batchable() )
+				BatchRequests();
+
+			Request* request = requests.front().get();
+			const string* msg = &request->Msg();
+			string traced;
+
+			if ( request->Traced() )
+				{
+				RequestTrace& trace = request->Trace();
+				trace.ready = max(trace.created, last_dequeue);
+				traced = "!" + *msg;
+				msg = &traced;
+				}
+
+			int n = nn_send(req_socket, msg->data(), msg->size(), NN_DONTWAIT);
 
 			if ( n < 0 )
 				handle_nn_error("Failed sending request: %s\n");
 			else
-				requests.front()->MarkAsSent();
+				{
+				Metrics::Add(METRIC_BYTES_SENT, n);
+				request->MarkAsSent();
+
+				if ( request->Traced() )
+					request->Trace().sent = current_time();
+				}
 			}
 		}
 
@@ -361,22 +1248,71 @@ bool nnc::NonAuthoritativeBackend::DoProcessIO()
 		handle_nn_error("Failed to receive subscription: %s\n");
 	else
 		{
-		auto pub = Publication::Parse(buf, n);
-		decltype(frontends)::const_iterator it;
-		it = pub ? frontends.find(pub->Topic()) : frontends.end();
+		Metrics::Add(METRIC_BYTES_RECEIVED, n);
 
-		if ( it != frontends.end() )
-			it->second->ProcessPublication(move(pub));
+		size_t sps = stats_prefix.size();
 
-		nn_freemsg(buf);
+		if ( size_t(n) >= sps && stats_prefix.compare(0, sps, buf, sps) == 0 )
+			{
+			auto response = Response::Parse(buf, n);
+			auto sr = message_cast<StatsResponse>(response.get());
+
+			if ( stats_callback )
+				{
+				if ( sr )
+					stats_callback(sr->Stats(), ASYNC_SUCCESS);
+				else
+					stats_callback(BackendStats(), ASYNC_INVALID_RESPONSE);
+				}
+			}
+		else
+			{
+			auto pub = Publication::Parse(buf, n);
+			auto fe = pub ? get_by_id(frontends_by_id, pub->TopicId())
+			              : nullptr;
+
+			if ( fe )
+				fe->ProcessPublication(move(pub));
+			}
+
+		if ( rel_socket < 0 )
+			nn_freemsg(buf);
+		// Passing the received buffer on avoids a copy.  Subscribers
+		// resynchronize after a frame the PUB socket couldn't take.
+		else if ( nn_send(rel_socket, &buf, NN_MSG, NN_DONTWAIT) < 0 )
+			{
+			handle_nn_error("Failed to relay publication: %s\n");
+			Metrics::Add(METRIC_RELAY_DROPS);
+			nn_freemsg(buf);
+			}
+		else
+			{
+			Metrics::Add(METRIC_BYTES_SENT, n);
+			Metrics::Add(METRIC_FRAMES_RELAYED);
+			}
+		}
+
+	// Try to serve reads.
+	if ( rep_socket >= 0 )
+		{
+		send_response(rep_socket, &pending_response, &pending_traced,
+		              &pending_trace);
+
+		if ( ! pending_response )
+			receive_request(rep_socket, &pending_response, &pending_traced,
+			                &pending_trace, [this](const Request* request)
+				{ return ReadReply(request); });
 		}
 
+	for ( auto& f : frontends )
+		f.second->ProcessTimers();
+
 	return HasPendingOutput();
 	}
 
 bool nnc::NonAuthoritativeBackend::DoHasPendingOutput() const
 	{
-	if ( ! updates.empty() )
+	if ( ! updates.empty() || pending_response )
 		return true;
 
 	if ( requests.empty() )
@@ -388,15 +1324,6 @@ bool nnc::NonAuthoritativeBackend::DoHasPendingOutput() const
 	return true;
 	}
 
-static bool less_time(timeval t1, timeval t2)
-	{
-	if ( t1.tv_sec < t2.tv_sec )
-		return true;
-	if ( t1.tv_sec == t2.tv_sec )
-		return t1.tv_usec < t2.tv_usec;
-	return false;
-	}
-
 bool nnc::NonAuthoritativeBackend::DoGetSelectParams(
         int* nfds, fd_set* readfds, fd_set* writefds, fd_set* errorfds,
         unique_ptr<timeval>* timeout) const
@@ -413,10 +1340,20 @@ bool nnc::NonAuthoritativeBackend::DoGetSelectParams(
 
 		if ( ! set_nn_fds(sub_socket, NN_RCVFD, readfds, &maxfd) )
 			return false;
+
+		if ( rep_socket >= 0 &&
+		     ! set_nn_fds(rep_socket, NN_RCVFD, readfds, &maxfd) )
+			return false;
 		}
 
 	if ( writefds )
 		{
+		if ( pending_response )
+			{
+			if ( ! set_nn_fds(rep_socket, NN_SNDFD, writefds, &maxfd) )
+				return false;
+			}
+
 		if ( ! updates.empty() )
 			{
 			if ( ! set_nn_fds(psh_socket, NN_SNDFD, writefds, &maxfd) )
@@ -433,17 +1370,19 @@ bool nnc::NonAuthoritativeBackend::DoGetSelectParams(
 	if ( timeout )
 		{
 		if ( ! requests.empty() && requests.front()->Sent() &&
-		     ! dynamic_cast<SnapshotRequest*>(requests.front().get()) )
+		     requests.front()->Expires() )
 			{
-			timeval time_left = requests.front()->UntilTimedOut();
+			min_timeout(timeout, requests.front()->UntilTimedOut());
+			}
 
-			if ( *timeout )
-				{
-				if ( less_time(time_left, *timeout->get()) )
-					timeout->reset(new timeval(time_left));
-				}
-			else
-				timeout->reset(new timeval(time_left));
+		double t = current_time();
+
+		for ( auto& f : frontends )
+			{
+			double deadline;
+
+			if ( f.second->NextDeadline(&deadline) )
+				min_timeout(timeout, to_timeval(deadline - t));
 			}
 		}
 
@@ -461,5 +1400,20 @@ bool nnc::NonAuthoritativeBackend::DoClose()
 	safe_nn_close({req_socket, sub_socket, psh_socket});
 	req_socket = sub_socket = psh_socket = -1;
 	connected = false;
+
+	if ( rel_socket >= 0 )
+		{
+		safe_nn_close(rel_socket);
+		rel_socket = -1;
+		}
+
+	if ( rep_socket >= 0 )
+		{
+		safe_nn_close(rep_socket);
+		rep_socket = -1;
+		pending_response = nullptr;
+		pending_traced = false;
+		}
+
 	return true;
 	}
@@ -2,12 +2,15 @@
 #define NANOCLONE_BACKEND_HPP
 
 #include "messages.hpp"
+#include "pool.hpp"
 
 #include <sys/select.h>
 #include <memory>
 #include <string>
+#include <deque>
 #include <queue>
 #include <list>
+#include <vector>
 #include <unordered_map>
 #include <unordered_set>
 
@@ -17,6 +20,30 @@ class Frontend;
 class AuthoritativeFrontend;
 class NonAuthoritativeFrontend;
 
+// What to do with a message for an outbound queue that's at its limits.
+enum QueuePolicy {
+	QUEUE_REJECT,      // Fail the call, e.g. an Insert returns false.
+	QUEUE_BLOCK,       // Run IO until there's room, rejecting after a timeout.
+	QUEUE_DROP_OLDEST, // Drop the oldest messages to make room.
+	QUEUE_CONFLATE,    // Replace queued writes of the same key, drop if full.
+};
+
+// Limits of 0 mean unlimited.  A queue may exceed max_bytes by a message,
+// as it takes one whenever below the limit.
+struct QueueLimits {
+	size_t max_messages = 0;
+	size_t max_bytes = 0;
+	QueuePolicy policy = QUEUE_REJECT;
+	double block_timeout = 1;
+};
+
+// An encoded SnapshotResponse kept for answering further snapshot requests.
+struct CachedSnapshot {
+	uint64_t sequence;
+	double creation_time;
+	std::shared_ptr<const std::string> msg;
+};
+
 class Backend {
 public:
 
@@ -25,7 +52,12 @@ public:
 	virtual ~Backend() {}
 
 	bool ProcessIO()
-		{ return DoProcessIO(); }
+		{ in_io = true; bool rval = DoProcessIO(); in_io = false; return rval; }
+
+	// Blocking on a queue runs IO, so it isn't done from within ProcessIO(),
+	// e.g. by callbacks.  Queues reject then instead.
+	bool ProcessingIO() const
+		{ return in_io; }
 
 	bool HasPendingOutput() const
 		{ return DoHasPendingOutput(); }
@@ -48,6 +80,8 @@ private:
 	DoGetSelectParams(int* nfds, fd_set* readfds, fd_set* writefds,
 	                  fd_set* errorfds,
 	                  std::unique_ptr<timeval>* timeout) const = 0;
+
+	bool in_io = false;
 };
 
 
@@ -59,7 +93,7 @@ public:
 	// If there are unsent publications, that means any subscribers are
 	// going to be out of sync and have to request a snapshot if an equivalent
 	// backend ever comes back up.
-	virtual ~AuthoritativeBackend() {}
+	virtual ~AuthoritativeBackend();
 
 	bool Listen(const std::string& reply_addr, const std::string& pub_addr,
 	            const std::string& pull_addr);
@@ -73,8 +107,85 @@ public:
 
 	bool Publish(std::shared_ptr<Publication> publication);
 
+	// After dropping publications of a topic, a DropPublication follows
+	// them.  Full replicas notice the gap in sequence numbers and resync,
+	// those limited to a key prefix resync on the marker, and partial
+	// replicas fetch the keys it may concern again.  Conflating isn't
+	// supported, as it would leave the same gaps in sequence numbers.
+	bool SetPublicationLimits(const QueueLimits& limits);
+
+	const QueueLimits& PublicationLimits() const
+		{ return publication_limits; }
+
+	// Whether another publication may be queued, blocking for room if the
+	// policy says so.  Frontends ask before changing their stores, so
+	// rejected changes aren't made at all.  Updates pulled from subscribers
+	// have no way to report a rejection, so they're always admitted, and
+	// only dropping the oldest publications keeps the queue at the limits.
+	bool AdmitPublication();
+
+	// An encoded full-topic snapshot is reused while the topic's sequence is
+	// unchanged.  With a non-zero window, it's also reused for that many
+	// seconds after being built even if the topic changed since, but only
+	// for requesters whose buffered publications pick up right after it
+	// (see SnapshotRequest's first_buffered).  Others get a fresh one.
+	void SetSnapshotCacheWindow(double seconds)
+		{ snapshot_cache_window = seconds; }
+
+	double SnapshotCacheWindow() const
+		{ return snapshot_cache_window; }
+
+	// Reports on all topics, or just on the given frontend's.
+	BackendStats Stats(const AuthoritativeFrontend* frontend = nullptr) const;
+
+	// With a non-zero interval, a StatsResponse is published every that many
+	// seconds for monitoring to subscribe to with the "STATS " prefix.
+	void SetStatsInterval(double seconds)
+		{ stats_interval = seconds; next_stats = 0; }
+
+	double StatsInterval() const
+		{ return stats_interval; }
+
+	// Topics that replicas limited to a key prefix joined get a
+	// HeartbeatPublication every that many seconds (0 disables them), from
+	// which those replicas notice missed publications.  Prefixes are
+	// tracked as their snapshots are served, up to max_tracked_prefixes
+	// per topic.  Replicas with other prefixes, or whose snapshots came
+	// from a read replica, notice only what the queue limits drop.
+	void SetHeartbeatInterval(double seconds)
+		{ heartbeat_interval = seconds; next_heartbeat = 0; }
+
+	double HeartbeatInterval() const
+		{ return heartbeat_interval; }
+
+	static const size_t max_tracked_prefixes = 64;
+
 private:
 
+	struct TopicCounters {
+		TopicStats stats;
+		uint64_t sampled_sequence = 0;
+		double sampled_time = 0;
+	};
+
+	TopicStats StatsFor(const AuthoritativeFrontend* fe) const;
+
+	void PopPublication();
+
+	void SampleRates(double now);
+
+	void CountForPrefixes(const Publication& publication);
+
+	void PublishHeartbeats();
+
+	void PublishDropMarkers();
+
+	std::unique_ptr<Response> SnapshotReply(const AuthoritativeFrontend* fe,
+	                                        const SnapshotRequest& request);
+
+	AuthoritativeFrontend* FindFrontend(const std::string& topic,
+	                                    uint32_t topic_id) const;
+
 	virtual bool DoProcessIO() override;
 	virtual bool DoHasPendingOutput() const override;
 	virtual bool DoClose() override;
@@ -88,8 +199,39 @@ private:
 	int pub_socket = -1;
 	int pul_socket = -1;
 	std::unordered_map<std::string, AuthoritativeFrontend*> frontends;
-	std::queue<std::shared_ptr<Publication>> publications;
+	// Indexed by topic ID.
+	std::vector<AuthoritativeFrontend*> frontends_by_id;
+	std::queue<std::shared_ptr<Publication>,
+	           std::deque<std::shared_ptr<Publication>,
+	                      PoolAllocator<std::shared_ptr<Publication>>>>
+	        publications;
+	size_t publication_bytes = 0;
+	QueueLimits publication_limits;
+	// Topics with publications dropped since markers were last published.
+	std::unordered_set<std::string> dropped_topics;
+	// Set while applying an update pulled from a subscriber.
+	bool applying_update = false;
 	std::unique_ptr<Response> pending_response = nullptr;
+	// Whether pending_response answers a traced request, and its stamps.
+	bool pending_traced = false;
+	RequestTrace pending_trace;
+	// Full-topic snapshots, keyed by topic.  Prefix snapshots aren't cached,
+	// as there could be any number of prefixes.
+	std::unordered_map<std::string, CachedSnapshot> snapshot_cache;
+	double snapshot_cache_window = 0;
+	// Keyed by topic.
+	std::unordered_map<std::string, TopicCounters> topic_counters;
+	double next_rate_sample = 0;
+	double listen_time = 0;
+	double stats_interval = 0;
+	double next_stats = 0;
+	std::shared_ptr<const std::string> pending_stats;
+	// Per topic, the number of publications about keys starting with each
+	// tracked prefix.
+	std::unordered_map<std::string,
+	                   std::unordered_map<key_type, uint64_t>> prefix_counts;
+	double heartbeat_interval = 1;
+	double next_heartbeat = 0;
 };
 
 
@@ -98,7 +240,7 @@ public:
 
 	NonAuthoritativeBackend() = default;
 
-	virtual ~NonAuthoritativeBackend() {}
+	virtual ~NonAuthoritativeBackend();
 
 	bool Connect(const std::string& request_addr, const std::string& sub_addr,
 	             const std::string& push_addr);
@@ -106,16 +248,90 @@ public:
 	bool Connected() const
 		{ return connected; }
 
+	// Makes this a read replica: requests arriving at the reply address are
+	// answered from the synchronized frontends' stores, as of the sequence
+	// each reflects, so clients may send lookups, scans and snapshot requests
+	// here instead of to the authoritative backend.  Anything else, like an
+	// atomic operation, is answered with an error.  Partial replicas and
+	// frontends with a key prefix or in counter mode don't hold the topic as
+	// the authoritative side does, so aren't served.
+	bool ServeReads(const std::string& reply_addr);
+
+	bool ServingReads() const
+		{ return rep_socket >= 0; }
+
+	// Makes this a relay: each frame the SUB socket receives, i.e. the
+	// publications of the frontends' topics and any stats subscribed to, is
+	// published again as is on a PUB socket bound to the address.  With
+	// ServeReads() answering their snapshot requests, subscribers join a
+	// relay as they would the authoritative backend.  Relays may feed
+	// relays, keeping the authoritative side's egress the same however many
+	// subscribers there are.  Relayed frontends shouldn't have a key prefix,
+	// which would leave gaps in the topic's sequence.
+	bool Relay(const std::string& pub_addr);
+
+	bool Relaying() const
+		{ return rel_socket >= 0; }
+
 	bool AddFrontend(NonAuthoritativeFrontend* frontend);
 
 	bool RemFrontend(NonAuthoritativeFrontend* frontend);
 
+	// Moves the frontend's subscriptions from a previous topic ID (0 if
+	// none) to its current one.
+	bool Resubscribe(NonAuthoritativeFrontend* frontend, uint32_t old_id);
+
+	// Adds or drops the subscription to a key a partial replica holds.
+	bool SubscribeKey(const NonAuthoritativeFrontend* frontend,
+	                  const key_type& key, bool subscribe);
+
+	// These return false if the queue's limits rejected the message, in
+	// which case callbacks aren't called.
 	bool SendRequest(Request* request);
 
 	bool SendUpdate(Update* update);
 
+	bool SetUpdateLimits(const QueueLimits& limits);
+
+	const QueueLimits& UpdateLimits() const
+		{ return update_limits; }
+
+	// Only rejecting or blocking, as requests have callbacks waiting on
+	// them.  Requests that don't expire, which keep frontends synchronized,
+	// are never held back.
+	bool SetRequestLimits(const QueueLimits& limits);
+
+	const QueueLimits& RequestLimits() const
+		{ return request_limits; }
+
+	// Traces requests sent from then on, passing their stamps to the sink.
+	// A null sink stops tracing.
+	void SetTraceSink(trace_cb sink)
+		{ trace_sink = sink; }
+
+	// Calls back with each StatsResponse the authoritative backend publishes.
+	// A null callback unsubscribes.
+	bool SubscribeStats(stats_cb cb);
+
 private:
 
+	using update_list = std::list<std::unique_ptr<Update>,
+	                              PoolAllocator<std::unique_ptr<Update>>>;
+	using request_list = std::list<std::unique_ptr<Request>,
+	                               PoolAllocator<std::unique_ptr<Request>>>;
+
+	update_list::iterator EraseUpdate(update_list::iterator it);
+	request_list::iterator EraseRequest(request_list::iterator it);
+
+	// Replaces the topic ID and snapshot requests at the front of the
+	// queue, if there are several, with a BatchRequest.
+	void BatchRequests();
+
+	std::unique_ptr<Response> SnapshotReply(const NonAuthoritativeFrontend* fe,
+	                                        const key_type& key_prefix);
+
+	std::unique_ptr<Response> ReadReply(const Request* request);
+
 	virtual bool DoProcessIO() override;
 	virtual bool DoHasPendingOutput() const override;
 	virtual bool DoClose() override;
@@ -129,8 +345,31 @@ private:
 	int sub_socket = -1;
 	int psh_socket = -1;
 	std::unordered_map<std::string, NonAuthoritativeFrontend*> frontends;
-	std::list<std::unique_ptr<Request>> requests;
-	std::queue<std::unique_ptr<Update>> updates;
+	// Indexed by topic ID.
+	std::vector<NonAuthoritativeFrontend*> frontends_by_id;
+	request_list requests;
+	size_t request_bytes = 0;
+	QueueLimits request_limits;
+	update_list updates;
+	size_t update_bytes = 0;
+	QueueLimits update_limits;
+	// Queued updates that conflating could replace, keyed by topic and key
+	// separated by a space.
+	std::unordered_map<std::string, update_list::iterator> conflatable;
+	stats_cb stats_callback;
+	trace_cb trace_sink;
+	// When a request last left the queue, letting the next one be sent.
+	double last_dequeue = 0;
+	// Serving reads.
+	int rep_socket = -1;
+	std::unique_ptr<Response> pending_response = nullptr;
+	bool pending_traced = false;
+	RequestTrace pending_trace;
+	// Full-topic snapshots, keyed by topic.  Prefix snapshots aren't cached,
+	// as there could be any number of prefixes.
+	std::unordered_map<std::string, CachedSnapshot> snapshot_cache;
+	// Relaying.
+	int rel_socket = -1;
 };
 
 } // namespace nnc
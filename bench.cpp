@@ -0,0 +1,410 @@
+// Micro-benchmarks for message encoding/decoding and store operations.
+//
+// Each result is printed as one JSON object per line, e.g.
+//   {"name":"InsertUpdate/parse/k16","iterations":2097152,"ns_per_op":61.2,
+//    "bytes_per_op":48.0,"allocs_per_op":2.00,"msg_bytes":31}
+// where bytes_per_op and allocs_per_op count heap allocations made while the
+// operation ran, and msg_bytes is the size of the encoded message (if any).
+
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+#include <getopt.h>
+
+#include "frontend.hpp"
+#include "messages.hpp"
+
+using namespace std;
+using namespace nnc;
+
+// Atomic, as parsing large snapshots allocates from several threads.
+static atomic<uint64_t> alloc_count(0);
+static atomic<uint64_t> alloc_bytes(0);
+
+void* operator new(size_t size)
+	{
+	alloc_count.fetch_add(1, memory_order_relaxed);
+	alloc_bytes.fetch_add(size, memory_order_relaxed);
+
+	if ( void* rval = malloc(size ? size : 1) )
+		return rval;
+
+	throw bad_alloc();
+	}
+
+// Not inlined so that GCC doesn't mistake the free() for a mismatch.
+__attribute__((noinline)) void operator delete(void* ptr) noexcept
+	{
+	free(ptr);
+	}
+
+__attribute__((noinline)) void operator delete(void* ptr, size_t) noexcept
+	{
+	free(ptr);
+	}
+
+// Keeps the optimizer from discarding results.
+static volatile uint64_t sink;
+
+static double min_time = 0.5;
+static uint64_t max_snapshot_keys = 1000000;
+static string filter;
+
+static void run(const string& name, size_t msg_bytes,
+                const function<void(uint64_t)>& body)
+	{
+	if ( ! filter.empty() && name.find(filter) == string::npos )
+		return;
+
+	typedef chrono::steady_clock clock;
+
+	for ( uint64_t n = 1; ; n *= 2 )
+		{
+		uint64_t count0 = alloc_count;
+		uint64_t bytes0 = alloc_bytes;
+		auto start = clock::now();
+		body(n);
+		double elapsed = chrono::duration<double>(clock::now() - start).count();
+
+		if ( elapsed < min_time )
+			continue;
+
+		printf("{\"name\":\"%s\",\"iterations\":%" PRIu64 ","
+		       "\"ns_per_op\":%.1f,\"bytes_per_op\":%.1f,"
+		       "\"allocs_per_op\":%.2f,\"msg_bytes\":%zu}\n",
+		       name.c_str(), n, elapsed * 1e9 / n,
+		       double(alloc_bytes - bytes0) / n,
+		       double(alloc_count - count0) / n, msg_bytes);
+		fflush(stdout);
+		return;
+		}
+	}
+
+// Keys are padded at the front so the distinguishing digits always survive.
+static key_type make_key(uint64_t i, size_t size)
+	{
+	char buf[32];
+	int n = snprintf(buf, sizeof(buf), "%016" PRIx64, i);
+	key_type rval(size > size_t(n) ? size - n : 0, 'k');
+	rval.append(buf, size < size_t(n) ? size : n);
+	return rval;
+	}
+
+static mt19937_64 rng(42);
+
+static value_type make_val()
+	{
+	// Mostly small counters, some full-width values.
+	return rng() % 4 ? value_type(rng() % 100000) : value_type(rng());
+	}
+
+static kv_store_type make_store(uint64_t num_keys, size_t key_size)
+	{
+	kv_store_type rval;
+	rval.reserve(num_keys);
+
+	for ( uint64_t i = 0; i < num_keys; ++i )
+		rval[make_key(i, key_size)] = make_val();
+
+	return rval;
+	}
+
+// Benchmarks Prepare() of an already constructed message and Parse() of the
+// resulting encoding with the parser of its base class T.
+template <typename T>
+static void bench_message(const string& name, Message* m)
+	{
+	unique_ptr<Message> owned(m);
+	// Held on to since Prepare() replaces the message's own copy.
+	auto msg = m->SharedMsg();
+
+	run(name + "/prepare", msg->size(), [m](uint64_t n)
+		{
+		for ( uint64_t i = 0; i < n; ++i )
+			m->Prepare();
+		});
+
+	if ( ! T::Parse(msg->data(), msg->size()) )
+		{
+		fprintf(stderr, "%s: failed to parse its own encoding\n",
+		        name.c_str());
+		exit(1);
+		}
+
+	run(name + "/parse", msg->size(), [&msg](uint64_t n)
+		{
+		for ( uint64_t i = 0; i < n; ++i )
+			sink = sink + (T::Parse(msg->data(), msg->size()) ? 1 : 0);
+		});
+	}
+
+template <typename M>
+static M* with_topic_id(M* m)
+	{
+	m->SetTopicId(1);
+	return m;
+	}
+
+static void bench_messages(size_t key_size)
+	{
+	const string topic = "example0";
+	const string sfx = "/k" + to_string(key_size);
+	key_type key = make_key(12345, key_size);
+	value_type val = 1234567890123;
+	const size_t batch_size = 64;
+
+	bench_message<Request>("LookupRequest" + sfx, with_topic_id(
+	        new LookupRequest(topic, key, 5, nullptr)));
+	bench_message<Request>("HasKeyRequest" + sfx, with_topic_id(
+	        new HasKeyRequest(topic, key, 5, nullptr)));
+	bench_message<Request>("SizeRequest" + sfx, with_topic_id(
+	        new SizeRequest(topic, 5, nullptr)));
+	bench_message<Request>("ScanRequest" + sfx, with_topic_id(
+	        new ScanRequest(topic, key, make_key(99999, key_size), 100, 5,
+	                        nullptr)));
+	bench_message<Request>("AtomicRequest" + sfx, with_topic_id(
+	        new AtomicRequest(topic, ATOMIC_CAS, key, val, val - 1, 5,
+	                          nullptr)));
+	bench_message<Request>("SnapshotRequest" + sfx, with_topic_id(
+	        new SnapshotRequest(topic, key.substr(0, key_size / 2))));
+	bench_message<Request>("TopicIdRequest" + sfx,
+	                       new TopicIdRequest(topic));
+
+	auto br = new BatchRequest();
+
+	for ( size_t i = 0; i < batch_size; ++i )
+		br->Add(unique_ptr<Request>(new TopicIdRequest(topic + to_string(i))));
+
+	bench_message<Request>("BatchRequest/" + to_string(batch_size) + sfx, br);
+
+	bench_message<Response>("LookupResponse" + sfx, new LookupResponse(&val));
+	bench_message<Response>("HasKeyResponse" + sfx, new HasKeyResponse(true));
+	bench_message<Response>("SizeResponse" + sfx, new SizeResponse(1000000));
+	bench_message<Response>("AtomicResponse" + sfx,
+	                        new AtomicResponse(true, &val, 1000000));
+	bench_message<Response>("TopicIdResponse" + sfx, new TopicIdResponse(1));
+	bench_message<Response>("InvalidRequestResponse" + sfx,
+	                        new InvalidRequestResponse("unknown topic"));
+
+	kv_pair_list pairs;
+
+	for ( size_t i = 0; i < 100; ++i )
+		pairs.emplace_back(make_key(i, key_size), make_val());
+
+	bench_message<Response>("ScanResponse/100" + sfx,
+	                        new ScanResponse(move(pairs), true,
+	                                         make_key(100, key_size)));
+
+	bench_message<Publication>("ValUpdatePublication" + sfx, with_topic_id(
+	        new ValUpdatePublication(topic, key, &val, 1000000)));
+	bench_message<Publication>("ValUpdatePublication/remove" + sfx,
+	        with_topic_id(new ValUpdatePublication(topic, key, nullptr,
+	                                               1000000)));
+	bench_message<Publication>("ClearPublication" + sfx, with_topic_id(
+	        new ClearPublication(topic, 1000000)));
+
+	auto bp = new BatchPublication(topic, 1000000);
+	auto cp = new CounterPublication(topic, 1000000, "node0");
+	WriteBatch batch;
+	pn_counter_list states;
+
+	for ( size_t i = 0; i < batch_size; ++i )
+		{
+		key_type k = make_key(i, key_size);
+		value_type v = make_val();
+		pn_counter c;
+		c.p = v;
+		c.n = v / 2;
+		bp->Add(k, &v);
+		cp->Add(k, c, c.p - c.n);
+		batch.Insert(k, v);
+		states.emplace_back(k, c);
+		}
+
+	bench_message<Publication>("BatchPublication/64" + sfx,
+	                           with_topic_id(bp));
+	bench_message<Publication>("CounterPublication/64" + sfx,
+	                           with_topic_id(cp));
+
+	bench_message<Update>("InsertUpdate" + sfx, with_topic_id(
+	        new InsertUpdate(topic, key, val)));
+	bench_message<Update>("RemoveUpdate" + sfx, with_topic_id(
+	        new RemoveUpdate(topic, key)));
+	bench_message<Update>("IncrementUpdate" + sfx, with_topic_id(
+	        new IncrementUpdate(topic, key, 1)));
+	bench_message<Update>("DecrementUpdate" + sfx, with_topic_id(
+	        new DecrementUpdate(topic, key, 1)));
+	bench_message<Update>("AtomicUpdate" + sfx, with_topic_id(
+	        new AtomicUpdate(topic, ATOMIC_FETCH_ADD, key, 1, 0)));
+	bench_message<Update>("ClearUpdate" + sfx, with_topic_id(
+	        new ClearUpdate(topic)));
+	bench_message<Update>("BatchUpdate/64" + sfx, with_topic_id(
+	        new BatchUpdate(topic, move(batch))));
+	bench_message<Update>("CounterUpdate/64" + sfx, with_topic_id(
+	        new CounterUpdate(topic, "node0", move(states))));
+	}
+
+static void bench_snapshots(size_t key_size)
+	{
+	for ( uint64_t num_keys = 1000; num_keys <= max_snapshot_keys;
+	      num_keys *= 10 )
+		{
+		string name = "SnapshotResponse/" + to_string(num_keys) + "/k" +
+		              to_string(key_size);
+
+		if ( ! filter.empty() && name.find(filter) == string::npos )
+			continue;
+
+		SnapshotResponse r(make_store(num_keys, key_size), num_keys, 1);
+		auto msg = r.SharedMsg();
+
+		run(name + "/prepare", msg->size(), [&r](uint64_t n)
+			{
+			for ( uint64_t i = 0; i < n; ++i )
+				r.Prepare();
+			});
+
+		for ( size_t threads : {0, 1} )
+			{
+			SnapshotResponse::SetDecodeThreads(threads);
+			string sfx = threads == 1 ? "/serial" : "";
+
+			run(name + "/parse" + sfx, msg->size(), [&msg](uint64_t n)
+				{
+				for ( uint64_t i = 0; i < n; ++i )
+					sink = sink + (Response::Parse(msg->data(), msg->size()) ?
+					               1 : 0);
+				});
+			}
+
+		SnapshotResponse::SetDecodeThreads(0);
+		}
+	}
+
+static void bench_store(size_t key_size)
+	{
+	const string sfx = "/k" + to_string(key_size);
+	const uint64_t num_keys = 100000;
+	vector<key_type> keys;
+	vector<key_type> missing;
+
+	for ( uint64_t i = 0; i < num_keys; ++i )
+		{
+		keys.push_back(make_key(i, key_size));
+		missing.push_back(make_key(i + num_keys, key_size));
+		}
+
+	run("AuthoritativeFrontend::Insert/new" + sfx, 0, [&](uint64_t n)
+		{
+		AuthoritativeFrontend fe("example0");
+
+		for ( uint64_t i = 0; i < n; ++i )
+			fe.Insert(make_key(i, key_size), i);
+		});
+
+	AuthoritativeFrontend fe("example0");
+
+	for ( uint64_t i = 0; i < num_keys; ++i )
+		fe.Insert(keys[i], i);
+
+	run("AuthoritativeFrontend::Insert/overwrite" + sfx, 0, [&](uint64_t n)
+		{
+		for ( uint64_t i = 0; i < n; ++i )
+			fe.Insert(keys[i % num_keys], i);
+		});
+
+	run("AuthoritativeFrontend::Increment" + sfx, 0, [&](uint64_t n)
+		{
+		for ( uint64_t i = 0; i < n; ++i )
+			fe.Increment(keys[i % num_keys], 1);
+		});
+
+	run("Frontend::LookupSync/hit" + sfx, 0, [&](uint64_t n)
+		{
+		for ( uint64_t i = 0; i < n; ++i )
+			sink = sink + (fe.LookupSync(keys[i % num_keys]) ? 1 : 0);
+		});
+
+	run("Frontend::LookupSync/miss" + sfx, 0, [&](uint64_t n)
+		{
+		for ( uint64_t i = 0; i < n; ++i )
+			sink = sink + (fe.LookupSync(missing[i % num_keys]) ? 1 : 0);
+		});
+
+	vector<unique_ptr<Publication>> pubs;
+
+	for ( uint64_t i = 0; i < 1024; ++i )
+		{
+		value_type v = make_val();
+		pubs.emplace_back(new ValUpdatePublication("example0",
+		                                           keys[i * 97 % num_keys],
+		                                           &v, i + 1));
+		}
+
+	kv_store_type store = make_store(num_keys, key_size);
+
+	run("ValUpdatePublication::Apply" + sfx, 0, [&](uint64_t n)
+		{
+		for ( uint64_t i = 0; i < n; ++i )
+			pubs[i % pubs.size()]->Apply(store);
+		});
+	}
+
+static void usage(const string& program)
+	{
+	fprintf(stderr, "%s [options]\n", program.c_str());
+	fprintf(stderr, "    -t|--min-time    | seconds to run each benchmark for\n");
+	fprintf(stderr, "    -k|--max-keys    | largest snapshot to benchmark\n");
+	fprintf(stderr, "    -f|--filter      | only run benchmarks containing this\n");
+	}
+
+static option long_options[] = {
+    {"min-time",     required_argument,    0, 't'},
+    {"max-keys",     required_argument,    0, 'k'},
+    {"filter",       required_argument,    0, 'f'},
+    {0,              0,                    0,  0 },
+};
+
+static const char* opt_string = "t:k:f:";
+
+int main(int argc, char** argv)
+	{
+	for ( ; ; )
+		{
+		int o = getopt_long(argc, argv, opt_string, long_options, 0);
+
+		if ( o == -1 )
+			break;
+
+		switch ( o ) {
+		case 't':
+			min_time = stod(optarg);
+			break;
+		case 'k':
+			max_snapshot_keys = stoull(optarg);
+			break;
+		case 'f':
+			filter = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+		}
+
+	for ( size_t key_size : {16, 64} )
+		{
+		bench_messages(key_size);
+		bench_snapshots(key_size);
+		bench_store(key_size);
+		}
+
+	return 0;
+	}
@@ -1,7 +1,11 @@
 #include "client.hpp"
 #include "frontend.hpp"
 #include "backend.hpp"
+#include "coro.hpp"
+#include "util.hpp"
 
+#include <cerrno>
+#include <csignal>
 #include <sstream>
 #include <vector>
 #include <string>
@@ -32,15 +36,40 @@ void lookup_callback(const key_type& key, unique_ptr<value_type> val,
 		printf("lookup(%s): %d, null\n", key.c_str(), res);
 	}
 
-int run_client(unsigned long start_port, const string& name)
+#ifdef NANOCLONE_HAVE_COROUTINES
+static Task<> lookup_io_count(const Frontend& frontend)
+	{
+	LookupResult r = co_await frontend.Lookup("io_count_server", 5);
+
+	if ( r.found )
+		printf("lookup(io_count_server): %d, %" PRIi64 "\n", r.code, r.val);
+	else
+		printf("lookup(io_count_server): %d, null\n", r.code);
+	}
+#endif
+
+int run_client(unsigned long start_port, const string& name,
+               const ExportOptions& export_options,
+               const ClientOptions& options)
 	{
 	NonAuthoritativeFrontend frontend("example0");
 	NonAuthoritativeBackend backend;
+	StoreExporter exporter(frontend, export_options);
+	StoreExporter::TriggerOnSignal(SIGUSR1);
 	vector<string> addrs = get_addrs(start_port);
 	int64_t io_count = 0;
 	int io_count_throttle = 10;
 	string io_count_key = "io_count_" + name;
 
+	if ( options.upstream_port )
+		{
+		addrs[0] = get_addr(options.upstream_port);
+		addrs[1] = get_addr(options.upstream_port + 1);
+		}
+
+	if ( options.query_port )
+		addrs[0] = get_addr(options.query_port);
+
 	if ( ! backend.Connect(addrs[0], addrs[1], addrs[2]) )
 		{
 		printf("Failed to connect on ports %lu - %lu\n", start_port,
@@ -48,6 +77,25 @@ int run_client(unsigned long start_port, const string& name)
 		return 1;
 		}
 
+	if ( options.read_port &&
+	     ! backend.ServeReads(get_addr(options.read_port)) )
+		{
+		printf("Failed to serve reads on port %lu\n", options.read_port);
+		return 1;
+		}
+
+	if ( options.relay_port &&
+	     ! (backend.ServeReads(get_addr(options.relay_port)) &&
+	        backend.Relay(get_addr(options.relay_port + 1))) )
+		{
+		printf("Failed to relay on ports %lu - %lu\n", options.relay_port,
+		       options.relay_port + 1);
+		return 1;
+		}
+
+	if ( options.partial_capacity )
+		frontend.EnablePartialReplica(options.partial_capacity);
+
 	frontend.Pair(&backend);
 	frontend.Insert(io_count_key, io_count);
 
@@ -71,9 +119,20 @@ int run_client(unsigned long start_port, const string& name)
 			return 1;
 			}
 
+		double deadline;
+
+		if ( exporter.NextDeadline(&deadline) )
+			{
+			timeval tv = to_timeval(deadline - current_time());
+
+			if ( ! to || timercmp(&tv, to.get(), <) )
+				to.reset(new timeval(tv));
+			}
+
 		int num_ready = select(nfds, &rfds, &wfds, nullptr, to.get());
 
-		if ( num_ready < 0 )
+		// Export signals interrupt select().
+		if ( num_ready < 0 && errno != EINTR )
 			{
 			printf("Error in select()\n");
 			return 1;
@@ -85,10 +144,14 @@ int run_client(unsigned long start_port, const string& name)
 		if ( io_count % io_count_throttle == 0 )
 			{
 			frontend.Increment(io_count_key, io_count_throttle);
+#ifdef NANOCLONE_HAVE_COROUTINES
+			Spawn(lookup_io_count(frontend));
+#else
 			frontend.LookupAsync("io_count_server", 5, lookup_callback);
+#endif
 			}
 
-		frontend.DumpDebug(stdout);
+		exporter.ProcessTimers();
 		}
 
 	return 0;
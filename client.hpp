@@ -1,3 +1,21 @@
+#include "store_export.hpp"
+
 #include <string>
 
-int run_client(unsigned long starting_port, const std::string& name);
+struct ClientOptions {
+	// Serves reads on this port, making the client a read replica.
+	unsigned long read_port = 0;
+	// Sends requests to this port, e.g. a replica's, rather than the server's.
+	unsigned long query_port = 0;
+	// Serves reads on this port and relays publications from the next one.
+	unsigned long relay_port = 0;
+	// Sends requests to and subscribes at a relay's two ports rather than the
+	// server's.  Writes still go to the server.
+	unsigned long upstream_port = 0;
+	// Holds only the keys looked up, up to this many, rather than the topic.
+	size_t partial_capacity = 0;
+};
+
+int run_client(unsigned long starting_port, const std::string& name,
+               const nnc::ExportOptions& export_options,
+               const ClientOptions& options = ClientOptions());
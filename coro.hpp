@@ -0,0 +1,372 @@
+#ifndef NANOCLONE_CORO_HPP
+#define NANOCLONE_CORO_HPP
+
+// Awaitable forms of the async queries, for code built as C++20 (e.g. with
+// the NANOCLONE_COROUTINES CMake option).  The library itself doesn't need
+// it: everything here sits on top of the callback API.
+//
+//     Task<> Report(const Frontend& frontend)
+//         {
+//         LookupResult r = co_await frontend.Lookup("key", 5);
+//         ...
+//         }
+//
+//     Spawn(Report(frontend));
+//
+// A coroutine awaiting a query resumes from within the backend's
+// ProcessIO(), i.e. on the thread running the event loop, once the response
+// or timeout arrives.  Queries an authoritative frontend answers on the spot
+// don't suspend at all.
+
+#include "frontend.hpp"
+
+#ifdef NANOCLONE_HAVE_COROUTINES
+
+#include "pool.hpp"
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+
+namespace nnc {
+
+struct LookupResult {
+	AsyncResultCode code = ASYNC_SUCCESS;
+	bool found = false;
+	value_type val = 0;
+};
+
+struct HasKeyResult {
+	AsyncResultCode code = ASYNC_SUCCESS;
+	bool exists = false;
+};
+
+struct SizeResult {
+	AsyncResultCode code = ASYNC_SUCCESS;
+	uint64_t size = 0;
+};
+
+template<class T = void>
+class Task;
+
+namespace detail {
+
+// Frames come from the same free lists as messages.
+class TaskPromiseBase {
+public:
+
+	static void* operator new(size_t size)
+		{ return pool_allocate(size); }
+
+	static void operator delete(void* p, size_t size)
+		{ pool_free(p, size); }
+
+	std::suspend_always initial_suspend() noexcept
+		{ return {}; }
+
+	void unhandled_exception()
+		{ exception = std::current_exception(); }
+
+	// Resumes whoever awaited the task.  A spawned task frees itself.
+	template<class Promise>
+	struct FinalAwaiter {
+		bool await_ready() noexcept
+			{ return false; }
+
+		std::coroutine_handle<>
+		await_suspend(std::coroutine_handle<Promise> h) noexcept
+			{
+			TaskPromiseBase& p = h.promise();
+
+			if ( p.continuation )
+				return p.continuation;
+
+			if ( p.detached )
+				{
+				// Nobody is left to hand the exception to.
+				if ( p.exception )
+					std::terminate();
+
+				h.destroy();
+				}
+
+			return std::noop_coroutine();
+			}
+
+		void await_resume() noexcept {}
+	};
+
+	std::coroutine_handle<> continuation;
+	std::exception_ptr exception;
+	bool detached = false;
+};
+
+template<class T>
+class TaskPromise : public TaskPromiseBase {
+public:
+
+	Task<T> get_return_object();
+
+	FinalAwaiter<TaskPromise> final_suspend() noexcept
+		{ return {}; }
+
+	template<class U>
+	void return_value(U&& value)
+		{ result.emplace(std::forward<U>(value)); }
+
+	T Result()
+		{
+		if ( exception )
+			std::rethrow_exception(exception);
+
+		return std::move(*result);
+		}
+
+private:
+
+	std::optional<T> result;
+};
+
+template<>
+class TaskPromise<void> : public TaskPromiseBase {
+public:
+
+	Task<void> get_return_object();
+
+	FinalAwaiter<TaskPromise> final_suspend() noexcept
+		{ return {}; }
+
+	void return_void() {}
+
+	void Result()
+		{
+		if ( exception )
+			std::rethrow_exception(exception);
+		}
+};
+
+} // namespace detail
+
+// A coroutine that starts when awaited (or spawned) and resumes its awaiter
+// when done, handing over its result or exception.
+template<class T>
+class Task {
+public:
+
+	using promise_type = detail::TaskPromise<T>;
+	using handle_type = std::coroutine_handle<promise_type>;
+
+	explicit Task(handle_type h)
+		: handle(h) {}
+
+	Task(Task&& other) noexcept
+		: handle(std::exchange(other.handle, nullptr)) {}
+
+	Task& operator=(Task&& other) noexcept
+		{
+		if ( this != &other )
+			{
+			if ( handle )
+				handle.destroy();
+
+			handle = std::exchange(other.handle, nullptr);
+			}
+
+		return *this;
+		}
+
+	~Task()
+		{ if ( handle ) handle.destroy(); }
+
+	bool await_ready() const noexcept
+		{ return ! handle || handle.done(); }
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter)
+		{
+		handle.promise().continuation = awaiter;
+		return handle;
+		}
+
+	T await_resume()
+		{ return handle.promise().Result(); }
+
+	// Starts the task without awaiting it; it frees itself when done.
+	friend void Spawn(Task task)
+		{
+		handle_type h = std::exchange(task.handle, nullptr);
+		h.promise().detached = true;
+		h.resume();
+		}
+
+private:
+
+	handle_type handle;
+};
+
+template<class T>
+Task<T> detail::TaskPromise<T>::get_return_object()
+	{
+	return Task<T>(Task<T>::handle_type::from_promise(*this));
+	}
+
+inline Task<void> detail::TaskPromise<void>::get_return_object()
+	{
+	return Task<void>(Task<void>::handle_type::from_promise(*this));
+	}
+
+namespace detail {
+
+// Sends the query when awaited and resumes the awaiter from its callback.
+// The callbacks capture only the awaiter, small enough for std::function
+// to hold without allocating.
+template<class Derived, class Result>
+class QueryAwaitable {
+public:
+
+	bool await_ready() const noexcept
+		{ return false; }
+
+	bool await_suspend(std::coroutine_handle<> h)
+		{
+		waiter = h;
+
+		if ( ! static_cast<Derived*>(this)->Send() )
+			{
+			result.code = ASYNC_REJECTED;
+			return false;
+			}
+
+		// Answered during Send(), so there's no need to suspend.
+		suspended = ! done;
+		return suspended;
+		}
+
+	Result await_resume()
+		{ return result; }
+
+protected:
+
+	// Nothing may touch the awaitable after this, as the resumed coroutine
+	// may have destroyed it.
+	void Complete()
+		{
+		done = true;
+
+		if ( suspended )
+			waiter.resume();
+		}
+
+	Result result;
+
+private:
+
+	std::coroutine_handle<> waiter;
+	bool done = false;
+	bool suspended = false;
+};
+
+} // namespace detail
+
+class LookupAwaitable
+	: public detail::QueryAwaitable<LookupAwaitable, LookupResult> {
+public:
+
+	LookupAwaitable(const Frontend& arg_frontend, key_type arg_key,
+	                double arg_timeout)
+		: frontend(arg_frontend), key(std::move(arg_key)),
+		  timeout(arg_timeout) {}
+
+	bool Send()
+		{
+		return frontend.LookupAsync(key, timeout,
+		        [this](const key_type&, std::unique_ptr<value_type> val,
+		               AsyncResultCode code)
+			{
+			result.code = code;
+			result.found = val != nullptr;
+			result.val = val ? *val : 0;
+			Complete();
+			});
+		}
+
+private:
+
+	const Frontend& frontend;
+	key_type key;
+	double timeout;
+};
+
+class HasKeyAwaitable
+	: public detail::QueryAwaitable<HasKeyAwaitable, HasKeyResult> {
+public:
+
+	HasKeyAwaitable(const Frontend& arg_frontend, key_type arg_key,
+	                double arg_timeout)
+		: frontend(arg_frontend), key(std::move(arg_key)),
+		  timeout(arg_timeout) {}
+
+	bool Send()
+		{
+		return frontend.HasKeyAsync(key, timeout,
+		        [this](const key_type&, bool exists, AsyncResultCode code)
+			{
+			result.code = code;
+			result.exists = exists;
+			Complete();
+			});
+		}
+
+private:
+
+	const Frontend& frontend;
+	key_type key;
+	double timeout;
+};
+
+class SizeAwaitable
+	: public detail::QueryAwaitable<SizeAwaitable, SizeResult> {
+public:
+
+	SizeAwaitable(const Frontend& arg_frontend, double arg_timeout)
+		: frontend(arg_frontend), timeout(arg_timeout) {}
+
+	bool Send()
+		{
+		return frontend.SizeAsync(timeout,
+		        [this](uint64_t size, AsyncResultCode code)
+			{
+			result.code = code;
+			result.size = size;
+			Complete();
+			});
+		}
+
+private:
+
+	const Frontend& frontend;
+	double timeout;
+};
+
+inline LookupAwaitable Frontend::Lookup(const key_type& key,
+                                        double timeout) const
+	{
+	return LookupAwaitable(*this, key, timeout);
+	}
+
+inline HasKeyAwaitable Frontend::HasKey(const key_type& key,
+                                        double timeout) const
+	{
+	return HasKeyAwaitable(*this, key, timeout);
+	}
+
+inline SizeAwaitable Frontend::Size(double timeout) const
+	{
+	return SizeAwaitable(*this, timeout);
+	}
+
+} // namespace nnc
+
+#endif // NANOCLONE_HAVE_COROUTINES
+
+#endif // NANOCLONE_CORO_HPP
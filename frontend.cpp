@@ -1,9 +1,13 @@
 #include "frontend.hpp"
 #include "backend.hpp"
 #include "messages.hpp"
+#include "metrics.hpp"
+#include "shared_replica.hpp"
 #include "util.hpp"
 
 #include <memory>
+#include <algorithm>
+#include <atomic>
 #include <cinttypes>
 #include <assert.h>
 #include <nanomsg/nn.h>
@@ -36,6 +40,34 @@ const nnc::value_type* nnc::Frontend::LookupSync(const nnc::key_type& key) const
 	return &it->second;
 	}
 
+key_type nnc::Frontend::PrefixEnd(const key_type& prefix)
+	{
+	key_type rval = prefix;
+
+	while ( ! rval.empty() )
+		{
+		unsigned char c = rval.back();
+
+		if ( c != 0xff )
+			{
+			rval.back() = c + 1;
+			return rval;
+			}
+
+		rval.pop_back();
+		}
+
+	return rval;
+	}
+
+nnc::AuthoritativeFrontend::AuthoritativeFrontend(const string& topic)
+	: Frontend(topic)
+	{
+	// Frontends may be constructed on several threads.
+	static atomic<uint32_t> next_topic_id(1);
+	topic_id = next_topic_id.fetch_add(1, memory_order_relaxed);
+	}
+
 bool nnc::AuthoritativeFrontend::AddBackend(AuthoritativeBackend* backend)
 	{
 	backend->AddFrontend(this);
@@ -48,38 +80,211 @@ bool nnc::AuthoritativeFrontend::RemBackend(AuthoritativeBackend* backend)
 	return backends.erase(backend) == 1;
 	}
 
-unique_ptr<Response> nnc::AuthoritativeFrontend::Snapshot() const
+static inline bool has_prefix(const key_type& key, const key_type& prefix)
 	{
-	return unique_ptr<Response>(new SnapshotResponse(store, sequence));
+	return key.compare(0, prefix.size(), prefix) == 0;
 	}
 
-bool nnc::AuthoritativeFrontend::DoInsert(const key_type& key,
-                                          const value_type& val)
+unique_ptr<Response>
+nnc::Frontend::DoSnapshot(const key_type& key_prefix) const
 	{
-	store[key] = val;
-	++sequence;
-	auto p = make_shared<ValUpdatePublication>(Topic(), key, &val, sequence);
-	for ( auto b : backends ) b->Publish(p);
+	if ( key_prefix.empty() )
+		return unique_ptr<Response>(new SnapshotResponse(store, sequence,
+		                                                 topic_id));
+
+	kv_store_type filtered;
+
+	for ( const auto& kv : store )
+		if ( has_prefix(kv.first, key_prefix) )
+			filtered.insert(kv);
+
+	return unique_ptr<Response>(new SnapshotResponse(move(filtered),
+	                                                 sequence, topic_id));
+	}
+
+unique_ptr<Response>
+nnc::AuthoritativeFrontend::DoSnapshot(const key_type& key_prefix) const
+	{
+	if ( key_prefix.empty() || ! ordered_keys )
+		return Frontend::DoSnapshot(key_prefix);
+
+	kv_store_type filtered;
+	auto it = ordered_keys->lower_bound(&key_prefix);
+
+	for ( ; it != ordered_keys->end() && has_prefix(**it, key_prefix); ++it )
+		filtered.emplace(**it, store.find(**it)->second);
+
+	return unique_ptr<Response>(new SnapshotResponse(move(filtered),
+	                                                 sequence, topic_id));
+	}
+
+void nnc::AuthoritativeFrontend::SetOrderedIndex(bool enable)
+	{
+	if ( ! enable )
+		{
+		ordered_keys = nullptr;
+		return;
+		}
+
+	if ( ordered_keys )
+		return;
+
+	ordered_keys.reset(new ordered_index_type);
+
+	for ( const auto& kv : store )
+		ordered_keys->insert(&kv.first);
+	}
+
+static inline bool in_range(const key_type& key, const key_type& end)
+	{
+	return end.empty() || key < end;
+	}
+
+bool nnc::Frontend::DoScanSync(const key_type& begin, const key_type& end,
+                               size_t limit, kv_pair_list* pairs,
+                               key_type* next) const
+	{
+	vector<const key_type*> keys;
+
+	for ( const auto& kv : store )
+		if ( kv.first >= begin && in_range(kv.first, end) )
+			keys.push_back(&kv.first);
+
+	bool more = keys.size() > limit;
+	size_t n = more ? limit + 1 : keys.size();
+	partial_sort(keys.begin(), keys.begin() + n, keys.end(), key_ptr_less());
+
+	for ( size_t i = 0; i < n; ++i )
+		{
+		if ( i == limit )
+			{
+			*next = *keys[i];
+			break;
+			}
+
+		pairs->emplace_back(*keys[i], store.find(*keys[i])->second);
+		}
+
+	return more;
+	}
+
+bool nnc::AuthoritativeFrontend::DoScanSync(const key_type& begin,
+                                            const key_type& end, size_t limit,
+                                            kv_pair_list* pairs,
+                                            key_type* next) const
+	{
+	if ( ! ordered_keys )
+		return Frontend::DoScanSync(begin, end, limit, pairs, next);
+
+	auto it = ordered_keys->lower_bound(&begin);
+
+	for ( ; it != ordered_keys->end() && in_range(**it, end); ++it )
+		{
+		if ( pairs->size() == limit )
+			{
+			*next = **it;
+			return true;
+			}
+
+		pairs->emplace_back(**it, store.find(**it)->second);
+		}
+
+	return false;
+	}
+
+bool nnc::AuthoritativeFrontend::CanPublish() const
+	{
+	for ( auto b : backends )
+		if ( ! b->AdmitPublication() )
+			return false;
+
 	return true;
 	}
 
-bool nnc::AuthoritativeFrontend::DoRemove(const key_type& key)
+void nnc::AuthoritativeFrontend::Publish(shared_ptr<Publication> publication)
+	{
+	publication->SetTopicId(topic_id);
+	Metrics::Add(METRIC_PUBLICATIONS_CREATED);
+
+	for ( auto b : backends )
+		b->Publish(publication);
+	}
+
+void nnc::AuthoritativeFrontend::StoreSet(const key_type& key,
+                                          const value_type& val)
+	{
+	// Looking up first, as inserting allocates a node even for a key that's
+	// already there.
+	auto it = store.find(key);
+
+	if ( it != store.end() )
+		{
+		it->second = val;
+		return;
+		}
+
+	auto res = store.emplace(key, val);
+
+	if ( ordered_keys )
+		ordered_keys->insert(&res.first->first);
+	}
+
+bool nnc::AuthoritativeFrontend::StoreErase(const key_type& key)
 	{
 	auto it = store.find(key);
 
 	if ( it == store.end() )
 		return false;
 
+	counters.erase(key);
+
+	if ( ordered_keys )
+		ordered_keys->erase(&it->first);
+
 	store.erase(it);
+	return true;
+	}
+
+bool nnc::AuthoritativeFrontend::DoInsert(const key_type& key,
+                                          const value_type& val)
+	{
+	if ( ! CanPublish() )
+		return false;
+
+	InsertAndPublish(key, val);
+	return true;
+	}
+
+void nnc::AuthoritativeFrontend::InsertAndPublish(const key_type& key,
+                                                  const value_type& val)
+	{
+	StoreSet(key, val);
+	++sequence;
+	auto p = make_pooled<ValUpdatePublication>(Topic(), key, &val, sequence);
+	Publish(p);
+	}
+
+bool nnc::AuthoritativeFrontend::DoRemove(const key_type& key)
+	{
+	if ( ! HasKeySync(key) || ! CanPublish() )
+		return false;
+
+	// Admission may have run IO that applied a pulled update removing it.
+	if ( ! StoreErase(key) )
+		return false;
+
 	++sequence;
-	auto p = make_shared<ValUpdatePublication>(Topic(), key, nullptr, sequence);
-	for ( auto b : backends ) b->Publish(p);
+	auto p = make_pooled<ValUpdatePublication>(Topic(), key, nullptr, sequence);
+	Publish(p);
 	return true;
 	}
 
 bool nnc::AuthoritativeFrontend::DoIncrement(const key_type& key,
                                              const value_type& by)
 	{
+	if ( ! CanPublish() )
+		return false;
+
 	auto it = store.find(key);
 
 	if ( it == store.end() )
@@ -87,15 +292,18 @@ bool nnc::AuthoritativeFrontend::DoIncrement(const key_type& key,
 
 	it->second += by;
 	++sequence;
-	auto p = make_shared<ValUpdatePublication>(Topic(), key, &it->second,
+	auto p = make_pooled<ValUpdatePublication>(Topic(), key, &it->second,
 	                                           sequence);
-	for ( auto b : backends ) b->Publish(p);
+	Publish(p);
 	return true;
 	}
 
 bool nnc::AuthoritativeFrontend::DoDecrement(const key_type& key,
                                              const value_type& by)
 	{
+	if ( ! CanPublish() )
+		return false;
+
 	auto it = store.find(key);
 
 	if ( it == store.end() )
@@ -103,18 +311,222 @@ bool nnc::AuthoritativeFrontend::DoDecrement(const key_type& key,
 
 	it->second -= by;
 	++sequence;
-	auto p = make_shared<ValUpdatePublication>(Topic(), key, &it->second,
+	auto p = make_pooled<ValUpdatePublication>(Topic(), key, &it->second,
 	                                           sequence);
-	for ( auto b : backends ) b->Publish(p);
+	Publish(p);
+	return true;
+	}
+
+bool nnc::AuthoritativeFrontend::DoWrite(const WriteBatch& batch)
+	{
+	if ( ! CanPublish() )
+		return false;
+
+	// Keys whose final state gets published, in the order first touched.
+	vector<const key_type*> touched;
+	unordered_set<key_type> seen;
+
+	for ( const auto& op : batch.Ops() )
+		{
+		bool changed = false;
+
+		switch ( op.type ) {
+		case WriteBatch::INSERT:
+			StoreSet(op.key, op.val);
+			changed = true;
+			break;
+		case WriteBatch::REMOVE:
+			changed = StoreErase(op.key);
+			break;
+		case WriteBatch::INCREMENT:
+		case WriteBatch::DECREMENT:
+			{
+			auto it = store.find(op.key);
+
+			if ( it == store.end() )
+				break;
+
+			if ( op.type == WriteBatch::INCREMENT )
+				it->second += op.val;
+			else
+				it->second -= op.val;
+
+			changed = true;
+			}
+			break;
+		}
+
+		if ( changed && seen.insert(op.key).second )
+			touched.push_back(&op.key);
+		}
+
+	if ( touched.empty() )
+		return true;
+
+	++sequence;
+	auto p = make_pooled<BatchPublication>(Topic(), sequence);
+
+	for ( auto k : touched )
+		p->Add(*k, LookupSync(*k));
+
+	Publish(p);
+	return true;
+	}
+
+bool nnc::AuthoritativeFrontend::MergeCounters(const string& node,
+                                               const pn_counter_list& states)
+	{
+	if ( ! CanPublish() )
+		return false;
+
+	shared_ptr<CounterPublication> p;
+
+	for ( const auto& s : states )
+		{
+		pn_counter& c = counters[s.first][node];
+		value_type delta = 0;
+		bool changed = false;
+
+		if ( s.second.p > c.p )
+			{
+			delta += s.second.p - c.p;
+			c.p = s.second.p;
+			changed = true;
+			}
+
+		if ( s.second.n > c.n )
+			{
+			delta -= s.second.n - c.n;
+			c.n = s.second.n;
+			changed = true;
+			}
+
+		if ( ! changed )
+			continue;
+
+		const value_type* cur = LookupSync(s.first);
+		value_type total = (cur ? *cur : 0) + delta;
+		StoreSet(s.first, total);
+
+		if ( ! p )
+			p = make_pooled<CounterPublication>(Topic(), sequence + 1, node);
+
+		p->Add(s.first, c, total);
+		}
+
+	if ( ! p )
+		return true;
+
+	++sequence;
+	Publish(p);
 	return true;
 	}
 
 bool nnc::AuthoritativeFrontend::DoClear()
 	{
+	if ( ! CanPublish() )
+		return false;
+
+	counters.clear();
+
+	if ( ordered_keys )
+		ordered_keys->clear();
+
 	store.clear();
 	++sequence;
-	auto p = make_shared<ClearPublication>(Topic(), sequence);
-	for ( auto b : backends ) b->Publish(p);
+	auto p = make_pooled<ClearPublication>(Topic(), sequence);
+	Publish(p);
+	return true;
+	}
+
+// Whether the operation applies to a key's current value, if any, and the
+// value it then stores.
+static bool eval_atomic(AtomicOp op, const value_type* cur,
+                        const value_type& operand, const value_type& expected,
+                        value_type* val)
+	{
+	bool applied = true;
+	*val = operand;
+
+	switch ( op ) {
+	case ATOMIC_CAS:
+		applied = cur && *cur == expected;
+		break;
+	case ATOMIC_FETCH_ADD:
+		applied = cur != nullptr;
+
+		if ( cur )
+			*val = *cur + operand;
+		break;
+	case ATOMIC_UPSERT_ADD:
+		if ( cur )
+			*val = *cur + operand;
+		break;
+	case ATOMIC_INSERT_IF_ABSENT:
+		applied = ! cur;
+		break;
+	case ATOMIC_MAX:
+		if ( cur )
+			*val = max(*cur, operand);
+		break;
+	case ATOMIC_MIN:
+		if ( cur )
+			*val = min(*cur, operand);
+		break;
+	default:
+		applied = false;
+		break;
+	}
+
+	return applied;
+	}
+
+bool nnc::AuthoritativeFrontend::Atomic(AtomicOp op, const key_type& key,
+                                        const value_type& operand,
+                                        const value_type& expected,
+                                        unique_ptr<value_type>* result)
+	{
+	const value_type* cur = LookupSync(key);
+	value_type val;
+	bool applied = eval_atomic(op, cur, operand, expected, &val);
+
+	if ( applied && ( ! cur || *cur != val ) )
+		{
+		// Queue limits may keep it from taking effect after all.  Admission
+		// may also run IO applying other writes to the key, so the operation
+		// is evaluated again once admitted.
+		if ( CanPublish() )
+			{
+			cur = LookupSync(key);
+			applied = eval_atomic(op, cur, operand, expected, &val);
+
+			if ( applied && ( ! cur || *cur != val ) )
+				InsertAndPublish(key, val);
+			}
+		else
+			applied = false;
+		}
+
+	if ( result )
+		{
+		const value_type* v = LookupSync(key);
+		result->reset(v ? new value_type(*v) : nullptr);
+		}
+
+	return applied;
+	}
+
+bool nnc::AuthoritativeFrontend::DoAtomic(AtomicOp op, const key_type& key,
+                                          const value_type& operand,
+                                          const value_type& expected,
+                                          double timeout, atomic_cb cb)
+	{
+	if ( ! cb )
+		return Atomic(op, key, operand, expected);
+
+	unique_ptr<value_type> result;
+	bool applied = Atomic(op, key, operand, expected, &result);
+	cb(key, applied, move(result), sequence, ASYNC_SUCCESS);
 	return true;
 	}
 
@@ -146,155 +558,1001 @@ bool nnc::AuthoritativeFrontend::DoSizeAsync(double timeout, size_cb cb) const
 	return true;
 	}
 
+bool nnc::AuthoritativeFrontend::DoScanAsync(const key_type& begin,
+                                             const key_type& end, size_t limit,
+                                             double timeout, scan_cb cb) const
+	{
+	kv_pair_list pairs;
+	key_type next;
+	bool more = ScanSync(begin, end, limit, &pairs, &next);
+	cb(move(pairs), more, next, ASYNC_SUCCESS);
+	return true;
+	}
+
 bool
 nnc::NonAuthoritativeFrontend::ApplySnapshot(std::unique_ptr<Response> snapshot)
 	{
-	SnapshotResponse* r = dynamic_cast<SnapshotResponse*>(snapshot.get());
+	SnapshotResponse* r = message_cast<SnapshotResponse>(snapshot.get());
 
 	if ( ! r )
+		{
+		RetryLater();
+		return false;
+		}
+
+	if ( r->TopicId() != topic_id )
+		{
+		// Subscribed under an outdated ID, so publications may be missing.
+		AssignTopicId(r->TopicId());
+		return false;
+		}
+
+	// Publications the publisher dropped may be missing from it.
+	if ( ! key_prefix.empty() && r->Sequence() < dropped_through )
+		{
+		Resync();
 		return false;
+		}
 
 	sequence = r->Sequence();
+	snapshot_sequence = sequence;
 	store = r->Store();
 
-	while ( ! pub_backlog.empty() )
+	// Whatever was shipped is presumed to be in the snapshot already.
+	for ( auto& kv : own_counters )
 		{
-		unique_ptr<Publication> pub = move(pub_backlog.front());
-		pub_backlog.pop();
+		kv.second.seen = kv.second.shipped;
+		value_type unmerged = Unmerged(kv.second);
 
-		if ( pub->Sequence() == sequence + 1 )
-			pub->Apply(store);
+		if ( unmerged )
+			store[kv.first] += unmerged;
 		}
 
 	synchronized = true;
+	gap_start = 0;
+	heartbeat_seen = false;
+	Metrics::Add(METRIC_SNAPSHOTS_APPLIED);
+
+	if ( shared_replica )
+		shared_replica->Assign(store, sequence, true);
+
+	ApplyReorderBuffer();
 	return true;
 	}
 
 bool nnc::NonAuthoritativeFrontend::ProcessPublication(
         std::unique_ptr<Publication> pub)
 	{
-	if ( ! synchronized )
+	auto hb = message_cast<HeartbeatPublication>(pub.get());
+
+	if ( hb )
+		{
+		CheckHeartbeat(*hb);
+		return false;
+		}
+
+	auto dp = message_cast<DropPublication>(pub.get());
+
+	if ( dp )
 		{
-		pub_backlog.push(move(pub));
+		CheckDrop(*dp);
 		return false;
 		}
 
-	if ( pub->Sequence() == sequence + 1 )
+	if ( partial_capacity )
 		{
-		pub->Apply(store);
+		ApplyPartialPublication(*pub);
 		return true;
 		}
 
-	pub_backlog = {};
-	synchronized = false;
-	backend->SendRequest(new SnapshotRequest(topic));
-	return false;
-	}
+	uint64_t seq = pub->Sequence();
 
-bool nnc::NonAuthoritativeFrontend::Pair(NonAuthoritativeBackend* arg_backend)
-	{
-	if ( backend )
+	if ( synchronized && seq <= sequence )
+		{
+		// Duplicate or already reflected in the snapshot.
+		Metrics::Add(METRIC_PUBLICATIONS_DUPLICATE);
 		return false;
+		}
 
-	// The backend must already be connected so that update publications may
-	// be received _before_ the snapshot request is made, guaranteeing that the
-	// received state snapshot is newer than oldest update publication.
-	assert(arg_backend->Connected());
+	// The common case needn't go through the buffer's map.
+	if ( synchronized && reorder_buffer.empty() &&
+	     (seq == sequence + 1 || ! key_prefix.empty()) )
+		{
+		ApplyPublication(*pub);
+		gap_start = 0;
+		return true;
+		}
 
-	if ( ! arg_backend->Connected() )
-		return false;
+	reorder_buffer[seq] = move(pub);
 
-	backend = arg_backend;
-	backend->AddFrontend(this);
-	return true;
-	}
+	if ( ! synchronized )
+		{
+		// Only the newest publications can follow the pending snapshot.
+		if ( reorder_buffer.size() > reorder_limit )
+			reorder_buffer.erase(reorder_buffer.begin());
 
-bool nnc::NonAuthoritativeFrontend::Unpair()
-	{
-	if ( ! backend )
 		return false;
+		}
 
-	backend = nullptr;
-	backend->RemFrontend(this);
-	return true;
+	return ApplyReorderBuffer();
 	}
 
-bool nnc::NonAuthoritativeFrontend::DoInsert(const key_type& key,
-                                             const value_type& val)
+bool nnc::NonAuthoritativeFrontend::ApplyReorderBuffer()
 	{
-	if ( ! backend )
-		return false;
+	bool applied = false;
+	auto it = reorder_buffer.begin();
 
-	backend->SendUpdate(new InsertUpdate(Topic(), key, val));
-	return true;
-	}
+	// A prefix-filtered replica sees only some sequence numbers, so anything
+	// newer counts as next.
+	bool filtered = ! key_prefix.empty();
 
-bool nnc::NonAuthoritativeFrontend::DoRemove(const key_type& key)
-	{
-	if ( ! backend )
-		return false;
+	while ( it != reorder_buffer.end() &&
+	        (it->first <= sequence + 1 || filtered) )
+		{
+		if ( it->first > sequence )
+			{
+			ApplyPublication(*it->second);
+			applied = true;
+			}
 
-	backend->SendUpdate(new RemoveUpdate(Topic(), key));
-	return true;
-	}
+		it = reorder_buffer.erase(it);
+		}
 
-bool nnc::NonAuthoritativeFrontend::DoIncrement(const key_type& key,
-                                                const value_type& by)
-	{
-	if ( ! backend )
-		return false;
+	if ( reorder_buffer.empty() )
+		{
+		gap_start = 0;
+		return applied;
+		}
 
-	backend->SendUpdate(new IncrementUpdate(Topic(), key, by));
-	return true;
-	}
+	// Still waiting on sequence + 1; the gap is timed from the last progress.
+	if ( applied || gap_start == 0 )
+		gap_start = current_time();
 
-bool nnc::NonAuthoritativeFrontend::DoDecrement(const key_type& key,
-                                                const value_type& by)
-	{
-	if ( ! backend )
+	if ( reorder_buffer.size() > reorder_limit )
+		{
+		Resync();
 		return false;
+		}
 
-	backend->SendUpdate(new DecrementUpdate(Topic(), key, by));
-	return true;
+	return applied;
 	}
 
-bool nnc::NonAuthoritativeFrontend::DoClear()
+// Heartbeats arrive behind the publications they count, so between two of
+// them a prefix-limited replica should have applied as many as the counts
+// went up by.
+void nnc::NonAuthoritativeFrontend::CheckHeartbeat(
+        const HeartbeatPublication& hb)
 	{
-	if ( ! backend )
-		return false;
+	uint64_t count;
 
-	backend->SendUpdate(new ClearUpdate(Topic()));
-	return true;
+	if ( key_prefix.empty() || ! synchronized ||
+	     ! hb.Count(key_prefix, &count) )
+		return;
+
+	if ( heartbeat_seen )
+		{
+		if ( count - heartbeat_count != applied_since_heartbeat )
+			{
+			Metrics::Add(METRIC_PREFIX_GAPS);
+			Resync();
+			return;
+			}
+		}
+	else if ( hb.Sequence() < sequence )
+		// Older than the snapshot, so the count doesn't line up with it.
+		return;
+
+	heartbeat_seen = true;
+	heartbeat_count = count;
+	applied_since_heartbeat = 0;
 	}
 
-bool nnc::NonAuthoritativeFrontend::DoLookupAsync(const key_type& key,
-                                                  double timeout,
-                                                  lookup_cb cb) const
+// Full replicas notice dropped publications from gaps in sequence numbers,
+// so only partial and prefix-limited ones act on drop markers.
+void nnc::NonAuthoritativeFrontend::CheckDrop(const DropPublication& dp)
+	{
+	uint64_t seq = dp.Sequence();
+
+	if ( partial_capacity )
+		{
+		// Keys known as of the marker can't have missed anything.
+		vector<key_type> keys;
+
+		for ( auto& kv : cached )
+			if ( kv.second.sequence < seq )
+				{
+				kv.second.fetching = true;
+				keys.push_back(kv.first);
+				}
+
+		if ( keys.empty() || Send(new FetchRequest(topic, keys)) )
+			return;
+
+		for ( const auto& key : keys )
+			cached[key].fetching = false;
+
+		RetryLater();
+		return;
+		}
+
+	if ( key_prefix.empty() )
+		return;
+
+	dropped_through = max(dropped_through, seq);
+
+	if ( synchronized && snapshot_sequence < seq )
+		Resync();
+	}
+
+void nnc::NonAuthoritativeFrontend::ApplyPublication(const Publication& pub)
+	{
+	auto cp = counter_node.empty() ? nullptr :
+	          message_cast<CounterPublication>(&pub);
+
+	if ( cp )
+		MergeCounterPublication(cp);
+	else
+		pub.Apply(store, key_prefix);
+
+	if ( ! key_prefix.empty() )
+		{
+		auto vp = message_cast<ValUpdatePublication>(&pub);
+
+		// What the publisher counts for the prefix.
+		if ( vp && vp->Key().compare(0, key_prefix.size(), key_prefix) == 0 )
+			++applied_since_heartbeat;
+		}
+
+	sequence = pub.Sequence();
+	Metrics::Add(METRIC_PUBLICATIONS_APPLIED);
+
+	if ( shared_replica )
+		Mirror(pub);
+	}
+
+// Each publication reaches readers as a whole.
+void nnc::NonAuthoritativeFrontend::Mirror(const Publication& pub)
+	{
+	vector<const key_type*> keys;
+
+	if ( ! pub.ChangedKeys(&keys) )
+		{
+		shared_replica->Assign(store, sequence, synchronized);
+		return;
+		}
+
+	shared_replica->BeginWrite();
+
+	for ( auto key : keys )
+		MirrorKey(*key);
+
+	shared_replica->SetSequence(sequence);
+	shared_replica->EndWrite();
+	}
+
+void nnc::NonAuthoritativeFrontend::MirrorKey(const key_type& key)
+	{
+	auto it = store.find(key);
+
+	if ( it == store.end() )
+		shared_replica->Erase(key);
+	else
+		shared_replica->Set(key, it->second);
+	}
+
+void nnc::NonAuthoritativeFrontend::SetSharedReplica(
+        SharedMemoryReplica* replica)
+	{
+	shared_replica = replica;
+
+	if ( shared_replica )
+		shared_replica->Assign(store, sequence, synchronized);
+	}
+
+void nnc::NonAuthoritativeFrontend::Resync()
+	{
+	// Buffered publications are kept: those newer than the snapshot that
+	// answers this request still apply on top of it.
+	synchronized = false;
+	gap_start = 0;
+	retry_at = 0;
+	heartbeat_seen = false;
+	Metrics::Add(METRIC_RESYNCS);
+
+	if ( shared_replica )
+		shared_replica->SetSynchronized(false);
+
+	if ( partial_capacity )
+		{
+		Refetch();
+		return;
+		}
+
+	while ( reorder_buffer.size() > reorder_limit )
+		reorder_buffer.erase(reorder_buffer.begin());
+
+	uint64_t first_buffered = reorder_buffer.empty() ? 0 :
+	                          reorder_buffer.begin()->first;
+	Send(new SnapshotRequest(topic, key_prefix, first_buffered));
+	}
+
+bool nnc::NonAuthoritativeFrontend::AssignTopicId(uint32_t id)
 	{
 	if ( ! backend )
 		return false;
 
-	backend->SendRequest(new LookupRequest(Topic(), key, timeout, cb));
+	uint32_t old_id = topic_id;
+	topic_id = id;
+	backend->Resubscribe(this, old_id);
+
+	// Anything buffered under a previous ID may not even be of this topic.
+	reorder_buffer.clear();
+	dropped_through = 0;
+	Resync();
 	return true;
 	}
 
-bool nnc::NonAuthoritativeFrontend::DoHasKeyAsync(const key_type& key,
+void nnc::NonAuthoritativeFrontend::EnableCounterMode(const string& node,
+                                                     double arg_flush_interval)
+	{
+	counter_node = node;
+	flush_interval = arg_flush_interval;
+	last_flush = current_time();
+	}
+
+bool nnc::NonAuthoritativeFrontend::CountLocally(const key_type& key,
+                                                 const value_type& by)
+	{
+	OwnCounter& c = own_counters[key];
+
+	if ( by >= 0 )
+		c.local.p += by;
+	else
+		c.local.n -= by;
+
+	store[key] += by;
+
+	if ( shared_replica )
+		MirrorKey(key);
+
+	if ( ! c.dirty )
+		{
+		c.dirty = true;
+		dirty_counters.push_back(key);
+		}
+
+	return true;
+	}
+
+bool nnc::NonAuthoritativeFrontend::FlushCounters()
+	{
+	last_flush = current_time();
+
+	if ( dirty_counters.empty() )
+		return false;
+
+	// States rather than deltas are shipped, so a lost or repeated flush
+	// is harmless: merging takes the maximum.
+	pn_counter_list states;
+	// What was shipped before, in case the update queue rejects this flush.
+	pn_counter_list previous;
+	states.reserve(dirty_counters.size());
+	previous.reserve(dirty_counters.size());
+
+	for ( const auto& key : dirty_counters )
+		{
+		OwnCounter& c = own_counters[key];
+		previous.emplace_back(key, c.shipped);
+		c.dirty = false;
+		c.shipped = c.local;
+		states.emplace_back(key, c.local);
+		}
+
+	dirty_counters.clear();
+
+	if ( Send(new CounterUpdate(Topic(), counter_node, move(states))) )
+		return true;
+
+	// Ship them with the next flush instead.
+	for ( auto& e : previous )
+		{
+		OwnCounter& c = own_counters[e.first];
+		c.dirty = true;
+		c.shipped = e.second;
+		dirty_counters.emplace_back(move(e.first));
+		}
+
+	return false;
+	}
+
+void nnc::NonAuthoritativeFrontend::MergeCounterPublication(
+        const CounterPublication* pub)
+	{
+	bool own = pub->Node() == counter_node;
+
+	for ( const auto& e : pub->Entries() )
+		{
+		if ( e.key.compare(0, key_prefix.size(), key_prefix) != 0 )
+			continue;
+
+		value_type val = e.total;
+		auto it = own_counters.find(e.key);
+
+		if ( it != own_counters.end() )
+			{
+			if ( own )
+				it->second.seen = e.state;
+
+			val += Unmerged(it->second);
+			}
+
+		store[e.key] = val;
+		}
+	}
+
+bool nnc::NonAuthoritativeFrontend::EnablePartialReplica(size_t capacity)
+	{
+	if ( backend || capacity == 0 || ! key_prefix.empty() ||
+	     ! counter_node.empty() )
+		return false;
+
+	partial_capacity = capacity;
+	return true;
+	}
+
+vector<string> nnc::NonAuthoritativeFrontend::Subscriptions(uint32_t id) const
+	{
+	if ( ! partial_capacity )
+		return Publication::Subscriptions(id, key_prefix);
+
+	// Topic-wide publications, e.g. clearing the store, concern all keys.
+	vector<string> rval{encode_topic_id(id) + " *"};
+	rval.reserve(cached.size() + 1);
+
+	for ( const auto& kv : cached )
+		rval.push_back(Publication::KeySubscription(id, kv.first));
+
+	return rval;
+	}
+
+nnc::NonAuthoritativeFrontend::CachedKey&
+nnc::NonAuthoritativeFrontend::Admit(const key_type& key) const
+	{
+	auto res = cached.emplace(key, CachedKey());
+
+	if ( res.second )
+		{
+		clock.push_back(key);
+
+		if ( backend )
+			backend->SubscribeKey(this, key, true);
+		}
+
+	return res.first->second;
+	}
+
+bool nnc::NonAuthoritativeFrontend::LookupPartial(const key_type& key,
                                                   double timeout,
-                                                  haskey_cb cb) const
+                                                  lookup_cb lcb,
+                                                  haskey_cb hcb) const
 	{
+	auto it = cached.find(key);
+
+	if ( it != cached.end() && it->second.known )
+		{
+		Metrics::Add(METRIC_PARTIAL_HITS);
+		it->second.referenced = true;
+		const value_type* v = LookupSync(key);
+
+		if ( lcb )
+			lcb(key, unique_ptr<value_type>(v ? new value_type(*v) : nullptr),
+			    ASYNC_SUCCESS);
+		else
+			hcb(key, v != nullptr, ASYNC_SUCCESS);
+
+		return true;
+		}
+
 	if ( ! backend )
 		return false;
 
-	backend->SendRequest(new HasKeyRequest(Topic(), key, timeout, cb));
+	Metrics::Add(METRIC_PARTIAL_MISSES);
+	CachedKey& c = Admit(key);
+
+	// Lookups of a key already being fetched wait on the same response.
+	// Without a topic ID, the fetch follows once it's assigned.
+	if ( ! c.fetching && topic_id )
+		{
+		if ( ! Send(new FetchRequest(topic, {key})) )
+			return false;
+
+		c.fetching = true;
+		}
+
+	auto d = waiter_deadlines.emplace(current_time() + timeout, key);
+	c.waiters.push_back({d, lcb, hcb});
 	return true;
 	}
 
-bool nnc::NonAuthoritativeFrontend::DoSizeAsync(double timeout,
-                                                size_cb cb) const
+bool nnc::NonAuthoritativeFrontend::DeclareInterest(const key_type& key)
+	{
+	if ( ! partial_capacity )
+		return false;
+
+	CachedKey& c = Admit(key);
+	c.pinned = true;
+
+	if ( ! c.known && ! c.fetching && topic_id &&
+	     Send(new FetchRequest(topic, {key})) )
+		c.fetching = true;
+
+	Evict();
+	return true;
+	}
+
+bool nnc::NonAuthoritativeFrontend::Forget(const key_type& key)
+	{
+	auto it = cached.find(key);
+
+	if ( it == cached.end() || ! it->second.pinned )
+		return false;
+
+	it->second.pinned = false;
+	Evict();
+	return true;
+	}
+
+bool nnc::NonAuthoritativeFrontend::ApplyFetch(const vector<key_type>& keys,
+                                               unique_ptr<Response> response)
+	{
+	FetchResponse* r = message_cast<FetchResponse>(response.get());
+	AsyncResultCode code = ASYNC_SUCCESS;
+
+	if ( ! r )
+		{
+		if ( message_cast<InvalidRequestResponse>(response.get()) )
+			code = ASYNC_INVALID_REQUEST;
+		else
+			code = ASYNC_INVALID_RESPONSE;
+
+		// Keys of interest are fetched again along with the rest.
+		RetryLater();
+		}
+	else
+		{
+		uint64_t seq = r->Sequence();
+
+		for ( const auto& e : r->Entries() )
+			{
+			auto it = cached.find(e.key);
+
+			// Publications may have been newer, or the key evicted meanwhile.
+			if ( it == cached.end() || seq < it->second.sequence )
+				continue;
+
+			if ( e.exists )
+				store[e.key] = e.val;
+			else
+				store.erase(e.key);
+
+			it->second.sequence = seq;
+			it->second.known = true;
+
+			if ( shared_replica )
+				MirrorKey(e.key);
+			}
+
+		sequence = max(sequence, seq);
+
+		if ( ! synchronized )
+			{
+			synchronized = true;
+
+			if ( shared_replica )
+				shared_replica->SetSynchronized(true);
+			}
+		}
+
+	for ( const auto& key : keys )
+		{
+		auto it = cached.find(key);
+
+		if ( it == cached.end() )
+			continue;
+
+		it->second.fetching = false;
+
+		// A publication may have brought the key despite a failed fetch.
+		if ( it->second.known )
+			Answer(key, &it->second, ASYNC_SUCCESS);
+		else if ( code != ASYNC_SUCCESS )
+			Answer(key, &it->second, code);
+		}
+
+	Evict();
+	return r != nullptr;
+	}
+
+void nnc::NonAuthoritativeFrontend::Answer(const key_type& key, Waiter* w,
+                                           AsyncResultCode code)
+	{
+	waiter_deadlines.erase(w->deadline);
+	const value_type* v = code == ASYNC_SUCCESS ? LookupSync(key) : nullptr;
+
+	if ( w->lookup )
+		w->lookup(key, unique_ptr<value_type>(v ? new value_type(*v) : nullptr),
+		          code);
+	else
+		w->haskey(key, v != nullptr, code);
+	}
+
+void nnc::NonAuthoritativeFrontend::Answer(const key_type& key, CachedKey* c,
+                                           AsyncResultCode code)
+	{
+	// Callbacks may look up more keys, or evict this one.
+	vector<Waiter> waiters;
+	waiters.swap(c->waiters);
+
+	for ( auto& w : waiters )
+		Answer(key, &w, code);
+	}
+
+void nnc::NonAuthoritativeFrontend::ExpireWaiters()
+	{
+	double now = current_time();
+
+	while ( ! waiter_deadlines.empty() &&
+	        waiter_deadlines.begin()->first <= now )
+		{
+		auto d = waiter_deadlines.begin();
+		key_type key = d->second;
+		auto& waiters = cached.find(key)->second.waiters;
+		auto w = waiters.begin();
+
+		while ( w->deadline != d )
+			++w;
+
+		Waiter expired = move(*w);
+		waiters.erase(w);
+		Metrics::Add(METRIC_REQUEST_TIMEOUTS);
+		Answer(key, &expired, ASYNC_TIMEOUT);
+		}
+	}
+
+void nnc::NonAuthoritativeFrontend::ApplyPartialPublication(
+        const Publication& pub)
+	{
+	uint64_t seq = pub.Sequence();
+	vector<const key_type*> keys;
+
+	if ( ! pub.ChangedKeys(&keys) )
+		{
+		// Cleared, so no key held exists as of the publication.
+		for ( auto& kv : cached )
+			if ( seq > kv.second.sequence )
+				{
+				store.erase(kv.first);
+				kv.second.sequence = seq;
+				kv.second.known = true;
+				}
+		}
+	else
+		{
+		// The resulting values of the keys changed, whether held or not.
+		kv_store_type changed;
+		pub.Apply(changed);
+
+		for ( auto k : keys )
+			{
+			auto it = cached.find(*k);
+
+			// Keys that only share a subscription prefix with held ones
+			// arrive too.
+			if ( it == cached.end() || seq <= it->second.sequence )
+				continue;
+
+			auto v = changed.find(*k);
+
+			if ( v == changed.end() )
+				store.erase(*k);
+			else
+				store[*k] = v->second;
+
+			it->second.sequence = seq;
+			it->second.known = true;
+			}
+		}
+
+	sequence = max(sequence, seq);
+	Metrics::Add(METRIC_PUBLICATIONS_APPLIED);
+
+	if ( shared_replica )
+		Mirror(pub);
+	}
+
+bool nnc::NonAuthoritativeFrontend::Refetch()
+	{
+	if ( cached.empty() )
+		{
+		synchronized = true;
+
+		if ( shared_replica )
+			shared_replica->SetSynchronized(true);
+
+		return true;
+		}
+
+	// Publications may have been missed, so known keys go along too.
+	vector<key_type> keys;
+	keys.reserve(cached.size());
+
+	for ( auto& kv : cached )
+		{
+		kv.second.fetching = true;
+		keys.push_back(kv.first);
+		}
+
+	if ( Send(new FetchRequest(topic, move(keys))) )
+		return true;
+
+	for ( auto& kv : cached )
+		kv.second.fetching = false;
+
+	RetryLater();
+	return false;
+	}
+
+// Keys of interest and those with lookups waiting on them stay, even if that
+// leaves the replica over its capacity.
+void nnc::NonAuthoritativeFrontend::Evict()
+	{
+	size_t steps = 2 * clock.size();
+
+	while ( cached.size() > partial_capacity && steps-- > 0 )
+		{
+		if ( clock_hand >= clock.size() )
+			clock_hand = 0;
+
+		auto it = cached.find(clock[clock_hand]);
+		CachedKey& c = it->second;
+
+		if ( c.pinned || ! c.waiters.empty() )
+			{
+			++clock_hand;
+			continue;
+			}
+
+		if ( c.referenced )
+			{
+			c.referenced = false;
+			++clock_hand;
+			continue;
+			}
+
+		key_type key = move(clock[clock_hand]);
+		swap(clock[clock_hand], clock.back());
+		clock.pop_back();
+		cached.erase(it);
+		store.erase(key);
+		Metrics::Add(METRIC_PARTIAL_EVICTIONS);
+
+		if ( backend )
+			backend->SubscribeKey(this, key, false);
+
+		if ( shared_replica )
+			MirrorKey(key);
+		}
+	}
+
+void nnc::NonAuthoritativeFrontend::RetryLater()
+	{
+	if ( retry_at == 0 )
+		retry_at = current_time() + retry_interval;
+	}
+
+void nnc::NonAuthoritativeFrontend::ProcessTimers()
+	{
+	CheckGap();
+	ExpireWaiters();
+
+	if ( retry_at && current_time() >= retry_at )
+		{
+		retry_at = 0;
+
+		// Without an ID, it was the topic ID request that failed.
+		if ( topic_id )
+			Resync();
+		else
+			Send(new TopicIdRequest(topic));
+		}
+
+	if ( ! counter_node.empty() &&
+	     current_time() >= last_flush + flush_interval )
+		FlushCounters();
+	}
+
+bool nnc::NonAuthoritativeFrontend::NextDeadline(double* deadline) const
+	{
+	bool rval = GapDeadline(deadline);
+
+	if ( retry_at && (! rval || retry_at < *deadline) )
+		{
+		*deadline = retry_at;
+		rval = true;
+		}
+
+	if ( ! waiter_deadlines.empty() &&
+	     (! rval || waiter_deadlines.begin()->first < *deadline) )
+		{
+		*deadline = waiter_deadlines.begin()->first;
+		rval = true;
+		}
+
+	if ( counter_node.empty() || dirty_counters.empty() )
+		return rval;
+
+	double flush_deadline = last_flush + flush_interval;
+
+	if ( ! rval || flush_deadline < *deadline )
+		*deadline = flush_deadline;
+
+	return true;
+	}
+
+bool nnc::NonAuthoritativeFrontend::Send(Update* update)
 	{
+	unique_ptr<Update> u(update);
+
 	if ( ! backend )
 		return false;
 
-	backend->SendRequest(new SizeRequest(Topic(), timeout, cb));
+	u->SetTopicId(topic_id);
+	return backend->SendUpdate(u.release());
+	}
+
+bool nnc::NonAuthoritativeFrontend::Send(Request* request) const
+	{
+	unique_ptr<Request> r(request);
+
+	if ( ! backend )
+		return false;
+
+	r->SetTopicId(topic_id);
+	return backend->SendRequest(r.release());
+	}
+
+bool nnc::NonAuthoritativeFrontend::CheckGap()
+	{
+	double deadline;
+
+	if ( ! GapDeadline(&deadline) )
+		return false;
+
+	if ( current_time() < deadline )
+		return false;
+
+	Resync();
+	return true;
+	}
+
+bool nnc::NonAuthoritativeFrontend::GapDeadline(double* deadline) const
+	{
+	if ( ! synchronized || gap_start == 0 )
+		return false;
+
+	*deadline = gap_start + gap_timeout;
+	return true;
+	}
+
+bool nnc::NonAuthoritativeFrontend::Pair(NonAuthoritativeBackend* arg_backend)
+	{
+	if ( backend )
+		return false;
+
+	// The backend must already be connected so that update publications may
+	// be received _before_ the snapshot request is made, guaranteeing that the
+	// received state snapshot is newer than oldest update publication.
+	assert(arg_backend->Connected());
+
+	if ( ! arg_backend->Connected() )
+		return false;
+
+	backend = arg_backend;
+	backend->AddFrontend(this);
 	return true;
 	}
+
+bool nnc::NonAuthoritativeFrontend::Unpair()
+	{
+	if ( ! backend )
+		return false;
+
+	backend->RemFrontend(this);
+	backend = nullptr;
+	return true;
+	}
+
+bool nnc::NonAuthoritativeFrontend::DoInsert(const key_type& key,
+                                             const value_type& val)
+	{
+	return Send(new InsertUpdate(Topic(), key, val));
+	}
+
+bool nnc::NonAuthoritativeFrontend::DoRemove(const key_type& key)
+	{
+	return Send(new RemoveUpdate(Topic(), key));
+	}
+
+bool nnc::NonAuthoritativeFrontend::DoIncrement(const key_type& key,
+                                                const value_type& by)
+	{
+	if ( ! counter_node.empty() )
+		return CountLocally(key, by);
+
+	return Send(new IncrementUpdate(Topic(), key, by));
+	}
+
+bool nnc::NonAuthoritativeFrontend::DoDecrement(const key_type& key,
+                                                const value_type& by)
+	{
+	if ( ! counter_node.empty() )
+		return CountLocally(key, -by);
+
+	return Send(new DecrementUpdate(Topic(), key, by));
+	}
+
+bool nnc::NonAuthoritativeFrontend::DoClear()
+	{
+	return Send(new ClearUpdate(Topic()));
+	}
+
+bool nnc::NonAuthoritativeFrontend::DoWrite(const WriteBatch& batch)
+	{
+	return Send(new BatchUpdate(Topic(), batch));
+	}
+
+bool nnc::NonAuthoritativeFrontend::DoAtomic(AtomicOp op, const key_type& key,
+                                             const value_type& operand,
+                                             const value_type& expected,
+                                             double timeout, atomic_cb cb)
+	{
+	if ( ! cb )
+		return Send(new AtomicUpdate(Topic(), op, key, operand, expected));
+
+	return Send(new AtomicRequest(Topic(), op, key, operand, expected, timeout,
+	                              cb));
+	}
+
+bool nnc::NonAuthoritativeFrontend::DoLookupAsync(const key_type& key,
+                                                  double timeout,
+                                                  lookup_cb cb) const
+	{
+	if ( partial_capacity )
+		return LookupPartial(key, timeout, cb, nullptr);
+
+	return Send(new LookupRequest(Topic(), key, timeout, cb));
+	}
+
+bool nnc::NonAuthoritativeFrontend::DoHasKeyAsync(const key_type& key,
+                                                  double timeout,
+                                                  haskey_cb cb) const
+	{
+	if ( partial_capacity )
+		return LookupPartial(key, timeout, nullptr, cb);
+
+	return Send(new HasKeyRequest(Topic(), key, timeout, cb));
+	}
+
+bool nnc::NonAuthoritativeFrontend::DoSizeAsync(double timeout,
+                                                size_cb cb) const
+	{
+	return Send(new SizeRequest(Topic(), timeout, cb));
+	}
+
+bool nnc::NonAuthoritativeFrontend::DoScanAsync(const key_type& begin,
+                                                const key_type& end,
+                                                size_t limit, double timeout,
+                                                scan_cb cb) const
+	{
+	return Send(new ScanRequest(Topic(), begin, end, limit, timeout, cb));
+	}
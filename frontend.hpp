@@ -7,9 +7,17 @@
 #include <cstdint>
 #include <cstdio>
 #include <string>
+#include <vector>
 #include <unordered_map>
 #include <unordered_set>
-#include <queue>
+#include <map>
+
+// The awaitable queries in coro.hpp need C++20 coroutines.
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#define NANOCLONE_HAVE_COROUTINES 1
+#endif
+#endif
 
 namespace nnc {
 
@@ -18,6 +26,54 @@ class AuthoritativeBackend;
 class NonAuthoritativeBackend;
 class Response;
 class Publication;
+class Request;
+class Update;
+class CounterPublication;
+class HeartbeatPublication;
+class DropPublication;
+class SharedMemoryReplica;
+class LookupAwaitable;
+class HasKeyAwaitable;
+class SizeAwaitable;
+
+// A group of mutations that the authoritative store applies together under a
+// single sequence number, and that travels as one message each way.
+class WriteBatch {
+public:
+
+	enum OpType { INSERT, REMOVE, INCREMENT, DECREMENT };
+
+	struct Op {
+		OpType type;
+		key_type key;
+		value_type val;
+	};
+
+	void Insert(const key_type& key, const value_type& val)
+		{ ops.push_back({INSERT, key, val}); }
+
+	void Remove(const key_type& key)
+		{ ops.push_back({REMOVE, key, 0}); }
+
+	void Increment(const key_type& key, const value_type& by)
+		{ ops.push_back({INCREMENT, key, by}); }
+
+	void Decrement(const key_type& key, const value_type& by)
+		{ ops.push_back({DECREMENT, key, by}); }
+
+	const std::vector<Op>& Ops() const
+		{ return ops; }
+
+	bool Empty() const
+		{ return ops.empty(); }
+
+	void Clear()
+		{ ops.clear(); }
+
+private:
+
+	std::vector<Op> ops;
+};
 
 class Frontend {
 public:
@@ -30,6 +86,13 @@ public:
 	const std::string& Topic() const
 		{ return topic; }
 
+	uint64_t Sequence() const
+		{ return sequence; }
+
+	// Compact ID the authoritative side assigned to the topic, or 0.
+	uint32_t TopicId() const
+		{ return topic_id; }
+
 	// TODO: add a param for expiry time of this key.
 	bool Insert(const key_type& key, const value_type& val)
 		{ return DoInsert(key, val); }
@@ -46,6 +109,38 @@ public:
 	bool Clear()
 		{ return DoClear(); }
 
+	// Increments and decrements of missing keys are skipped, as they are
+	// outside of a batch.
+	bool Write(const WriteBatch& batch)
+		{ return batch.Empty() || DoWrite(batch); }
+
+	// Atomic operations are fire-and-forget without a callback.  With one,
+	// it gets the outcome as a reply from the authoritative store.
+	bool CompareAndSwap(const key_type& key, const value_type& expected,
+	                    const value_type& desired, atomic_cb cb = nullptr,
+	                    double timeout = 5)
+		{ return DoAtomic(ATOMIC_CAS, key, desired, expected, timeout, cb); }
+
+	bool FetchAdd(const key_type& key, const value_type& by,
+	              atomic_cb cb = nullptr, double timeout = 5)
+		{ return DoAtomic(ATOMIC_FETCH_ADD, key, by, 0, timeout, cb); }
+
+	bool UpsertIncrement(const key_type& key, const value_type& by,
+	                     atomic_cb cb = nullptr, double timeout = 5)
+		{ return DoAtomic(ATOMIC_UPSERT_ADD, key, by, 0, timeout, cb); }
+
+	bool InsertIfAbsent(const key_type& key, const value_type& val,
+	                    atomic_cb cb = nullptr, double timeout = 5)
+		{ return DoAtomic(ATOMIC_INSERT_IF_ABSENT, key, val, 0, timeout, cb); }
+
+	bool Max(const key_type& key, const value_type& val,
+	         atomic_cb cb = nullptr, double timeout = 5)
+		{ return DoAtomic(ATOMIC_MAX, key, val, 0, timeout, cb); }
+
+	bool Min(const key_type& key, const value_type& val,
+	         atomic_cb cb = nullptr, double timeout = 5)
+		{ return DoAtomic(ATOMIC_MIN, key, val, 0, timeout, cb); }
+
 	const value_type* LookupSync(const key_type& key) const;
 
 	bool HasKeySync(const key_type& key) const
@@ -63,14 +158,62 @@ public:
 	bool SizeAsync(double timeout, size_cb cb) const
 		{ return DoSizeAsync(timeout, cb); }
 
+#ifdef NANOCLONE_HAVE_COROUTINES
+	// co_await-able forms of the above, defined in coro.hpp.
+	LookupAwaitable Lookup(const key_type& key, double timeout = 5) const;
+	HasKeyAwaitable HasKey(const key_type& key, double timeout = 5) const;
+	SizeAwaitable Size(double timeout = 5) const;
+#endif
+
+	// Delivers up to 'limit' pairs with keys in [begin, end), in key order.
+	// An empty 'end' means the range is unbounded.
+	bool ScanAsync(const key_type& begin, const key_type& end, size_t limit,
+	               double timeout, scan_cb cb) const
+		{ return limit && DoScanAsync(begin, end, limit, timeout, cb); }
+
+	bool ScanPrefixAsync(const key_type& prefix, size_t limit, double timeout,
+	                     scan_cb cb) const
+		{ return ScanAsync(prefix, PrefixEnd(prefix), limit, timeout, cb); }
+
+	// The smallest key greater than all keys starting with 'prefix', or an
+	// empty key if there is none.
+	static key_type PrefixEnd(const key_type& prefix);
+
+	// Prints every pair, so it's for debugging small stores.  StoreExporter
+	// (store_export.hpp) writes large ones without stalling an event loop.
 	void DumpDebug(FILE* out) const;
 
+	// A copy of the pairs, i.e. a consistent image of the store that stays
+	// valid while it changes.
+	kv_pair_list Pairs() const
+		{ return kv_pair_list(store.begin(), store.end()); }
+
+	// A SnapshotResponse of the store as of Sequence().  A non-empty key
+	// prefix limits it to keys starting with the prefix.
+	std::unique_ptr<Response>
+	Snapshot(const key_type& key_prefix = key_type()) const
+		{ return DoSnapshot(key_prefix); }
+
+	// Returns whether keys in the range remain beyond 'limit', in which case
+	// 'next' is set to the first of them.
+	bool ScanSync(const key_type& begin, const key_type& end, size_t limit,
+	              kv_pair_list* pairs, key_type* next) const
+		{ return DoScanSync(begin, end, limit, pairs, next); }
+
 protected:
 
 	std::string topic;
+	uint32_t topic_id = 0;
 	kv_store_type store;
 	uint64_t sequence = 0;
 
+	// Both take a pass over the whole store.
+	virtual std::unique_ptr<Response>
+	        DoSnapshot(const key_type& key_prefix) const;
+	virtual bool DoScanSync(const key_type& begin, const key_type& end,
+	                        size_t limit, kv_pair_list* pairs,
+	                        key_type* next) const;
+
 private:
 
 	virtual bool DoInsert(const key_type& key, const value_type& val) = 0;
@@ -78,12 +221,19 @@ private:
 	virtual bool DoIncrement(const key_type& key, const value_type& by) = 0;
 	virtual bool DoDecrement(const key_type& key, const value_type& by) = 0;
 	virtual bool DoClear() = 0;
+	virtual bool DoWrite(const WriteBatch& batch) = 0;
+	virtual bool DoAtomic(AtomicOp op, const key_type& key,
+	                      const value_type& operand, const value_type& expected,
+	                      double timeout, atomic_cb cb) = 0;
 
 	virtual bool DoLookupAsync(const key_type& key, double timeout,
 	                           lookup_cb cb) const = 0;
 	virtual bool DoHasKeyAsync(const key_type& key, double timeout,
 	                           haskey_cb cb) const = 0;
 	virtual bool DoSizeAsync(double timeout, size_cb cb) const = 0;
+	virtual bool DoScanAsync(const key_type& begin, const key_type& end,
+	                         size_t limit, double timeout,
+	                         scan_cb cb) const = 0;
 };
 
 class Response;
@@ -91,13 +241,28 @@ class Response;
 class AuthoritativeFrontend : public Frontend {
 public:
 
-	AuthoritativeFrontend(const std::string& topic)
-		: Frontend(topic) {}
+	// Each is assigned a topic ID, unique within the process.
+	AuthoritativeFrontend(const std::string& topic);
 
 	bool AddBackend(AuthoritativeBackend* backend);
 	bool RemBackend(AuthoritativeBackend* backend);
 
-	std::unique_ptr<Response> Snapshot() const;
+	// Merges a node's PN-counter states for some keys, publishing the
+	// resulting totals under a single sequence number.
+	bool MergeCounters(const std::string& node, const pn_counter_list& states);
+
+	// Executes an atomic operation, returning whether its condition held.
+	// If given, 'result' is set to the key's value afterwards.
+	bool Atomic(AtomicOp op, const key_type& key, const value_type& operand,
+	            const value_type& expected,
+	            std::unique_ptr<value_type>* result = nullptr);
+
+	// Maintains an ordered index of keys so scans cost O(log n + k) rather
+	// than a pass over the whole store.
+	void SetOrderedIndex(bool enable);
+
+	bool HasOrderedIndex() const
+		{ return ordered_keys != nullptr; }
 
 private:
 
@@ -106,22 +271,61 @@ private:
 	virtual bool DoIncrement(const key_type& key,const value_type& by) override;
 	virtual bool DoDecrement(const key_type& key,const value_type& by) override;
 	virtual bool DoClear() override;
+	virtual bool DoWrite(const WriteBatch& batch) override;
+	virtual bool DoAtomic(AtomicOp op, const key_type& key,
+	                      const value_type& operand, const value_type& expected,
+	                      double timeout, atomic_cb cb) override;
 
 	virtual bool DoLookupAsync(const key_type& key, double timeout,
 	                           lookup_cb cb) const override;
 	virtual bool DoHasKeyAsync(const key_type& key, double timeout,
 	                           haskey_cb cb) const override;
 	virtual bool DoSizeAsync(double timeout, size_cb cb) const override;
+	virtual bool DoScanAsync(const key_type& begin, const key_type& end,
+	                         size_t limit, double timeout,
+	                         scan_cb cb) const override;
+
+	// These use the ordered index, if any.
+	virtual std::unique_ptr<Response>
+	        DoSnapshot(const key_type& key_prefix) const override;
+	virtual bool DoScanSync(const key_type& begin, const key_type& end,
+	                        size_t limit, kv_pair_list* pairs,
+	                        key_type* next) const override;
+
+	void StoreSet(const key_type& key, const value_type& val);
+	bool StoreErase(const key_type& key);
+	// Applies an admitted insert and publishes it.
+	void InsertAndPublish(const key_type& key, const value_type& val);
+	// Whether all backends have room to publish a change, so that one they
+	// can't take is rejected before it's made.  Blocking for room runs the
+	// backends' IO, which applies updates pulled from subscribers, so
+	// mutators must call this before acting on the store: iterators and
+	// values looked up earlier may be stale or dangling afterwards.
+	bool CanPublish() const;
+	void Publish(std::shared_ptr<Publication> publication);
 
 	std::unordered_set<AuthoritativeBackend*> backends;
+	std::unique_ptr<ordered_index_type> ordered_keys;
+	// Per-key, per-node state of keys updated as PN-counters.
+	std::unordered_map<key_type,
+	                   std::unordered_map<std::string, pn_counter>> counters;
 };
 
 
 class NonAuthoritativeFrontend : public Frontend {
 public:
 
-	NonAuthoritativeFrontend(const std::string& topic)
-		: Frontend(topic) {}
+	// A non-empty key prefix limits the replica to keys starting with it:
+	// only the matching part of a snapshot is requested, and publications
+	// about other keys are filtered out by the SUB socket.  Since the
+	// publications seen are then a subset of the topic's sequence, they're
+	// applied in arrival order and gaps can't be detected.
+	NonAuthoritativeFrontend(const std::string& topic,
+	                         const key_type& arg_key_prefix = key_type())
+		: Frontend(topic), key_prefix(arg_key_prefix) {}
+
+	const key_type& KeyPrefix() const
+		{ return key_prefix; }
 
 	bool Pair(NonAuthoritativeBackend* backend);
 	bool Unpair();
@@ -129,23 +333,197 @@ public:
 	bool ProcessPublication(std::unique_ptr<Publication> pub);
 	bool ApplySnapshot(std::unique_ptr<Response> snapshot);
 
+	// Makes this a partial replica, before pairing: rather than the whole
+	// topic, it holds the keys looked up asynchronously or declared of
+	// interest, up to 'capacity' of them (missing keys included), and
+	// subscribes to publications about those keys alone.  Lookups of keys
+	// not held fetch them from the server, and keys not used since the
+	// last sweep are evicted once over capacity, CLOCK-style.  The sync
+	// queries, scans and sizes only see the keys held.  As with a key
+	// prefix, publications are applied in arrival order.  Not compatible
+	// with a key prefix or counter mode.
+	bool EnablePartialReplica(size_t capacity);
+
+	bool PartialReplica() const
+		{ return partial_capacity > 0; }
+
+	// Fetches a key, if not held yet, and keeps it up to date until
+	// Forget(), exempt from eviction.
+	bool DeclareInterest(const key_type& key);
+
+	// Lets a key of interest be evicted again.
+	bool Forget(const key_type& key);
+
+	// Called with the answer to a FetchRequest for the keys.
+	bool ApplyFetch(const std::vector<key_type>& keys,
+	                std::unique_ptr<Response> response);
+
+	// The SUB socket subscriptions that select what the replica holds.
+	std::vector<std::string> Subscriptions(uint32_t id) const;
+
+	// Whether a snapshot was applied and no resync is pending since.
+	bool Synchronized() const
+		{ return synchronized; }
+
+	// Publications that arrive ahead of a missing sequence number are held
+	// in a reorder buffer, and a snapshot is only requested once the gap
+	// has persisted for the timeout or the buffer exceeds its limit.
+	void SetReorderLimit(size_t limit)
+		{ reorder_limit = limit; }
+
+	void SetGapTimeout(double seconds)
+		{ gap_timeout = seconds; }
+
+	// Called with the ID the authoritative side has for the topic.  Topic
+	// subscriptions are by ID, so a new one means resubscribing and
+	// resynchronizing.
+	bool AssignTopicId(uint32_t id);
+
+	// A topic ID or snapshot request that failed, e.g. as it reached a read
+	// replica that isn't synchronized yet, is sent again after this long.
+	void SetRetryInterval(double seconds)
+		{ retry_interval = seconds; }
+
+	// Called when the answer to a topic ID or snapshot request was an error.
+	void RetryLater();
+
+	// Requests a snapshot if a sequence gap outlived the gap timeout.
+	// Returns whether that happened.
+	bool CheckGap();
+
+	// Returns false if there's no gap being waited on.
+	bool GapDeadline(double* deadline) const;
+
+	// In counter mode, Increment/Decrement apply to the local replica at
+	// once and are shipped as this node's PN-counter state every flush
+	// interval, for the authoritative side to merge.  The node name must be
+	// unique to this process' lifetime: a reused one has its new counts
+	// ignored until they exceed the old ones.  Keys counted this way should
+	// not otherwise be modified.
+	void EnableCounterMode(const std::string& node, double flush_interval = 1);
+
+	bool CounterMode() const
+		{ return ! counter_node.empty(); }
+
+	bool FlushCounters();
+
+	// Runs whatever timed work is due: gap checks, retries and counter
+	// flushes.
+	void ProcessTimers();
+
+	// Returns false if there's no timed work pending.
+	bool NextDeadline(double* deadline) const;
+
+	// Mirrors the replica into shared memory, for other processes on the
+	// host to read with a SharedMemoryReader.  Null stops mirroring.
+	void SetSharedReplica(SharedMemoryReplica* replica);
+
 private:
 
+	struct OwnCounter {
+		pn_counter local;
+		pn_counter shipped;
+		// As last reflected in a publication from the authoritative side.
+		pn_counter seen;
+		bool dirty = false;
+	};
+
+	static value_type Unmerged(const OwnCounter& c)
+		{ return (c.local.p - c.seen.p) - (c.local.n - c.seen.n); }
+
+	using deadline_map = std::multimap<double, key_type>;
+
+	// A lookup waiting on a key a partial replica is fetching.
+	struct Waiter {
+		deadline_map::iterator deadline;
+		lookup_cb lookup;
+		haskey_cb haskey;
+	};
+
+	// A key held by a partial replica.  Its value, if any, is in the store.
+	struct CachedKey {
+		// That of the fetch or publication the value is from.
+		uint64_t sequence = 0;
+		bool known = false;
+		bool fetching = false;
+		bool pinned = false;
+		// Set when used, cleared as the CLOCK hand passes.
+		bool referenced = true;
+		std::vector<Waiter> waiters;
+	};
+
+	bool LookupPartial(const key_type& key, double timeout, lookup_cb lcb,
+	                   haskey_cb hcb) const;
+	CachedKey& Admit(const key_type& key) const;
+	void ApplyPartialPublication(const Publication& pub);
+	void Answer(const key_type& key, CachedKey* c, AsyncResultCode code);
+	void Answer(const key_type& key, Waiter* w, AsyncResultCode code);
+	void ExpireWaiters();
+	bool Refetch();
+	void Evict();
+
+	bool CountLocally(const key_type& key, const value_type& by);
+	void MergeCounterPublication(const CounterPublication* pub);
+	void ApplyPublication(const Publication& pub);
+	bool ApplyReorderBuffer();
+	void CheckHeartbeat(const HeartbeatPublication& hb);
+	void CheckDrop(const DropPublication& dp);
+	void Mirror(const Publication& pub);
+	void MirrorKey(const key_type& key);
+	void Resync();
+	bool Send(Update* update);
+	bool Send(Request* request) const;
+
 	virtual bool DoInsert(const key_type& key, const value_type& val) override;
 	virtual bool DoRemove(const key_type& key) override;
 	virtual bool DoIncrement(const key_type& key,const value_type& by) override;
 	virtual bool DoDecrement(const key_type& key,const value_type& by) override;
 	virtual bool DoClear() override;
+	virtual bool DoWrite(const WriteBatch& batch) override;
+	virtual bool DoAtomic(AtomicOp op, const key_type& key,
+	                      const value_type& operand, const value_type& expected,
+	                      double timeout, atomic_cb cb) override;
 
 	virtual bool DoLookupAsync(const key_type& key, double timeout,
 	                           lookup_cb cb) const override;
 	virtual bool DoHasKeyAsync(const key_type& key, double timeout,
 	                           haskey_cb cb) const override;
 	virtual bool DoSizeAsync(double timeout, size_cb cb) const override;
+	virtual bool DoScanAsync(const key_type& begin, const key_type& end,
+	                         size_t limit, double timeout,
+	                         scan_cb cb) const override;
 
 	NonAuthoritativeBackend* backend = nullptr;
-	std::queue<std::unique_ptr<Publication>> pub_backlog;
+	key_type key_prefix;
+	std::map<uint64_t, std::unique_ptr<Publication>> reorder_buffer;
+	size_t reorder_limit = 4096;
+	double gap_timeout = 1.0;
+	double gap_start = 0;
+	// With a key prefix: whether a heartbeat's count was taken since the
+	// last snapshot, that count, and the publications applied since.
+	bool heartbeat_seen = false;
+	uint64_t heartbeat_count = 0;
+	uint64_t applied_since_heartbeat = 0;
+	// With a key prefix: the sequence of the last snapshot applied, and the
+	// newest drop marker's, which later snapshots must cover.
+	uint64_t snapshot_sequence = 0;
+	uint64_t dropped_through = 0;
+	double retry_interval = 1;
+	double retry_at = 0;
 	bool synchronized = false;
+	std::string counter_node;
+	double flush_interval = 1;
+	double last_flush = 0;
+	std::unordered_map<key_type, OwnCounter> own_counters;
+	std::vector<key_type> dirty_counters;
+	SharedMemoryReplica* shared_replica = nullptr;
+	// Partial replicas.  Lookups are const, yet admit keys and wait on them.
+	size_t partial_capacity = 0;
+	mutable std::unordered_map<key_type, CachedKey> cached;
+	// The CLOCK's ring of cached keys, in no particular order.
+	mutable std::vector<key_type> clock;
+	size_t clock_hand = 0;
+	mutable deadline_map waiter_deadlines;
 };
 
 } // namespace nnc
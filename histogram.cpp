@@ -0,0 +1,98 @@
+#include "histogram.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+static const unsigned sub_bucket_bits = 6;
+static const uint64_t sub_bucket_count = 1 << sub_bucket_bits;
+static const size_t bucket_count = (64 - sub_bucket_bits + 1) *
+                                   sub_bucket_count;
+
+static unsigned highest_bit(uint64_t v)
+	{
+	return 63 - __builtin_clzll(v);
+	}
+
+nnc::Histogram::Histogram()
+	: counts(bucket_count, 0)
+	{
+	}
+
+size_t nnc::Histogram::BucketIndex(uint64_t value)
+	{
+	if ( value < sub_bucket_count * 2 )
+		return value;
+
+	// The top bits of the value select the sub-bucket.
+	unsigned shift = highest_bit(value) - sub_bucket_bits;
+	return (shift + 1) * sub_bucket_count +
+	       ((value >> shift) - sub_bucket_count);
+	}
+
+uint64_t nnc::Histogram::BucketHighest(size_t index)
+	{
+	if ( index < sub_bucket_count * 2 )
+		return index;
+
+	unsigned shift = index / sub_bucket_count - 1;
+	uint64_t sub = index % sub_bucket_count + sub_bucket_count;
+	return ((sub + 1) << shift) - 1;
+	}
+
+void nnc::Histogram::Record(uint64_t value)
+	{
+	++counts[BucketIndex(value)];
+
+	if ( count == 0 || value < min )
+		min = value;
+
+	if ( value > max )
+		max = value;
+
+	++count;
+	sum += value;
+	}
+
+void nnc::Histogram::Merge(const Histogram& other)
+	{
+	if ( other.count == 0 )
+		return;
+
+	for ( size_t i = 0; i < bucket_count; ++i )
+		counts[i] += other.counts[i];
+
+	if ( count == 0 || other.min < min )
+		min = other.min;
+
+	max = std::max(max, other.max);
+	count += other.count;
+	sum += other.sum;
+	}
+
+void nnc::Histogram::Reset()
+	{
+	fill(counts.begin(), counts.end(), 0);
+	count = sum = min = max = 0;
+	}
+
+uint64_t nnc::Histogram::Percentile(double percentile) const
+	{
+	if ( count == 0 )
+		return 0;
+
+	double p = std::min(std::max(percentile, 0.0), 100.0);
+	uint64_t rank = std::max<uint64_t>(ceil(p / 100 * count), 1);
+	uint64_t seen = 0;
+
+	for ( size_t i = 0; i < bucket_count; ++i )
+		{
+		seen += counts[i];
+
+		if ( seen >= rank )
+			return std::min(BucketHighest(i), max);
+		}
+
+	return max;
+	}
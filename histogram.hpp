@@ -0,0 +1,54 @@
+#ifndef NANOCLONE_HISTOGRAM_HPP
+#define NANOCLONE_HISTOGRAM_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace nnc {
+
+// Log-linear histogram of non-negative samples, e.g. latencies in ns.  Like
+// HdrHistogram, each power of two is split into 64 sub-buckets, so recorded
+// values are kept to within about 1.6% at a fixed ~30KB of memory.
+class Histogram {
+public:
+
+	Histogram();
+
+	void Record(uint64_t value);
+
+	void Merge(const Histogram& other);
+
+	void Reset();
+
+	uint64_t Count() const
+		{ return count; }
+
+	uint64_t Min() const
+		{ return count ? min : 0; }
+
+	uint64_t Max() const
+		{ return max; }
+
+	double Mean() const
+		{ return count ? double(sum) / count : 0; }
+
+	// Returns the highest value equivalent to that at the given percentile
+	// (0-100), or 0 if nothing was recorded.
+	uint64_t Percentile(double percentile) const;
+
+private:
+
+	static size_t BucketIndex(uint64_t value);
+	static uint64_t BucketHighest(size_t index);
+
+	std::vector<uint64_t> counts;
+	uint64_t count = 0;
+	uint64_t sum = 0;
+	uint64_t min = 0;
+	uint64_t max = 0;
+};
+
+} // namespace nnc
+
+#endif // NANOCLONE_HISTOGRAM_HPP
@@ -0,0 +1,499 @@
+#include "loadgen.hpp"
+#include "frontend.hpp"
+#include "backend.hpp"
+#include "histogram.hpp"
+#include "util.hpp"
+
+#include <atomic>
+#include <cinttypes>
+#include <cstdio>
+#include <deque>
+#include <list>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+using namespace std;
+using namespace nnc;
+
+static const string topic = "loadgen";
+
+enum OpType {
+	OP_INSERT,
+	OP_INCREMENT,
+	OP_LOOKUP,
+	OP_SNAPSHOT,
+	NUM_OP_TYPES,
+};
+
+static const char* op_names[NUM_OP_TYPES] = {
+	"insert", "increment", "lookup", "snapshot",
+};
+
+struct OpStats {
+	Histogram latency;
+	uint64_t started = 0;
+	uint64_t failed = 0;
+};
+
+// A write counts as done once the writer's own replica reflects it.
+struct PendingWrite {
+	OpType type;
+	key_type key;
+	value_type expected;
+	double start;
+};
+
+struct SimClient {
+	SimClient(unsigned arg_id, unsigned keys)
+		: id(arg_id), frontend(topic), increments(keys, 0) {}
+
+	unsigned id;
+	NonAuthoritativeBackend backend;
+	NonAuthoritativeFrontend frontend;
+	deque<PendingWrite> writes;
+	// Expected value of each of the client's counters.
+	vector<value_type> increments;
+	value_type last_insert = 0;
+	uint64_t lookups = 0;
+	uint64_t joins = 0;
+	double next_op = 0;
+};
+
+// A snapshot operation is a new replica joining: it's done once the replica
+// is synchronized.
+struct Joiner {
+	SimClient* owner;
+	unique_ptr<NonAuthoritativeBackend> backend;
+	unique_ptr<NonAuthoritativeFrontend> frontend;
+	double start;
+};
+
+static vector<string> get_addrs(const LoadgenOptions& o)
+	{
+	vector<string> rval;
+
+	for ( unsigned long i = 0; i < 3; ++i )
+		{
+		stringstream ss;
+
+		if ( o.transport == "ipc" )
+			ss << "ipc:///tmp/nanoclone-loadgen-" << getpid() << "-" << i
+			   << ".ipc";
+		else
+			ss << "tcp://127.0.0.1:" << o.start_port + i;
+
+		rval.push_back(ss.str());
+		}
+
+	return rval;
+	}
+
+static key_type insert_key(unsigned client, unsigned k)
+	{
+	stringstream ss;
+	ss << "c" << client << ":i" << k;
+	return ss.str();
+	}
+
+static key_type counter_key(unsigned client, unsigned k)
+	{
+	stringstream ss;
+	ss << "c" << client << ":n" << k;
+	return ss.str();
+	}
+
+static uint64_t to_ns(double seconds)
+	{
+	return seconds > 0 ? uint64_t(seconds * 1e9) : 0;
+	}
+
+static void serve(const LoadgenOptions& o, const vector<string>& addrs,
+                  const atomic<bool>* stop, atomic<int>* state)
+	{
+	AuthoritativeFrontend frontend(topic);
+	AuthoritativeBackend backend;
+
+	// Counters must exist to be incremented, and lookups should find values.
+	for ( unsigned c = 0; c < o.clients; ++c )
+		for ( unsigned k = 0; k < o.keys; ++k )
+			{
+			frontend.Insert(insert_key(c, k), 0);
+			frontend.Insert(counter_key(c, k), 0);
+			}
+
+	frontend.AddBackend(&backend);
+
+	if ( ! backend.Listen(addrs[0], addrs[1], addrs[2]) )
+		{
+		*state = -1;
+		return;
+		}
+
+	*state = 1;
+
+	while ( ! *stop )
+		{
+		int nfds = 0;
+		fd_set rfds;
+		fd_set wfds;
+		unique_ptr<timeval> to(new timeval(to_timeval(0.1)));
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+
+		if ( ! backend.GetSelectParams(&nfds, &rfds, &wfds, nullptr, &to) )
+			break;
+
+		if ( select(nfds, &rfds, &wfds, nullptr, to.get()) < 0 )
+			break;
+
+		backend.ProcessIO();
+		}
+
+	backend.Close();
+	}
+
+class LoadGenerator {
+public:
+
+	LoadGenerator(const LoadgenOptions& arg_options,
+	              const vector<string>& arg_addrs)
+		: options(arg_options), addrs(arg_addrs),
+		  op_dist({double(arg_options.insert_weight),
+		           double(arg_options.increment_weight),
+		           double(arg_options.lookup_weight),
+		           double(arg_options.snapshot_weight)})
+		{}
+
+	bool Connect();
+
+	// Waits for every client's replica to be synchronized.
+	bool Warmup(double timeout);
+
+	bool Run();
+
+	void Report() const;
+
+private:
+
+	bool Poll(double until);
+	void StartOp(SimClient* c, double start);
+	void CheckCompletions(double now);
+
+	bool Idle(const SimClient* c) const
+		{ return c->writes.empty() && c->lookups == 0 && c->joins == 0; }
+
+	const LoadgenOptions& options;
+	vector<string> addrs;
+	vector<unique_ptr<SimClient>> clients;
+	list<Joiner> joiners;
+	mt19937 rng;
+	discrete_distribution<int> op_dist;
+	OpStats stats[NUM_OP_TYPES];
+	double elapsed = 0;
+};
+
+bool LoadGenerator::Connect()
+	{
+	for ( unsigned i = 0; i < options.clients; ++i )
+		{
+		unique_ptr<SimClient> c(new SimClient(i, options.keys));
+
+		if ( ! c->backend.Connect(addrs[0], addrs[1], addrs[2]) )
+			return false;
+
+		c->frontend.Pair(&c->backend);
+		clients.push_back(move(c));
+		}
+
+	return true;
+	}
+
+bool LoadGenerator::Warmup(double timeout)
+	{
+	double deadline = current_time() + timeout;
+
+	for ( ; ; )
+		{
+		bool synchronized = true;
+
+		for ( const auto& c : clients )
+			synchronized = synchronized && c->frontend.Synchronized();
+
+		if ( synchronized )
+			return true;
+
+		if ( current_time() >= deadline )
+			return false;
+
+		if ( ! Poll(deadline) )
+			return false;
+		}
+	}
+
+bool LoadGenerator::Poll(double until)
+	{
+	int nfds = 0;
+	fd_set rfds;
+	fd_set wfds;
+	double t = current_time();
+	unique_ptr<timeval> to(new timeval(to_timeval(min(until - t, 0.1))));
+	FD_ZERO(&rfds);
+	FD_ZERO(&wfds);
+
+	for ( const auto& c : clients )
+		if ( ! c->backend.GetSelectParams(&nfds, &rfds, &wfds, nullptr, &to) )
+			return false;
+
+	for ( const auto& j : joiners )
+		if ( ! j.backend->GetSelectParams(&nfds, &rfds, &wfds, nullptr, &to) )
+			return false;
+
+	if ( select(nfds, &rfds, &wfds, nullptr, to.get()) < 0 )
+		return false;
+
+	for ( const auto& c : clients )
+		c->backend.ProcessIO();
+
+	for ( const auto& j : joiners )
+		j.backend->ProcessIO();
+
+	return true;
+	}
+
+void LoadGenerator::StartOp(SimClient* c, double start)
+	{
+	OpType type = OpType(op_dist(rng));
+	unsigned k = rng() % options.keys;
+	++stats[type].started;
+
+	switch ( type ) {
+	case OP_INSERT:
+		{
+		key_type key = insert_key(c->id, k);
+		c->frontend.Insert(key, ++c->last_insert);
+		c->writes.push_back({type, key, c->last_insert, start});
+		}
+		break;
+
+	case OP_INCREMENT:
+		{
+		key_type key = counter_key(c->id, k);
+		c->frontend.Increment(key, 1);
+		c->writes.push_back({type, key, ++c->increments[k], start});
+		}
+		break;
+
+	case OP_LOOKUP:
+		{
+		++c->lookups;
+		OpStats* s = &stats[type];
+		auto cb = [c, s, start](const key_type& key, unique_ptr<value_type> val,
+		                        AsyncResultCode res)
+			{
+			--c->lookups;
+
+			if ( res == ASYNC_SUCCESS )
+				s->latency.Record(to_ns(current_time() - start));
+			else
+				++s->failed;
+			};
+
+		c->frontend.LookupAsync(insert_key(c->id, k), 5, cb);
+		}
+		break;
+
+	case OP_SNAPSHOT:
+		{
+		Joiner j;
+		j.owner = c;
+		j.backend.reset(new NonAuthoritativeBackend);
+		j.frontend.reset(new NonAuthoritativeFrontend(topic));
+		j.start = start;
+
+		if ( ! j.backend->Connect(addrs[0], addrs[1], addrs[2]) )
+			{
+			++stats[type].failed;
+			break;
+			}
+
+		j.frontend->Pair(j.backend.get());
+		++c->joins;
+		joiners.push_back(move(j));
+		}
+		break;
+
+	default:
+		break;
+	}
+	}
+
+void LoadGenerator::CheckCompletions(double now)
+	{
+	for ( const auto& c : clients )
+		while ( ! c->writes.empty() )
+			{
+			const PendingWrite& w = c->writes.front();
+			const value_type* val = c->frontend.LookupSync(w.key);
+
+			// Writes are applied in the order they're sent.
+			if ( ! val || *val < w.expected )
+				break;
+
+			stats[w.type].latency.Record(to_ns(now - w.start));
+			c->writes.pop_front();
+			}
+
+	for ( auto it = joiners.begin(); it != joiners.end(); )
+		{
+		if ( ! it->frontend->Synchronized() )
+			{
+			++it;
+			continue;
+			}
+
+		stats[OP_SNAPSHOT].latency.Record(to_ns(now - it->start));
+		--it->owner->joins;
+		it->frontend->Unpair();
+		it->backend->Close();
+		it = joiners.erase(it);
+		}
+	}
+
+bool LoadGenerator::Run()
+	{
+	double start = current_time();
+	double end = start + options.duration;
+	bool open_loop = options.rate > 0;
+	double interval = open_loop ? options.clients / options.rate : 0;
+
+	// Spread out the clients' schedules.
+	for ( const auto& c : clients )
+		c->next_op = start + interval * c->id / options.clients;
+
+	for ( ; ; )
+		{
+		double now = current_time();
+
+		if ( now >= end )
+			break;
+
+		double next = end;
+
+		for ( const auto& c : clients )
+			{
+			if ( open_loop )
+				{
+				// Latency counts from when an operation was due, so falling
+				// behind schedule shows up in the results.
+				while ( c->next_op <= now )
+					{
+					StartOp(c.get(), c->next_op);
+					c->next_op += interval;
+					}
+
+				next = min(next, c->next_op);
+				}
+			else if ( Idle(c.get()) )
+				StartOp(c.get(), now);
+			}
+
+		if ( ! Poll(next) )
+			return false;
+
+		CheckCompletions(current_time());
+		}
+
+	elapsed = current_time() - start;
+	return true;
+	}
+
+void LoadGenerator::Report() const
+	{
+	uint64_t incomplete = joiners.size();
+
+	for ( const auto& c : clients )
+		incomplete += c->writes.size() + c->lookups;
+
+	printf("%u clients, %.1f s, %s\n", options.clients, elapsed,
+	       options.rate > 0 ? "open loop" : "closed loop");
+	printf("%-10s %10s %10s %8s %10s %10s %10s %10s %10s\n", "op", "done",
+	       "ops/s", "failed", "p50(us)", "p90(us)", "p99(us)", "p99.9(us)",
+	       "max(us)");
+
+	Histogram total;
+
+	for ( int i = 0; i < NUM_OP_TYPES; ++i )
+		{
+		const OpStats& s = stats[i];
+
+		if ( s.started == 0 )
+			continue;
+
+		total.Merge(s.latency);
+		const Histogram& h = s.latency;
+		printf("%-10s %10" PRIu64 " %10.0f %8" PRIu64
+		       " %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+		       op_names[i], h.Count(), h.Count() / elapsed, s.failed,
+		       h.Percentile(50) / 1e3, h.Percentile(90) / 1e3,
+		       h.Percentile(99) / 1e3, h.Percentile(99.9) / 1e3,
+		       h.Max() / 1e3);
+		}
+
+	printf("%-10s %10" PRIu64 " %10.0f\n", "total", total.Count(),
+	       total.Count() / elapsed);
+	printf("%" PRIu64 " operations still outstanding at the end\n",
+	       incomplete);
+	}
+
+int run_loadgen(const LoadgenOptions& options)
+	{
+	if ( options.clients == 0 || options.keys == 0 ||
+	     options.insert_weight + options.increment_weight +
+	     options.lookup_weight + options.snapshot_weight == 0 )
+		{
+		fprintf(stderr, "Need at least one client, key and operation type\n");
+		return 1;
+		}
+
+	vector<string> addrs = get_addrs(options);
+	atomic<bool> stop(false);
+	atomic<int> server_state(0);
+	thread server(serve, cref(options), cref(addrs), &stop, &server_state);
+
+	while ( server_state == 0 )
+		usleep(1000);
+
+	int rval = 1;
+
+	if ( server_state < 0 )
+		printf("Failed to listen on %s\n", addrs[0].c_str());
+	else
+		{
+		LoadGenerator gen(options, addrs);
+
+		if ( ! gen.Connect() )
+			printf("Failed to connect to %s\n", addrs[0].c_str());
+		else if ( ! gen.Warmup(10) )
+			printf("Clients failed to synchronize\n");
+		else if ( ! gen.Run() )
+			printf("Error in select()\n");
+		else
+			{
+			gen.Report();
+			rval = 0;
+			}
+		}
+
+	stop = true;
+	server.join();
+
+	if ( options.transport == "ipc" )
+		for ( const auto& a : addrs )
+			unlink(a.substr(6).c_str());
+
+	return rval;
+	}
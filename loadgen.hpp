@@ -0,0 +1,24 @@
+#include <string>
+
+struct LoadgenOptions {
+	unsigned long start_port = 10000;
+	// "tcp" for loopback TCP or "ipc" for Unix domain sockets.
+	std::string transport = "tcp";
+	unsigned clients = 4;
+	double duration = 10;
+	// Total operations per second across all clients, each started on
+	// schedule whether or not earlier ones finished (open loop).  With 0,
+	// each client starts an operation once its last one finished.
+	double rate = 0;
+	// Relative weights of the operation types.
+	unsigned insert_weight = 40;
+	unsigned increment_weight = 40;
+	unsigned lookup_weight = 20;
+	unsigned snapshot_weight = 0;
+	// Distinct keys written per client.
+	unsigned keys = 1000;
+};
+
+// Runs a server and simulated clients against it, then reports throughput
+// and latency percentiles per operation type.
+int run_loadgen(const LoadgenOptions& options);
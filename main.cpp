@@ -7,16 +7,39 @@
 
 #include "server.hpp"
 #include "client.hpp"
+#include "loadgen.hpp"
 
 using namespace std;
 
 static void usage(const string& program)
 	{
-	fprintf(stderr, "%s --server|--client [options]\n", program.c_str());
+	fprintf(stderr, "%s --server|--client|--load [options]\n",
+	        program.c_str());
 	fprintf(stderr, "    -s|--server      | server/authoritative mode\n");
 	fprintf(stderr, "    -c|--client      | client/non-authoritative mode\n");
+	fprintf(stderr, "    -l|--load        | load generator with local server\n");
 	fprintf(stderr, "    -p|--port        | starting TCP port for 3 sockets\n");
 	fprintf(stderr, "    -n|--name        | name for the instance\n");
+	fprintf(stderr, "    -R|--serve-reads | client serves reads on this port\n");
+	fprintf(stderr, "    -q|--query-port  | client sends requests to this port\n");
+	fprintf(stderr, "    -P|--relay       | client serves reads and relays "
+	                "on 2 ports\n");
+	fprintf(stderr, "    -u|--upstream    | client joins a relay's 2 ports\n");
+	fprintf(stderr, "    -K|--partial     | client holds up to this many keys "
+	                "it looked up\n");
+	fprintf(stderr, "store export options (SIGUSR1 also exports):\n");
+	fprintf(stderr, "    -e|--export      | file, - for stdout or |command\n");
+	fprintf(stderr, "    -i|--export-interval | seconds between exports\n");
+	fprintf(stderr, "    -f|--export-format   | csv or binary\n");
+	fprintf(stderr, "    -b|--export-background | write from a thread\n");
+	fprintf(stderr, "load generator options:\n");
+	fprintf(stderr, "    -C|--clients     | number of simulated clients\n");
+	fprintf(stderr, "    -d|--duration    | seconds to run for\n");
+	fprintf(stderr, "    -r|--rate        | total ops/sec, 0 for closed loop\n");
+	fprintf(stderr, "    -m|--mix         | insert:increment:lookup:snapshot "
+	                "weights\n");
+	fprintf(stderr, "    -k|--keys        | distinct keys per client\n");
+	fprintf(stderr, "    -t|--transport   | tcp or ipc\n");
 	}
 
 static option long_options[] = {
@@ -24,15 +47,36 @@ static option long_options[] = {
     {"client",       no_argument,          0, 'c'},
     {"port",         required_argument,    0, 'p'},
     {"name",         required_argument,    0, 'n'},
+    {"serve-reads",  required_argument,    0, 'R'},
+    {"query-port",   required_argument,    0, 'q'},
+    {"relay",        required_argument,    0, 'P'},
+    {"upstream",     required_argument,    0, 'u'},
+    {"partial",      required_argument,    0, 'K'},
+    {"export",       required_argument,    0, 'e'},
+    {"export-interval", required_argument, 0, 'i'},
+    {"export-format", required_argument,   0, 'f'},
+    {"export-background", no_argument,     0, 'b'},
+    {"load",         no_argument,          0, 'l'},
+    {"clients",      required_argument,    0, 'C'},
+    {"duration",     required_argument,    0, 'd'},
+    {"rate",         required_argument,    0, 'r'},
+    {"mix",          required_argument,    0, 'm'},
+    {"keys",         required_argument,    0, 'k'},
+    {"transport",    required_argument,    0, 't'},
+    {0,              0,                    0,  0 },
 };
 
-static const char* opt_string = "p:n:sc";
+static const char* opt_string = "p:n:R:q:P:u:K:sclC:d:r:m:k:t:e:i:f:b";
 
 int main(int argc, char** argv)
 	{
 	pid_t pid = getpid();
 	bool is_server = false;
+	bool is_load = false;
+	LoadgenOptions load_options;
+	nnc::ExportOptions export_options;
 	string starting_port = "10000";
+	ClientOptions client_options;
 	stringstream ss;
 	ss << pid;
 	string instance_name = ss.str();
@@ -57,14 +101,84 @@ int main(int argc, char** argv)
 		case 'n':
 			instance_name = optarg;
 			break;
+		case 'R':
+			client_options.read_port = stoul(optarg);
+			break;
+		case 'q':
+			client_options.query_port = stoul(optarg);
+			break;
+		case 'P':
+			client_options.relay_port = stoul(optarg);
+			break;
+		case 'u':
+			client_options.upstream_port = stoul(optarg);
+			break;
+		case 'K':
+			client_options.partial_capacity = stoul(optarg);
+			break;
+		case 'l':
+			is_load = true;
+			break;
+		case 'e':
+			export_options.path = optarg;
+			break;
+		case 'i':
+			export_options.interval = stod(optarg);
+			break;
+		case 'f':
+			if ( string(optarg) == "csv" )
+				export_options.format = nnc::EXPORT_CSV;
+			else if ( string(optarg) == "binary" )
+				export_options.format = nnc::EXPORT_BINARY;
+			else
+				{
+				usage(argv[0]);
+				return 1;
+				}
+			break;
+		case 'b':
+			export_options.background = true;
+			break;
+		case 'C':
+			load_options.clients = stoul(optarg);
+			break;
+		case 'd':
+			load_options.duration = stod(optarg);
+			break;
+		case 'r':
+			load_options.rate = stod(optarg);
+			break;
+		case 'm':
+			if ( sscanf(optarg, "%u:%u:%u:%u", &load_options.insert_weight,
+			            &load_options.increment_weight,
+			            &load_options.lookup_weight,
+			            &load_options.snapshot_weight) != 4 )
+				{
+				usage(argv[0]);
+				return 1;
+				}
+			break;
+		case 'k':
+			load_options.keys = stoul(optarg);
+			break;
+		case 't':
+			load_options.transport = optarg;
+			break;
 		default:
 			usage(argv[0]);
 			return 1;
 		}
 		}
 
+	if ( is_load )
+		{
+		load_options.start_port = stoul(starting_port);
+		return run_loadgen(load_options);
+		}
+
 	if ( is_server )
-		return run_server(stoul(starting_port), instance_name);
+		return run_server(stoul(starting_port), instance_name, export_options);
 	else
-		return run_client(stoul(starting_port), instance_name);
+		return run_client(stoul(starting_port), instance_name, export_options,
+		                  client_options);
 	}
@@ -1,9 +1,21 @@
 #include "messages.hpp"
+#include "metrics.hpp"
+#include "text_scan.hpp"
+#include "util.hpp"
 
 #include <sstream>
+#include <iomanip>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <algorithm>
 #include <utility>
 #include <cmath>
+#include <cstdint>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
 #include <sys/time.h>
 
 using namespace std;
@@ -11,210 +23,1397 @@ using namespace nnc;
 
 using kv_pair = pair<key_type, value_type>;
 
-static inline double now()
+// Appending to a string rather than a stream lets the messages written for
+// every change encode into a pooled buffer without allocating.
+static inline void serialize_uint64(string* s, uint64_t n)
 	{
-	struct timeval tv;
-	gettimeofday(&tv, 0);
-	return tv.tv_sec + (tv.tv_usec / 1000000.0);
+	char buf[20];
+	char* p = buf + sizeof(buf);
+
+	do
+		{
+		*--p = '0' + n % 10;
+		n /= 10;
+		} while ( n );
+
+	s->append(p, buf + sizeof(buf) - p);
+	}
+
+static inline void serialize_key(string* s, const key_type& key)
+	{
+	serialize_uint64(s, key.size());
+	s->push_back(' ');
+	s->append(key);
+	}
+
+// Reads a length-prefixed string in place, e.g. a key or a message within a
+// batch.
+static void unserialize_span(const char** msg, size_t* size, const char** data,
+                             size_t* len)
+	{
+	const char* p = find_space(*msg, *size);
+
+	if ( ! p )
+		throw parse_error();
+
+	size_t n = p - *msg;
+	uint64_t span_size;
+
+	if ( ! parse_uint64(*msg, n, &span_size) )
+		throw parse_error();
+
+	*msg += n + 1;
+	*size -= n + 1;
+
+	if ( *size < span_size )
+		throw parse_error();
+
+	*data = *msg;
+	*len = span_size;
+	*msg += span_size;
+	*size -= span_size;
+	}
+
+static key_type unserialize_key(const char** msg, size_t* size)
+	{
+	const char* data;
+	size_t len;
+	unserialize_span(msg, size, &data, &len);
+	return key_type(data, len);
+	}
+
+static inline void serialize_val(string* s, const value_type& val)
+	{
+	if ( val < 0 )
+		{
+		s->push_back('-');
+		serialize_uint64(s, -uint64_t(val));
+		}
+	else
+		serialize_uint64(s, val);
+	}
+
+static uint64_t unserialize_uint64(const char** msg, size_t* size)
+	{
+	const char* p = find_space(*msg, *size);
+	size_t n = p ? p - *msg : *size;
+	uint64_t rval;
+
+	if ( ! parse_uint64(*msg, n, &rval) )
+		throw parse_error();
+
+	*msg += n;
+	*size -= n;
+	return rval;
+	}
+
+static value_type unserialize_val(const char** msg, size_t* size)
+	{
+	const char* p = find_space(*msg, *size);
+	size_t n = p ? p - *msg : *size;
+	value_type rval;
+
+	if ( ! parse_int64(*msg, n, &rval) )
+		throw parse_error();
+
+	*msg += n;
+	*size -= n;
+	return rval;
+	}
+
+static double unserialize_double(const char** msg, size_t* size)
+	{
+	const char* p = find_space(*msg, *size);
+	size_t n = p ? p - *msg : *size;
+	double rval;
+
+	if ( ! parse_double(*msg, n, &rval) )
+		throw parse_error();
+
+	*msg += n;
+	*size -= n;
+	return rval;
+	}
+
+static void unserialize_space(const char** msg, size_t* size)
+	{
+	if ( *size == 0 || **msg != ' ' )
+		throw parse_error();
+
+	++*msg;
+	--*size;
+	}
+
+static inline void serialize_kv_pair(string* s, const key_type& key,
+                                     const value_type& val)
+	{
+	serialize_key(s, key);
+	s->push_back(' ');
+	serialize_val(s, val);
+	}
+
+static inline kv_pair unserialize_kv_pair(const char** msg, size_t* size)
+	{
+	key_type k = unserialize_key(msg, size);
+
+	if ( *size > 0 && *msg[0] == ' ' )
+		{
+		*msg += 1;
+		*size -= 1;
+		}
+	else
+		throw parse_error();
+
+	value_type v = unserialize_val(msg, size);
+	return kv_pair(move(k), v);
+	}
+
+// Pairs per segment of a snapshot decoded in parallel.
+static const uint64_t snapshot_segment_pairs = 16384;
+// How many segments may be decoded ahead of the one being inserted, per
+// decoding thread, bounding the pairs held outside the store.
+static const size_t snapshot_segments_ahead = 4;
+// Snapshots of only a few segments aren't worth starting threads for.
+static const uint64_t min_parallel_snapshot_pairs =
+        4 * snapshot_segment_pairs;
+
+static size_t snapshot_decode_threads = 0;
+
+void nnc::SnapshotResponse::SetDecodeThreads(size_t n)
+	{
+	snapshot_decode_threads = n;
+	}
+
+// Advances past n " <key> <val>" pairs, checking no more than it takes to
+// find where they end.
+static void skip_pairs(const char** msg, size_t* size, uint64_t n)
+	{
+	for ( uint64_t i = 0; i < n; ++i )
+		{
+		const char* key;
+		size_t key_size;
+		unserialize_space(msg, size);
+		unserialize_span(msg, size, &key, &key_size);
+		unserialize_space(msg, size);
+		const char* p = find_space(*msg, *size);
+		size_t val_size = p ? p - *msg : *size;
+		*msg += val_size;
+		*size -= val_size;
+		}
+	}
+
+namespace {
+
+struct SnapshotSegment {
+	const char* msg;
+	size_t size;
+	uint64_t n;
+	vector<kv_pair> pairs;
+	bool decoded = false;
+};
+
+} // namespace
+
+static void decode_segment(SnapshotSegment* seg)
+	{
+	const char* msg = seg->msg;
+	size_t size = seg->size;
+	seg->pairs.reserve(seg->n);
+
+	for ( uint64_t i = 0; i < seg->n; ++i )
+		{
+		unserialize_space(&msg, &size);
+		seg->pairs.push_back(unserialize_kv_pair(&msg, &size));
+		}
+	}
+
+// Reads n " <key> <val>" pairs into the store, a later pair for the same key
+// replacing an earlier one.  Large snapshots are cut into segments that
+// other threads decode while this one inserts them, in order, into the
+// store.  The store can't take inserts from several threads at once, but
+// allocating the keys and parsing the numbers can happen in parallel.
+static void unserialize_snapshot_pairs(const char** msg, size_t* size,
+                                       uint64_t n, kv_store_type* store)
+	{
+	// No pair takes less than 5 bytes, " 0  0", so a count beyond that
+	// can't be right and mustn't make us reserve memory for it.
+	if ( n > *size / 5 )
+		throw parse_error();
+
+	store->reserve(n);
+
+	size_t threads = snapshot_decode_threads;
+
+	if ( threads == 0 )
+		threads = thread::hardware_concurrency();
+
+	if ( threads <= 1 || n < min_parallel_snapshot_pairs )
+		{
+		for ( uint64_t i = 0; i < n; ++i )
+			{
+			unserialize_space(msg, size);
+			kv_pair kv = unserialize_kv_pair(msg, size);
+			(*store)[move(kv.first)] = kv.second;
+			}
+
+		return;
+		}
+
+	// Finding the segments takes a fraction of what decoding them does.
+	vector<SnapshotSegment> segments;
+	segments.reserve((n + snapshot_segment_pairs - 1) /
+	                 snapshot_segment_pairs);
+
+	for ( uint64_t i = 0; i < n; i += snapshot_segment_pairs )
+		{
+		SnapshotSegment seg;
+		seg.msg = *msg;
+		seg.size = *size;
+		seg.n = min(n - i, snapshot_segment_pairs);
+		skip_pairs(msg, size, seg.n);
+		seg.size -= *size;
+		segments.push_back(move(seg));
+		}
+
+	size_t decoders = min(threads - 1, segments.size());
+	size_t window = decoders * snapshot_segments_ahead;
+	mutex m;
+	condition_variable cv;
+	size_t next = 0;
+	size_t inserted = 0;
+	bool failed = false;
+	exception_ptr error;
+	vector<thread> workers;
+
+	auto decode = [&]()
+		{
+		unique_lock<mutex> lock(m);
+
+		for ( ; ; )
+			{
+			cv.wait(lock, [&]()
+				{
+				return failed || next == segments.size() ||
+				       next < inserted + window;
+				});
+
+			if ( failed || next == segments.size() )
+				return;
+
+			SnapshotSegment& seg = segments[next++];
+			lock.unlock();
+			exception_ptr e;
+
+			try
+				{
+				decode_segment(&seg);
+				}
+			catch ( ... ) { e = current_exception(); }
+
+			lock.lock();
+			seg.decoded = true;
+
+			if ( e && ! failed )
+				{
+				failed = true;
+				error = e;
+				}
+
+			cv.notify_all();
+			}
+		};
+
+	auto finish = [&]()
+		{
+			{
+			lock_guard<mutex> lock(m);
+			failed = failed || inserted < segments.size();
+			}
+
+		cv.notify_all();
+
+		for ( auto& w : workers )
+			w.join();
+		};
+
+	try
+		{
+		for ( size_t i = 0; i < decoders; ++i )
+			workers.emplace_back(decode);
+
+		for ( auto& seg : segments )
+			{
+				{
+				unique_lock<mutex> lock(m);
+				cv.wait(lock, [&]() { return seg.decoded || failed; });
+
+				if ( failed )
+					break;
+				}
+
+			for ( auto& kv : seg.pairs )
+				(*store)[move(kv.first)] = kv.second;
+
+			vector<kv_pair>().swap(seg.pairs);
+
+				{
+				lock_guard<mutex> lock(m);
+				++inserted;
+				}
+
+			cv.notify_all();
+			}
+		}
+	catch ( ... )
+		{
+		finish();
+		throw;
+		}
+
+	finish();
+
+	if ( error )
+		rethrow_exception(error);
+	}
+
+// Message types are words of up to 8 bytes, so each packs into an integer
+// without loss.  Parsers switch on that rather than comparing strings, leaving
+// the compiler to build the dispatch table.  Longer words pack to 0, which
+// matches no type.
+static constexpr uint64_t opcode(const char* s, size_t n, uint64_t code = 0)
+	{
+	return n > 8 ? 0 :
+	       n == 0 ? code : opcode(s + 1, n - 1, (code << 8) | uint8_t(*s));
+	}
+
+template<size_t N>
+static constexpr uint64_t opcode(const char (&name)[N])
+	{
+	static_assert(N > 1 && N <= 9, "message types are 1 to 8 bytes");
+	return opcode(name, N - 1);
+	}
+
+static void serialize_opcode(string* s, uint64_t code)
+	{
+	char buf[8];
+	size_t n = 0;
+
+	for ( ; code; code >>= 8 )
+		buf[sizeof(buf) - ++n] = char(code & 0xff);
+
+	s->append(buf + sizeof(buf) - n, n);
+	}
+
+// Reads a message's type and the space following it, or returns 0.
+static uint64_t unserialize_opcode(const char** msg, size_t* size)
+	{
+	const char* p = find_space(*msg, *size);
+
+	if ( ! p )
+		return 0;
+
+	size_t n = p - *msg;
+	uint64_t rval = opcode(*msg, n);
+	*msg += n + 1;
+	*size -= n + 1;
+	return rval;
+	}
+
+// The field types of message layouts.  Each appends a value with Put() and
+// reads one with Get(), which throws parse_error.  min_size bounds what a
+// value takes encoded, so that a list's count can be checked against what
+// the message could hold.
+struct Field {
+	static const bool optional = false;
+	static const size_t min_size = 1;
+
+	template<class T>
+	static bool Present(const T& v)
+		{ return true; }
+};
+
+struct KeyField : Field {
+	using type = key_type;
+	static const size_t min_size = 2;
+
+	static void Put(string* s, const type& v)
+		{ serialize_key(s, v); }
+
+	static void Get(const char** msg, size_t* size, type* v)
+		{ *v = unserialize_key(msg, size); }
+};
+
+struct ValField : Field {
+	using type = value_type;
+
+	static void Put(string* s, const type& v)
+		{ serialize_val(s, v); }
+
+	static void Get(const char** msg, size_t* size, type* v)
+		{ *v = unserialize_val(msg, size); }
+};
+
+struct UintField : Field {
+	using type = uint64_t;
+
+	static void Put(string* s, const type& v)
+		{ serialize_uint64(s, v); }
+
+	static void Get(const char** msg, size_t* size, type* v)
+		{ *v = unserialize_uint64(msg, size); }
+};
+
+// With 9 significant digits, as an ostream of that precision writes it.
+struct DoubleField : Field {
+	using type = double;
+
+	static void Put(string* s, const type& v)
+		{
+		char buf[32];
+		int n = snprintf(buf, sizeof(buf), "%.9g", v);
+		s->append(buf, n);
+		}
+
+	static void Get(const char** msg, size_t* size, type* v)
+		{ *v = unserialize_double(msg, size); }
+};
+
+// "0" or "1", though anything but a "0" reads as true.
+struct FlagField : Field {
+	using type = bool;
+
+	static void Put(string* s, const type& v)
+		{ s->push_back(v ? '1' : '0'); }
+
+	static void Get(const char** msg, size_t* size, type* v)
+		{
+		if ( *size == 0 )
+			throw parse_error();
+
+		*v = (*msg)[0] != '0';
+		++*msg;
+		--*size;
+		}
+};
+
+// The rest of the message, spaces included, so it can only come last.
+struct TextField : Field {
+	using type = string;
+	static const size_t min_size = 0;
+
+	static void Put(string* s, const type& v)
+		{ s->append(v); }
+
+	static void Get(const char** msg, size_t* size, type* v)
+		{
+		v->assign(*msg, *size);
+		*msg += *size;
+		*size = 0;
+		}
+};
+
+template<class T>
+struct Maybe {
+	bool present;
+	T val;
+};
+
+// A field that's left out, along with the space before it, when absent.
+// It's present if anything follows, so only fields that may be left out can
+// come after it.
+template<class F>
+struct OptionalField : Field {
+	using type = Maybe<typename F::type>;
+	static const bool optional = true;
+
+	template<class T>
+	static bool Present(const Maybe<T>& v)
+		{ return v.present; }
+
+	template<class T>
+	static void Put(string* s, const Maybe<T>& v)
+		{ F::Put(s, v.val); }
+
+	static void Get(const char** msg, size_t* size, type* v)
+		{
+		v->present = *size > 0;
+
+		if ( v->present )
+			F::Get(msg, size, &v->val);
+		}
+};
+
+// Fields in order, separated by spaces.
+template<class... Fields>
+struct Layout {
+	// Values may be of any type the fields' Put() take, e.g. any container
+	// for a ListField.
+	template<class... Vals>
+	static void Encode(string* s, const Vals&... vals)
+		{
+		static_assert(sizeof...(Vals) == sizeof...(Fields),
+		              "a value for each field");
+		bool first = true;
+		int expand[] = {0, (Put<Fields>(s, vals, &first), 0)...};
+		(void) expand;
+		}
+
+	// Throws parse_error.
+	static void Decode(const char** msg, size_t* size,
+	                   typename Fields::type*... vals)
+		{
+		bool first = true;
+		int expand[] = {0, (Get<Fields>(msg, size, vals, &first), 0)...};
+		(void) expand;
+		}
+
+private:
+
+	template<class F, class V>
+	static void Put(string* s, const V& v, bool* first)
+		{
+		if ( ! F::Present(v) )
+			return;
+
+		if ( ! *first )
+			s->push_back(' ');
+
+		*first = false;
+		F::Put(s, v);
+		}
+
+	template<class F>
+	static void Get(const char** msg, size_t* size, typename F::type* v,
+	                bool* first)
+		{
+		if ( ! *first && ! (F::optional && *size == 0) )
+			unserialize_space(msg, size);
+
+		*first = false;
+		F::Get(msg, size, v);
+		}
+};
+
+// A message type, "<type> <field> <field>...", declared once so that its
+// encoder and decoder follow from the same list of fields.  What goes in
+// front, e.g. the topic, is up to the message.
+template<uint64_t Code, class... Fields>
+struct Schema : Layout<Fields...> {
+	static const uint64_t code = Code;
+
+	template<class... Vals>
+	static void Encode(string* s, const Vals&... vals)
+		{
+		serialize_opcode(s, Code);
+		s->push_back(' ');
+		Layout<Fields...>::Encode(s, vals...);
+		}
+
+	// Decode() starts past the type and its space.
+};
+
+// A count and then as many elements, each preceded by a space.
+template<class Elem>
+struct ListField : Field {
+	using type = vector<typename Elem::type>;
+
+	template<class C>
+	static void Put(string* s, const C& elems)
+		{
+		serialize_uint64(s, elems.size());
+
+		for ( const auto& e : elems )
+			{
+			s->push_back(' ');
+			Elem::Put(s, e);
+			}
+		}
+
+	static void Get(const char** msg, size_t* size, type* v)
+		{
+		uint64_t n = unserialize_uint64(msg, size);
+
+		// Don't trust the count for a reservation beyond what the message
+		// could possibly contain.
+		v->clear();
+		v->reserve(min<uint64_t>(n, *size / (Elem::min_size + 1)));
+
+		for ( uint64_t i = 0; i < n; ++i )
+			{
+			unserialize_space(msg, size);
+			v->emplace_back();
+			Elem::Get(msg, size, &v->back());
+			}
+		}
+};
+
+// The element types of lists.
+
+// "<key> <val>"
+struct PairField : Field {
+	using type = kv_pair;
+	static const size_t min_size = 4;
+
+	template<class P>
+	static void Put(string* s, const P& kv)
+		{ serialize_kv_pair(s, kv.first, kv.second); }
+
+	static void Get(const char** msg, size_t* size, type* v)
+		{ *v = unserialize_kv_pair(msg, size); }
+};
+
+// A whole store, which unlike a list of pairs is decoded in parallel when
+// large.
+struct StoreField : Field {
+	using type = kv_store_type;
+
+	static void Put(string* s, const type& store)
+		{ ListField<PairField>::Put(s, store); }
+
+	static void Get(const char** msg, size_t* size, type* v)
+		{
+		uint64_t n = unserialize_uint64(msg, size);
+		unserialize_snapshot_pairs(msg, size, n, v);
+		}
+};
+
+// A key's resulting value, "S <key> <val>", or "R <key>" where there's none.
+struct BatchEntry {
+	key_type key;
+	bool exists;
+	value_type val;
+};
+
+struct BatchEntryField : Field {
+	using type = BatchEntry;
+	static const size_t min_size = 4;
+
+	template<class E>
+	static void Put(string* s, const E& e)
+		{
+		if ( e.exists )
+			{
+			s->append("S ");
+			serialize_kv_pair(s, e.key, e.val);
+			}
+		else
+			{
+			s->append("R ");
+			serialize_key(s, e.key);
+			}
+		}
+
+	static void Get(const char** msg, size_t* size, type* v)
+		{
+		v->exists = GetOp(msg, size) == 'S';
+
+		if ( v->exists )
+			Layout<KeyField, ValField>::Decode(msg, size, &v->key, &v->val);
+		else
+			KeyField::Get(msg, size, &v->key);
+		}
+
+	// Reads "<op> ", checking it's one of those that go with a value or
+	// "R".
+	static char GetOp(const char** msg, size_t* size, const char* ops = "S")
+		{
+		if ( *size < 2 || (*msg)[1] != ' ' ||
+		     ((*msg)[0] != 'R' && ! strchr(ops, (*msg)[0])) )
+			throw parse_error();
+
+		char rval = (*msg)[0];
+		*msg += 2;
+		*size -= 2;
+		return rval;
+		}
+};
+
+// A write of a WriteBatch, "<op> <key> <val>" or "R <key>" for a removal.
+struct WriteOpField : Field {
+	using type = WriteBatch::Op;
+	static const size_t min_size = 4;
+
+	static void Put(string* s, const type& op)
+		{
+		static const char op_chars[] = {'I', 'R', '+', '-'};
+		s->push_back(op_chars[op.type]);
+		s->push_back(' ');
+
+		if ( op.type == WriteBatch::REMOVE )
+			serialize_key(s, op.key);
+		else
+			serialize_kv_pair(s, op.key, op.val);
+		}
+
+	static void Get(const char** msg, size_t* size, type* v)
+		{
+		char op = BatchEntryField::GetOp(msg, size, "I+-");
+		v->val = 0;
+
+		if ( op == 'R' )
+			{
+			v->type = WriteBatch::REMOVE;
+			KeyField::Get(msg, size, &v->key);
+			return;
+			}
+
+		v->type = op == 'I' ? WriteBatch::INSERT :
+		          op == '+' ? WriteBatch::INCREMENT : WriteBatch::DECREMENT;
+		Layout<KeyField, ValField>::Decode(msg, size, &v->key, &v->val);
+		}
+};
+
+// One node's share of a PN-counter, "<key> <p> <n>".
+struct CounterStateField : Field {
+	using type = pair<key_type, pn_counter>;
+	static const size_t min_size = 6;
+
+	static void Put(string* s, const type& c)
+		{
+		Layout<KeyField, ValField, ValField>::Encode(s, c.first, c.second.p,
+		                                             c.second.n);
+		}
+
+	static void Get(const char** msg, size_t* size, type* v)
+		{
+		Layout<KeyField, ValField, ValField>::Decode(msg, size, &v->first,
+		                                             &v->second.p,
+		                                             &v->second.n);
+		}
+};
+
+// "<key> <p> <n> <total>"
+struct CounterEntryField : Field {
+	using type = CounterPublication::Entry;
+	static const size_t min_size = 8;
+
+	static void Put(string* s, const type& e)
+		{
+		Layout<KeyField, ValField, ValField, ValField>::Encode(
+		        s, e.key, e.state.p, e.state.n, e.total);
+		}
+
+	static void Get(const char** msg, size_t* size, type* v)
+		{
+		Layout<KeyField, ValField, ValField, ValField>::Decode(
+		        msg, size, &v->key, &v->state.p, &v->state.n, &v->total);
+		}
+};
+
+// "<prefix> <count>"
+struct PrefixCountField : Field {
+	using type = pair<key_type, uint64_t>;
+	static const size_t min_size = 4;
+
+	static void Put(string* s, const type& c)
+		{ Layout<KeyField, UintField>::Encode(s, c.first, c.second); }
+
+	static void Get(const char** msg, size_t* size, type* v)
+		{
+		Layout<KeyField, UintField>::Decode(msg, size, &v->first,
+		                                    &v->second);
+		}
+};
+
+using TopicStatsLayout = Layout<KeyField, UintField, UintField, UintField,
+                                DoubleField, UintField, UintField, UintField,
+                                UintField, DoubleField>;
+
+// "<topic> <id> <keys> <seq> <rate> <joins> <snapshots> <cache hits>
+// <snapshot bytes> <snapshot seconds>", with the topic encoded like a key.
+struct TopicStatsField : Field {
+	using type = TopicStats;
+	static const size_t min_size = 20;
+
+	static void Put(string* s, const type& ts)
+		{
+		TopicStatsLayout::Encode(s, ts.topic, ts.topic_id, ts.keys,
+		                         ts.sequence, ts.publication_rate, ts.joins,
+		                         ts.snapshots_served, ts.snapshot_cache_hits,
+		                         ts.snapshot_bytes, ts.snapshot_seconds);
+		}
+
+	static void Get(const char** msg, size_t* size, type* v)
+		{
+		uint64_t id;
+		TopicStatsLayout::Decode(msg, size, &v->topic, &id, &v->keys,
+		                         &v->sequence, &v->publication_rate,
+		                         &v->joins, &v->snapshots_served,
+		                         &v->snapshot_cache_hits, &v->snapshot_bytes,
+		                         &v->snapshot_seconds);
+
+		if ( id > UINT32_MAX )
+			throw parse_error();
+
+		v->topic_id = id;
+		}
+};
+
+// A message within a batch, length-prefixed like a key.  Parts that fail to
+// parse read as null.
+template<class M>
+struct MessageField : Field {
+	using type = unique_ptr<M>;
+	static const size_t min_size = 2;
+
+	template<class P>
+	static void Put(string* s, const P& m)
+		{ serialize_key(s, m->Msg()); }
+
+	static void Get(const char** msg, size_t* size, type* v)
+		{
+		const char* part;
+		size_t part_size;
+		unserialize_span(msg, size, &part, &part_size);
+		*v = M::Parse(part, part_size);
+		}
+};
+
+using LookupRequestSchema = Schema<opcode("LOOKUP"), KeyField>;
+using HasKeyRequestSchema = Schema<opcode("HASKEY"), KeyField>;
+using SizeRequestSchema = Schema<opcode("SIZE")>;
+using ScanRequestSchema = Schema<opcode("SCAN"), UintField, KeyField,
+                                 KeyField>;
+// "SNAPSHOT [<prefix>[ <first buffered>]]"
+using SnapshotRequestSchema = Schema<opcode("SNAPSHOT"),
+                                     OptionalField<KeyField>,
+                                     OptionalField<UintField>>;
+using TopicIdRequestSchema = Schema<opcode("TOPICID")>;
+using FetchRequestSchema = Schema<opcode("FETCH"), ListField<KeyField>>;
+using StatsRequestSchema = Schema<opcode("STATS")>;
+using BatchRequestSchema = Schema<opcode("BATCH"),
+                                  ListField<MessageField<Request>>>;
+// Atomic operations are named by their type, and only CAS has 'expected'.
+using AtomicArgsLayout = Layout<KeyField, ValField, OptionalField<ValField>>;
+
+using LookupResponseSchema = Schema<opcode("LOOKUP"), OptionalField<ValField>>;
+using HasKeyResponseSchema = Schema<opcode("HASKEY"), FlagField>;
+using SizeResponseSchema = Schema<opcode("SIZE"), UintField>;
+// "<uptime> <connections> <publications queued>" and the topics.
+using StatsResponseSchema = Schema<opcode("STATS"), DoubleField, UintField,
+                                   UintField, ListField<TopicStatsField>>;
+// "<seq> <topic ID> <pairs>"
+using SnapshotResponseSchema = Schema<opcode("SNAPSHOT"), UintField, UintField,
+                                      StoreField>;
+// "<applied> <seq>[ <val>]"
+using AtomicResponseSchema = Schema<opcode("ATOMIC"), FlagField, UintField,
+                                    OptionalField<ValField>>;
+using TopicIdResponseSchema = Schema<opcode("TOPICID"), UintField>;
+// "<more> <next> <pairs>"
+using ScanResponseSchema = Schema<opcode("SCAN"), FlagField, KeyField,
+                                  ListField<PairField>>;
+using FetchResponseSchema = Schema<opcode("FETCH"), UintField,
+                                   ListField<BatchEntryField>>;
+using BatchResponseSchema = Schema<opcode("BATCH"),
+                                   ListField<MessageField<Response>>>;
+using InvalidResponseSchema = Schema<opcode("INVALID"), TextField>;
+
+// Publications lead with their sequence number.  Keyed ones carry the key
+// in front, in the clear for subscriptions to match, and its size behind.
+using ValUpdatePublicationSchema = Schema<opcode("UPDATE"), UintField,
+                                          OptionalField<ValField>>;
+using ClearPublicationSchema = Schema<opcode("CLEAR"), UintField>;
+using BatchPublicationSchema = Schema<opcode("BATCH"), UintField,
+                                      ListField<BatchEntryField>>;
+// "<seq> <node> <entries>"
+using CounterPublicationSchema = Schema<opcode("PNCOUNT"), UintField,
+                                        KeyField,
+                                        ListField<CounterEntryField>>;
+using HeartbeatPublicationSchema = Schema<opcode("BEAT"), UintField,
+                                          ListField<PrefixCountField>>;
+using DropPublicationSchema = Schema<opcode("DROP"), UintField>;
+
+using InsertUpdateSchema = Schema<opcode("INSERT"), KeyField, ValField>;
+using RemoveUpdateSchema = Schema<opcode("REMOVE"), KeyField>;
+using IncrementUpdateSchema = Schema<opcode("+="), KeyField, ValField>;
+using DecrementUpdateSchema = Schema<opcode("-="), KeyField, ValField>;
+using BatchUpdateSchema = Schema<opcode("BATCH"), ListField<WriteOpField>>;
+// "<node> <states>"
+using CounterUpdateSchema = Schema<opcode("PNCOUNT"), KeyField,
+                                   ListField<CounterStateField>>;
+using ClearUpdateSchema = Schema<opcode("CLEAR")>;
+
+// Indexed by AtomicOp.
+static const uint64_t atomic_op_codes[] = {
+	opcode("CAS"), opcode("FETCH+="), opcode("UPSERT+="), opcode("INSERTNX"),
+	opcode("MAX"), opcode("MIN"),
+};
+
+static const int num_atomic_ops = sizeof(atomic_op_codes) / sizeof(uint64_t);
+
+static int atomic_op_from_code(uint64_t code)
+	{
+	for ( int i = 0; i < num_atomic_ops; ++i )
+		if ( code == atomic_op_codes[i] )
+			return i;
+
+	return -1;
+	}
+
+// "<op> <key> <operand>[ <expected>]", the latter only for CAS.
+static void serialize_atomic_op(string* s, AtomicOp op, const key_type& key,
+                                const value_type& operand,
+                                const value_type& expected)
+	{
+	serialize_opcode(s, atomic_op_codes[op]);
+	s->push_back(' ');
+	AtomicArgsLayout::Encode(s, key, operand,
+	                         Maybe<value_type>{op == ATOMIC_CAS, expected});
+	}
+
+static void unserialize_atomic_args(AtomicOp op, const char** msg,
+                                    size_t* size, kv_pair* kv,
+                                    value_type* expected)
+	{
+	Maybe<value_type> e;
+	AtomicArgsLayout::Decode(msg, size, &kv->first, &kv->second, &e);
+
+	if ( op == ATOMIC_CAS && ! e.present )
+		throw parse_error();
+
+	*expected = op == ATOMIC_CAS ? e.val : 0;
+	}
+
+string nnc::encode_topic_id(uint32_t topic_id)
+	{
+	char rval[5] = {'#',
+	                char(topic_id >> 24), char(topic_id >> 16),
+	                char(topic_id >> 8), char(topic_id)};
+	return string(rval, sizeof(rval));
+	}
+
+string nnc::encode_traced_response(const string& response,
+                                   const RequestTrace& trace)
+	{
+	stringstream ss;
+	ss << fixed << setprecision(6) << "!" << trace.server_received << " "
+	   << trace.processed << " " << trace.reply_sent << " " << response;
+	return ss.str();
+	}
+
+bool nnc::decode_traced_response(const char** msg, size_t* size,
+                                 RequestTrace* trace)
+	{
+	if ( *size == 0 || **msg != '!' )
+		return true;
+
+	++*msg;
+	--*size;
+
+	try
+		{
+		double* stamps[] = {&trace->server_received, &trace->processed,
+		                    &trace->reply_sent};
+
+		for ( double* stamp : stamps )
+			{
+			*stamp = unserialize_double(msg, size);
+			unserialize_space(msg, size);
+			}
+		}
+	catch ( parse_error& ) { return false; }
+
+	return true;
+	}
+
+static inline void serialize_topic(string* s, const string& topic,
+                                   uint32_t topic_id)
+	{
+	if ( topic_id )
+		s->append(encode_topic_id(topic_id));
+	else
+		s->append(topic);
+	}
+
+// Reads the topic's name or ID along with the space following it.
+static bool unserialize_topic(const char** msg, size_t* size, string* topic,
+                              uint32_t* topic_id)
+	{
+	if ( *size >= 6 && (*msg)[0] == '#' && (*msg)[5] == ' ' )
+		{
+		const unsigned char* b = (const unsigned char*)*msg + 1;
+		*topic_id = (uint32_t(b[0]) << 24) | (uint32_t(b[1]) << 16) |
+		            (uint32_t(b[2]) << 8) | uint32_t(b[3]);
+		*msg += 6;
+		*size -= 6;
+		return *topic_id != 0;
+		}
+
+	const char* p = find_space(*msg, *size);
+
+	if ( ! p || p == *msg || (*msg)[0] == '#' || (*msg)[0] == '!' )
+		return false;
+
+	size_t n = p - *msg;
+	topic->assign(*msg, n);
+	*topic_id = 0;
+	*msg += n + 1;
+	*size -= n + 1;
+	return true;
+	}
+
+nnc::Request::Request(MessageType type, const string& arg_topic,
+                      double arg_timeout)
+	: Message(type), topic(arg_topic), creation_time(current_time()),
+	  timeout(arg_timeout)
+	{
+	}
+
+timeval nnc::Request::UntilTimedOut() const
+	{
+	return to_timeval(creation_time + timeout - current_time());
+	}
+
+bool nnc::Request::DoTimedOut() const
+	{
+	return current_time() > creation_time + timeout;
 	}
 
-static const char* find_space(const char* msg, size_t size)
+static unique_ptr<Request> parse_request(const string& topic,
+                                         const char* msg, size_t size)
 	{
-	while ( size > 0 )
+	uint64_t type = unserialize_opcode(&msg, &size);
+
+	try
 		{
-		if ( msg[0] == ' ' )
-			return msg;
+		switch ( type ) {
+		case LookupRequestSchema::code:
+			{
+			key_type key;
+			LookupRequestSchema::Decode(&msg, &size, &key);
+			return unique_ptr<Request>(new LookupRequest(topic, key, 0,
+			                                             nullptr));
+			}
 
-		++msg;
-		--size;
-		}
+		case HasKeyRequestSchema::code:
+			{
+			key_type key;
+			HasKeyRequestSchema::Decode(&msg, &size, &key);
+			return unique_ptr<Request>(new HasKeyRequest(topic, key, 0,
+			                                             nullptr));
+			}
 
-	return nullptr;
-	}
+		case SizeRequestSchema::code:
+			return unique_ptr<Request>(new SizeRequest(topic, 0, nullptr));
 
-static inline void serialize_key(stringstream& ss, const key_type& key)
-	{
-	ss << key.size() << " " << key;
+		case TopicIdRequestSchema::code:
+			return unique_ptr<Request>(new TopicIdRequest(topic));
+
+		case StatsRequestSchema::code:
+			return unique_ptr<Request>(
+			            new StatsRequest(topic == "*" ? "" : topic, 0, nullptr));
+
+		case ScanRequestSchema::code:
+			{
+			uint64_t limit;
+			key_type begin;
+			key_type end;
+			ScanRequestSchema::Decode(&msg, &size, &limit, &begin, &end);
+
+			if ( limit == 0 )
+				return nullptr;
+
+			return unique_ptr<Request>(new ScanRequest(topic, begin, end,
+			                                           limit, 0, nullptr));
+			}
+
+		case SnapshotRequestSchema::code:
+			{
+			// Left as they are if absent.
+			Maybe<key_type> key_prefix;
+			Maybe<uint64_t> first_buffered{false, 0};
+			SnapshotRequestSchema::Decode(&msg, &size, &key_prefix,
+			                              &first_buffered);
+			return unique_ptr<Request>(new SnapshotRequest(topic,
+			                                               key_prefix.val,
+			                                               first_buffered.val));
+			}
+
+		case FetchRequestSchema::code:
+			{
+			vector<key_type> keys;
+			FetchRequestSchema::Decode(&msg, &size, &keys);
+			return unique_ptr<Request>(new FetchRequest(topic, move(keys)));
+			}
+
+		case BatchRequestSchema::code:
+			{
+			if ( topic != "*" )
+				return nullptr;
+
+			vector<unique_ptr<Request>> requests;
+			BatchRequestSchema::Decode(&msg, &size, &requests);
+			unique_ptr<BatchRequest> batch(new BatchRequest());
+
+			for ( auto& request : requests )
+				{
+				if ( ! request || ! request->Batchable() )
+					return nullptr;
+
+				batch->Add(move(request));
+				}
+
+			return unique_ptr<Request>(batch.release());
+			}
+
+		default:
+			{
+			int op = atomic_op_from_code(type);
+
+			if ( op < 0 )
+				return nullptr;
+
+			kv_pair kv;
+			value_type expected;
+			unserialize_atomic_args(AtomicOp(op), &msg, &size, &kv,
+			                        &expected);
+			return unique_ptr<Request>(new AtomicRequest(topic, AtomicOp(op),
+			                                             kv.first, kv.second,
+			                                             expected, 0,
+			                                             nullptr));
+			}
+		}
+		}
+	catch ( parse_error& ) { return nullptr; }
 	}
 
-static key_type unserialize_key(const char** msg, size_t* size)
+unique_ptr<Request> nnc::Request::Parse(const char* msg, size_t size)
 	{
-	const char* p = find_space(*msg, *size);
+	string topic;
+	uint32_t topic_id;
+	unique_ptr<Request> rval;
 
-	if ( ! p )
-		throw parse_error();
+	if ( unserialize_topic(&msg, &size, &topic, &topic_id) )
+		rval = parse_request(topic, msg, size);
 
-	size_t n = p - *msg;
-	string size_str(*msg, n);
-	*msg += n + 1;
-	*size -= n + 1;
-	size_t key_size;
+	if ( rval )
+		rval->SetTopicId(topic_id);
 
-	try
+	Metrics::Add(rval ? METRIC_REQUESTS_PARSED : METRIC_REQUESTS_INVALID);
+	return rval;
+	}
+
+void nnc::LookupRequest::DoPrepare()
+	{
+	auto s = pooled_string();
+	serialize_topic(s.get(), Topic(), TopicId());
+	s->push_back(' ');
+	LookupRequestSchema::Encode(s.get(), key);
+	SetMsg(move(s));
+	}
+
+bool nnc::LookupRequest::DoTimedOut() const
+	{
+	if ( Request::DoTimedOut() )
 		{
-		key_size = stoull(size_str);
+		cb(key, nullptr, ASYNC_TIMEOUT);
+		return true;
 		}
-	catch ( invalid_argument& ) { throw parse_error(); }
-	catch ( out_of_range& ) { throw parse_error(); }
 
-	if ( *size < key_size )
-		throw parse_error();
+	return false;
+	}
 
-	key_type rval(*msg, key_size);
-	*msg += key_size;
-	*size -= key_size;
-	return rval;
+unique_ptr<Response>
+nnc::LookupRequest::DoProcess(AuthoritativeFrontend* frontend) const
+	{
+	return DoProcessRead(frontend);
 	}
 
-static inline void serialize_val(stringstream& ss, const value_type& val)
+unique_ptr<Response>
+nnc::LookupRequest::DoProcessRead(const Frontend* frontend) const
 	{
-	ss << val;
+	return unique_ptr<Response>(new LookupResponse(frontend->LookupSync(key)));
 	}
 
-static uint64_t unserialize_uint64(const char** msg, size_t* size)
+bool nnc::LookupRequest::DoProcess(unique_ptr<Response> response,
+                                   NonAuthoritativeFrontend* frontend) const
 	{
-	const char* p = find_space(*msg, *size);
-	string val_str(*msg, p ? p - *msg : *size);
-	uint64_t rval;
+	LookupResponse* r = message_cast<LookupResponse>(response.get());
 
-	try
+	if ( ! r )
 		{
-		rval = stoull(val_str);
+		if ( message_cast<InvalidRequestResponse>(response.get()) )
+			cb(key, nullptr, ASYNC_INVALID_REQUEST);
+		else
+			cb(key, nullptr, ASYNC_INVALID_RESPONSE);
+
+		return false;
 		}
-	catch ( invalid_argument& ) { throw parse_error(); }
-	catch ( out_of_range& ) { throw parse_error(); }
 
-	*msg += val_str.size();
-	*size -= val_str.size();
-	return rval;
+	cb(key, r->Val(), ASYNC_SUCCESS);
+	return true;
 	}
 
-static value_type unserialize_val(const char** msg, size_t* size)
+void nnc::HasKeyRequest::DoPrepare()
 	{
-	const char* p = find_space(*msg, *size);
-	string val_str(*msg, p ? p - *msg : *size);
-	value_type rval;
+	auto s = pooled_string();
+	serialize_topic(s.get(), Topic(), TopicId());
+	s->push_back(' ');
+	HasKeyRequestSchema::Encode(s.get(), key);
+	SetMsg(move(s));
+	}
 
-	try
+bool nnc::HasKeyRequest::DoTimedOut() const
+	{
+	if ( Request::DoTimedOut() )
 		{
-		rval = stoll(val_str);
+		cb(key, false, ASYNC_TIMEOUT);
+		return true;
 		}
-	catch ( invalid_argument& ) { throw parse_error(); }
-	catch ( out_of_range& ) { throw parse_error(); }
 
-	*msg += val_str.size();
-	*size -= val_str.size();
-	return rval;
+	return false;
 	}
 
-static inline void serialize_kv_pair(stringstream& ss, const key_type& key,
-                                     const value_type& val)
+unique_ptr<Response>
+nnc::HasKeyRequest::DoProcess(AuthoritativeFrontend* frontend) const
 	{
-	serialize_key(ss, key);
-	ss << " ";
-	serialize_val(ss, val);
+	return DoProcessRead(frontend);
 	}
 
-static inline kv_pair unserialize_kv_pair(const char** msg, size_t* size)
+unique_ptr<Response>
+nnc::HasKeyRequest::DoProcessRead(const Frontend* frontend) const
 	{
-	key_type k = unserialize_key(msg, size);
+	return unique_ptr<Response>(new HasKeyResponse(frontend->HasKeySync(key)));
+	}
 
-	if ( *size > 0 && *msg[0] == ' ' )
+bool nnc::HasKeyRequest::DoProcess(std::unique_ptr<Response> response,
+                                   NonAuthoritativeFrontend* frontend) const
+	{
+	HasKeyResponse* r = message_cast<HasKeyResponse>(response.get());
+
+	if ( ! r )
 		{
-		*msg += 1;
-		*size += 1;
+		if ( message_cast<InvalidRequestResponse>(response.get()) )
+			cb(key, false, ASYNC_INVALID_REQUEST);
+		else
+			cb(key, false, ASYNC_INVALID_RESPONSE);
+
+		return false;
 		}
-	else
-		throw parse_error();
 
-	value_type v = unserialize_val(msg, size);
-	return kv_pair(k, v);
+	cb(key, r->Exists(), ASYNC_SUCCESS);
+	return true;
 	}
 
-nnc::Request::Request(const string& arg_topic, double arg_timeout)
-	: topic(arg_topic), creation_time(now()), timeout(arg_timeout)
+void nnc::SizeRequest::DoPrepare()
 	{
+	auto s = pooled_string();
+	serialize_topic(s.get(), Topic(), TopicId());
+	s->push_back(' ');
+	SizeRequestSchema::Encode(s.get());
+	SetMsg(move(s));
 	}
 
-timeval nnc::Request::UntilTimedOut() const
+bool nnc::SizeRequest::DoTimedOut() const
 	{
-	timeval rval;
-	rval.tv_sec = rval.tv_usec = 0;
-	double seconds_left = creation_time + timeout - now();
+	if ( Request::DoTimedOut() )
+		{
+		cb(0, ASYNC_TIMEOUT);
+		return true;
+		}
 
-	if ( seconds_left < 0 )
-		return rval;
+	return false;
+	}
 
-	double intp, fractp;
-	fractp = modf(seconds_left, &intp);
-	rval.tv_sec = intp;
-	rval.tv_usec = fractp * 1000000;
-	return rval;
+unique_ptr<Response>
+nnc::SizeRequest::DoProcess(AuthoritativeFrontend* frontend) const
+	{
+	return DoProcessRead(frontend);
 	}
 
-bool nnc::Request::DoTimedOut() const
+unique_ptr<Response>
+nnc::SizeRequest::DoProcessRead(const Frontend* frontend) const
 	{
-	return now() > creation_time + timeout;
+	return unique_ptr<Response>(new SizeResponse(frontend->SizeSync()));
 	}
 
-unique_ptr<Request> nnc::Request::Parse(const char* msg, size_t size)
+bool nnc::SizeRequest::DoProcess(std::unique_ptr<Response> response,
+                                 NonAuthoritativeFrontend* frontend) const
 	{
-	const char* p = find_space(msg, size);
+	SizeResponse* r = message_cast<SizeResponse>(response.get());
 
-	if ( ! p )
-		return nullptr;
+	if ( ! r )
+		{
+		if ( message_cast<InvalidRequestResponse>(response.get()) )
+			cb(0, ASYNC_INVALID_REQUEST);
+		else
+			cb(0, ASYNC_INVALID_RESPONSE);
 
-	size_t n = p - msg;
-	string topic(msg, n);
-	msg += n + 1;
-	size -= n + 1;
+		return false;
+		}
 
-	p = find_space(msg, size);
+	cb(r->Size(), ASYNC_SUCCESS);
+	return true;
+	}
 
-	if ( ! p )
-		return nullptr;
+void nnc::ScanRequest::DoPrepare()
+	{
+	auto s = pooled_string();
+	serialize_topic(s.get(), Topic(), TopicId());
+	s->push_back(' ');
+	ScanRequestSchema::Encode(s.get(), limit, begin, end);
+	SetMsg(move(s));
+	}
 
-	n = p - msg;
-	string type(msg, n);
-	msg += n + 1;
-	size -= 1;
+bool nnc::ScanRequest::DoTimedOut() const
+	{
+	if ( Request::DoTimedOut() )
+		{
+		cb(kv_pair_list(), false, key_type(), ASYNC_TIMEOUT);
+		return true;
+		}
 
-	if ( type == "SIZE" )
-		return unique_ptr<Request>(new SizeRequest(topic, 0, nullptr));
+	return false;
+	}
 
-	if ( type == "SNAPSHOT" )
-		return unique_ptr<Request>(new SnapshotRequest(topic));
+unique_ptr<Response>
+nnc::ScanRequest::DoProcess(AuthoritativeFrontend* frontend) const
+	{
+	return DoProcessRead(frontend);
+	}
 
-	key_type key;
+unique_ptr<Response>
+nnc::ScanRequest::DoProcessRead(const Frontend* frontend) const
+	{
+	kv_pair_list pairs;
+	key_type next;
+	bool more = frontend->ScanSync(begin, end, limit, &pairs, &next);
+	return unique_ptr<Response>(new ScanResponse(move(pairs), more, next));
+	}
 
-	try
-		{
-		key = unserialize_key(&msg, &size);
-		}
-	catch ( parse_error& ) { return nullptr; }
+bool nnc::ScanRequest::DoProcess(std::unique_ptr<Response> response,
+                                 NonAuthoritativeFrontend* frontend) const
+	{
+	ScanResponse* r = message_cast<ScanResponse>(response.get());
 
-	if ( type == "LOOKUP" )
-		return unique_ptr<Request>(new LookupRequest(topic, key, 0, nullptr));
+	if ( ! r )
+		{
+		if ( message_cast<InvalidRequestResponse>(response.get()) )
+			cb(kv_pair_list(), false, key_type(), ASYNC_INVALID_REQUEST);
+		else
+			cb(kv_pair_list(), false, key_type(), ASYNC_INVALID_RESPONSE);
 
-	if ( type == "HASKEY" )
-		return unique_ptr<Request>(new HasKeyRequest(topic, key, 0, nullptr));
+		return false;
+		}
 
-	return nullptr;
+	cb(r->Pairs(), r->More(), r->Next(), ASYNC_SUCCESS);
+	return true;
 	}
 
-void nnc::LookupRequest::DoPrepare()
+void nnc::AtomicRequest::DoPrepare()
 	{
-	stringstream ss;
-	ss << Topic() << " LOOKUP ";
-	serialize_key(ss, key);
-	SetMsg(ss.str());
+	auto s = pooled_string();
+	serialize_topic(s.get(), Topic(), TopicId());
+	s->push_back(' ');
+	serialize_atomic_op(s.get(), op, key, operand, expected);
+	SetMsg(move(s));
 	}
 
-bool nnc::LookupRequest::DoTimedOut() const
+bool nnc::AtomicRequest::DoTimedOut() const
 	{
 	if ( Request::DoTimedOut() )
 		{
-		cb(key, nullptr, ASYNC_TIMEOUT);
+		cb(key, false, nullptr, 0, ASYNC_TIMEOUT);
 		return true;
 		}
 
@@ -222,86 +1421,191 @@ bool nnc::LookupRequest::DoTimedOut() const
 	}
 
 unique_ptr<Response>
-nnc::LookupRequest::DoProcess(const AuthoritativeFrontend* frontend) const
+nnc::AtomicRequest::DoProcess(AuthoritativeFrontend* frontend) const
 	{
-	return unique_ptr<Response>(new LookupResponse(frontend->LookupSync(key)));
+	unique_ptr<value_type> val;
+	bool applied = frontend->Atomic(op, key, operand, expected, &val);
+	return unique_ptr<Response>(new AtomicResponse(applied, val.get(),
+	                                               frontend->Sequence()));
 	}
 
-bool nnc::LookupRequest::DoProcess(unique_ptr<Response> response,
+bool nnc::AtomicRequest::DoProcess(std::unique_ptr<Response> response,
                                    NonAuthoritativeFrontend* frontend) const
 	{
-	LookupResponse* r = dynamic_cast<LookupResponse*>(response.get());
+	AtomicResponse* r = message_cast<AtomicResponse>(response.get());
 
 	if ( ! r )
 		{
-		if ( dynamic_cast<InvalidRequestResponse*>(response.get()) )
-			cb(key, nullptr, ASYNC_INVALID_REQUEST);
+		if ( message_cast<InvalidRequestResponse>(response.get()) )
+			cb(key, false, nullptr, 0, ASYNC_INVALID_REQUEST);
 		else
-			cb(key, nullptr, ASYNC_INVALID_RESPONSE);
+			cb(key, false, nullptr, 0, ASYNC_INVALID_RESPONSE);
 
 		return false;
 		}
 
-	cb(key, move(r->Val()), ASYNC_SUCCESS);
+	cb(key, r->Applied(), r->Val(), r->Sequence(), ASYNC_SUCCESS);
 	return true;
 	}
 
-void nnc::HasKeyRequest::DoPrepare()
+void nnc::SnapshotRequest::DoPrepare()
 	{
-	stringstream ss;
-	ss << Topic() << " HASKEY ";
-	serialize_key(ss, key);
-	SetMsg(ss.str());
+	auto s = pooled_string();
+	serialize_topic(s.get(), Topic(), TopicId());
+	s->push_back(' ');
+
+	// Peers that predate first_buffered ignore it.
+	bool has_prefix = ! key_prefix.empty() || first_buffered;
+	SnapshotRequestSchema::Encode(
+	        s.get(), Maybe<key_type>{has_prefix, key_prefix},
+	        Maybe<uint64_t>{first_buffered != 0, first_buffered});
+	SetMsg(move(s));
 	}
 
-bool nnc::HasKeyRequest::DoTimedOut() const
+unique_ptr<Response>
+nnc::SnapshotRequest::DoProcess(AuthoritativeFrontend* frontend) const
 	{
-	if ( Request::DoTimedOut() )
+	return DoProcessRead(frontend);
+	}
+
+unique_ptr<Response>
+nnc::SnapshotRequest::DoProcessRead(const Frontend* frontend) const
+	{
+	return frontend->Snapshot(key_prefix);
+	}
+
+bool nnc::SnapshotRequest::DoProcess(std::unique_ptr<Response> response,
+                                     NonAuthoritativeFrontend* frontend) const
+	{
+	return frontend && frontend->ApplySnapshot(move(response));
+	}
+
+void nnc::TopicIdRequest::DoPrepare()
+	{
+	auto s = pooled_string();
+	s->append(Topic());
+	s->push_back(' ');
+	TopicIdRequestSchema::Encode(s.get());
+	SetMsg(move(s));
+	}
+
+unique_ptr<Response>
+nnc::TopicIdRequest::DoProcess(AuthoritativeFrontend* frontend) const
+	{
+	return DoProcessRead(frontend);
+	}
+
+unique_ptr<Response>
+nnc::TopicIdRequest::DoProcessRead(const Frontend* frontend) const
+	{
+	return unique_ptr<Response>(new TopicIdResponse(frontend->TopicId()));
+	}
+
+bool nnc::TopicIdRequest::DoProcess(std::unique_ptr<Response> response,
+                                    NonAuthoritativeFrontend* frontend) const
+	{
+	TopicIdResponse* r = message_cast<TopicIdResponse>(response.get());
+
+	if ( ! frontend )
+		return false;
+
+	if ( ! r )
 		{
-		cb(key, false, ASYNC_TIMEOUT);
-		return true;
+		frontend->RetryLater();
+		return false;
 		}
 
-	return false;
+	return frontend->AssignTopicId(r->TopicId());
+	}
+
+void nnc::FetchRequest::DoPrepare()
+	{
+	auto s = pooled_string();
+	serialize_topic(s.get(), Topic(), TopicId());
+	s->push_back(' ');
+	FetchRequestSchema::Encode(s.get(), keys);
+	SetMsg(move(s));
 	}
 
 unique_ptr<Response>
-nnc::HasKeyRequest::DoProcess(const AuthoritativeFrontend* frontend) const
+nnc::FetchRequest::DoProcess(AuthoritativeFrontend* frontend) const
 	{
-	return unique_ptr<Response>(new HasKeyResponse(frontend->HasKeySync(key)));
+	return DoProcessRead(frontend);
 	}
 
-bool nnc::HasKeyRequest::DoProcess(std::unique_ptr<Response> response,
-                                   NonAuthoritativeFrontend* frontend) const
+unique_ptr<Response>
+nnc::FetchRequest::DoProcessRead(const Frontend* frontend) const
+	{
+	unique_ptr<FetchResponse> r(new FetchResponse(frontend->Sequence()));
+
+	for ( const auto& key : keys )
+		r->Add(key, frontend->LookupSync(key));
+
+	return unique_ptr<Response>(r.release());
+	}
+
+bool nnc::FetchRequest::DoProcess(unique_ptr<Response> response,
+                                  NonAuthoritativeFrontend* frontend) const
+	{
+	return frontend && frontend->ApplyFetch(keys, move(response));
+	}
+
+void nnc::StatsRequest::DoPrepare()
+	{
+	auto s = pooled_string();
+
+	if ( Topic().empty() )
+		s->push_back('*');
+	else
+		serialize_topic(s.get(), Topic(), TopicId());
+
+	s->push_back(' ');
+	StatsRequestSchema::Encode(s.get());
+	SetMsg(move(s));
+	}
+
+void nnc::BatchRequest::DoPrepare()
+	{
+	auto s = pooled_string();
+	s->append("* ");
+	BatchRequestSchema::Encode(s.get(), requests);
+	SetMsg(move(s));
+	}
+
+void nnc::BatchRequest::ProcessEach(
+        unique_ptr<Response> response,
+        const function<NonAuthoritativeFrontend*(const string&)>& find) const
 	{
-	HasKeyResponse* r = dynamic_cast<HasKeyResponse*>(response.get());
+	BatchResponse* r = message_cast<BatchResponse>(response.get());
+	bool matches = r && r->Responses().size() == requests.size();
 
-	if ( ! r )
+	for ( size_t i = 0; i < requests.size(); ++i )
 		{
-		if ( dynamic_cast<InvalidRequestResponse*>(response.get()) )
-			cb(key, false, ASYNC_INVALID_REQUEST);
-		else
-			cb(key, false, ASYNC_INVALID_RESPONSE);
+		unique_ptr<Response> part;
 
-		return false;
-		}
+		if ( matches )
+			part = move(r->Responses()[i]);
 
-	cb(key, r->Exists(), ASYNC_SUCCESS);
-	return true;
+		requests[i]->Process(move(part), find(requests[i]->Topic()));
+		}
 	}
 
-void nnc::SizeRequest::DoPrepare()
+bool nnc::BatchRequest::DoProcess(unique_ptr<Response> response,
+                                  NonAuthoritativeFrontend* frontend) const
 	{
-	stringstream ss;
-	ss << Topic() << " SIZE ";
-	SetMsg(ss.str());
+	ProcessEach(move(response), [frontend](const string& topic)
+		{
+		return frontend && frontend->Topic() == topic ? frontend : nullptr;
+		});
+
+	return true;
 	}
 
-bool nnc::SizeRequest::DoTimedOut() const
+bool nnc::StatsRequest::DoTimedOut() const
 	{
 	if ( Request::DoTimedOut() )
 		{
-		cb(0, ASYNC_TIMEOUT);
+		cb(BackendStats(), ASYNC_TIMEOUT);
 		return true;
 		}
 
@@ -309,388 +1613,714 @@ bool nnc::SizeRequest::DoTimedOut() const
 	}
 
 unique_ptr<Response>
-nnc::SizeRequest::DoProcess(const AuthoritativeFrontend* frontend) const
+nnc::StatsRequest::DoProcess(AuthoritativeFrontend* frontend) const
 	{
-	return unique_ptr<Response>(new SizeResponse(frontend->SizeSync()));
+	TopicStats ts;
+	ts.topic = frontend->Topic();
+	ts.topic_id = frontend->TopicId();
+	ts.keys = frontend->SizeSync();
+	ts.sequence = frontend->Sequence();
+	BackendStats stats;
+	stats.topics.push_back(move(ts));
+	return unique_ptr<Response>(new StatsResponse(move(stats)));
 	}
 
-bool nnc::SizeRequest::DoProcess(std::unique_ptr<Response> response,
-                                 NonAuthoritativeFrontend* frontend) const
+bool nnc::StatsRequest::DoProcess(std::unique_ptr<Response> response,
+                                  NonAuthoritativeFrontend* frontend) const
 	{
-	SizeResponse* r = dynamic_cast<SizeResponse*>(response.get());
+	StatsResponse* r = message_cast<StatsResponse>(response.get());
 
 	if ( ! r )
 		{
-		if ( dynamic_cast<InvalidRequestResponse*>(response.get()) )
-			cb(0, ASYNC_INVALID_REQUEST);
+		if ( message_cast<InvalidRequestResponse>(response.get()) )
+			cb(BackendStats(), ASYNC_INVALID_REQUEST);
 		else
-			cb(0, ASYNC_INVALID_RESPONSE);
+			cb(BackendStats(), ASYNC_INVALID_RESPONSE);
 
 		return false;
 		}
 
-	cb(r->Size(), ASYNC_SUCCESS);
+	cb(r->Stats(), ASYNC_SUCCESS);
 	return true;
 	}
 
-void nnc::SnapshotRequest::DoPrepare()
-	{
-	stringstream ss;
-	ss << Topic() << " SNAPSHOT ";
-	SetMsg(ss.str());
-	}
-
-unique_ptr<Response>
-nnc::SnapshotRequest::DoProcess(const AuthoritativeFrontend* frontend) const
-	{
-	return frontend->Snapshot();
-	}
-
-bool nnc::SnapshotRequest::DoProcess(std::unique_ptr<Response> response,
-                                     NonAuthoritativeFrontend* frontend) const
-	{
-	return frontend->ApplySnapshot(move(response));
-	}
-
-unique_ptr<Response> nnc::Response::Parse(const char* msg, size_t size)
+static unique_ptr<Response> parse_response(const char* msg, size_t size)
 	{
-	const char* p = find_space(msg, size);
-
-	if ( ! p )
-		return nullptr;
+	uint64_t type = unserialize_opcode(&msg, &size);
 
-	size_t n = p - msg;
-	string type(msg, n);
-	msg += n + 1;
-	size -= n + 1;
-
-	if ( type == "LOOKUP" )
+	try
 		{
-		if ( size == 0 )
-			return unique_ptr<Response>(new LookupResponse(nullptr));
-
-		value_type val;
-
-		try
+		switch ( type ) {
+		case LookupResponseSchema::code:
 			{
-			val = unserialize_val(&msg, &size);
+			Maybe<value_type> val;
+			LookupResponseSchema::Decode(&msg, &size, &val);
+			return unique_ptr<Response>(
+			        new LookupResponse(val.present ? &val.val : nullptr));
 			}
-		catch ( parse_error& ) { return nullptr; }
 
-		return unique_ptr<Response>(new LookupResponse(&val));
-		}
-
-	if ( type == "HASKEY" )
-		{
-		if ( size > 0 )
+		case HasKeyResponseSchema::code:
 			{
-			if ( msg[0] == '0' )
-				return unique_ptr<Response>(new HasKeyResponse(false));
-			else
-				return unique_ptr<Response>(new HasKeyResponse(true));
+			bool exists;
+			HasKeyResponseSchema::Decode(&msg, &size, &exists);
+			return unique_ptr<Response>(new HasKeyResponse(exists));
 			}
 
-		return nullptr;
-		}
-
-	if ( type == "SIZE" )
-		{
-		uint64_t s;
-
-		try
+		case SizeResponseSchema::code:
 			{
-			s = unserialize_uint64(&msg, &size);
+			uint64_t n;
+			SizeResponseSchema::Decode(&msg, &size, &n);
+			return unique_ptr<Response>(new SizeResponse(n));
 			}
-		catch ( parse_error& ) { return nullptr; }
 
-		return unique_ptr<Response>(new SizeResponse(s));
-		}
+		case TopicIdResponseSchema::code:
+			{
+			uint64_t topic_id;
+			TopicIdResponseSchema::Decode(&msg, &size, &topic_id);
 
-	if ( type == "SNAPSHOT" )
-		{
-		kv_store_type store;
-		uint64_t seq;
-		uint64_t store_size;
+			if ( topic_id == 0 || topic_id > UINT32_MAX )
+				return nullptr;
 
-		try
+			return unique_ptr<Response>(new TopicIdResponse(topic_id));
+			}
+
+		case BatchResponseSchema::code:
 			{
-			seq = unserialize_uint64(&msg, &size);
+			vector<unique_ptr<Response>> responses;
+			BatchResponseSchema::Decode(&msg, &size, &responses);
+			return unique_ptr<Response>(new BatchResponse(move(responses)));
 			}
-		catch ( parse_error& ) { return nullptr; }
 
-		if ( size == 0 || msg[0] != ' ' )
-			return nullptr;
+		case FetchResponseSchema::code:
+			{
+			uint64_t seq;
+			vector<BatchEntry> entries;
+			FetchResponseSchema::Decode(&msg, &size, &seq, &entries);
+			unique_ptr<FetchResponse> rval(new FetchResponse(seq));
 
-		++msg;
-		--size;
+			for ( const auto& e : entries )
+				rval->Add(e.key, e.exists ? &e.val : nullptr);
+
+			return move(rval);
+			}
 
-		try
+		case StatsResponseSchema::code:
 			{
-			store_size = unserialize_uint64(&msg, &size);
+			BackendStats stats;
+			StatsResponseSchema::Decode(&msg, &size, &stats.uptime,
+			                            &stats.connections,
+			                            &stats.publications_queued,
+			                            &stats.topics);
+			return unique_ptr<Response>(new StatsResponse(move(stats)));
 			}
-		catch ( parse_error& ) { return nullptr; }
 
-		for ( uint64_t i = 0; i < store_size; ++i )
+		case SnapshotResponseSchema::code:
 			{
-			if ( size == 0 || msg[0] != ' ' )
+			uint64_t seq;
+			uint64_t topic_id;
+			kv_store_type store;
+			SnapshotResponseSchema::Decode(&msg, &size, &seq, &topic_id,
+			                               &store);
+
+			if ( topic_id > UINT32_MAX )
 				return nullptr;
 
-			msg += 1;
-			size -= 1;
+			return unique_ptr<Response>(new SnapshotResponse(move(store), seq,
+			                                                 topic_id));
+			}
 
-			kv_pair kvp;
+		case AtomicResponseSchema::code:
+			{
+			bool applied;
+			uint64_t seq;
+			Maybe<value_type> val;
+			AtomicResponseSchema::Decode(&msg, &size, &applied, &seq, &val);
+			return unique_ptr<Response>(
+			        new AtomicResponse(applied,
+			                           val.present ? &val.val : nullptr, seq));
+			}
 
-			try
-				{
-				kvp = unserialize_kv_pair(&msg, &size);
-				}
-			catch ( parse_error& ) { return nullptr; }
+		case InvalidResponseSchema::code:
+			{
+			string reason;
+			InvalidResponseSchema::Decode(&msg, &size, &reason);
+			return unique_ptr<Response>(new InvalidRequestResponse(reason));
+			}
 
-			store[kvp.first] = kvp.second;
+		case ScanResponseSchema::code:
+			{
+			bool more;
+			key_type next;
+			kv_pair_list pairs;
+			ScanResponseSchema::Decode(&msg, &size, &more, &next, &pairs);
+			return unique_ptr<Response>(new ScanResponse(move(pairs), more,
+			                                             next));
 			}
 
-		return unique_ptr<Response>(new SnapshotResponse(move(store), seq));
+		default:
+			return nullptr;
 		}
+		}
+	catch ( parse_error& ) { return nullptr; }
+	}
 
-	return nullptr;
+unique_ptr<Response> nnc::Response::Parse(const char* msg, size_t size)
+	{
+	auto rval = parse_response(msg, size);
+	Metrics::Add(rval ? METRIC_RESPONSES_PARSED : METRIC_RESPONSES_INVALID);
+	return rval;
 	}
 
 void nnc::LookupResponse::DoPrepare()
 	{
-	stringstream ss;
-	ss << "LOOKUP ";
-
-	if ( val )
-		serialize_val(ss, *val);
-
-	SetMsg(ss.str());
+	auto s = pooled_string();
+	LookupResponseSchema::Encode(s.get(), Maybe<value_type>{has_val, val});
+	SetMsg(move(s));
 	}
 
 void nnc::HasKeyResponse::DoPrepare()
 	{
-	SetMsg(exists ? "HASKEY 1" : "HASKEY 0");
+	auto s = pooled_string();
+	HasKeyResponseSchema::Encode(s.get(), exists);
+	SetMsg(move(s));
 	}
 
 void nnc::SizeResponse::DoPrepare()
 	{
-	stringstream ss;
-	ss << "SIZE " << size;
-	SetMsg(ss.str());
+	auto s = pooled_string();
+	SizeResponseSchema::Encode(s.get(), size);
+	SetMsg(move(s));
+	}
+
+void nnc::StatsResponse::DoPrepare()
+	{
+	auto s = pooled_string();
+	StatsResponseSchema::Encode(s.get(), stats.uptime, stats.connections,
+	                            stats.publications_queued, stats.topics);
+	SetMsg(move(s));
+	}
+
+void nnc::BatchResponse::DoPrepare()
+	{
+	auto s = pooled_string();
+	BatchResponseSchema::Encode(s.get(), responses);
+	SetMsg(move(s));
+	}
+
+// Encoded like a BatchPublication, "R" marking keys that don't exist.
+void nnc::FetchResponse::DoPrepare()
+	{
+	auto s = pooled_string();
+	FetchResponseSchema::Encode(s.get(), sequence, entries);
+	SetMsg(move(s));
 	}
 
 void nnc::SnapshotResponse::DoPrepare()
 	{
-	using ittype = kv_store_type::const_iterator;
-	stringstream ss;
-	ss << "SNAPSHOT " << sequence << " " << store.size();
+	auto s = pooled_string();
+	SnapshotResponseSchema::Encode(s.get(), sequence, topic_id, store);
+	SetMsg(move(s));
+	}
 
-	for ( ittype it = store.begin(); it != store.end(); ++it )
-		{
-		ss << " ";
-		serialize_kv_pair(ss, it->first, it->second);
-		}
+void nnc::ScanResponse::DoPrepare()
+	{
+	auto s = pooled_string();
+	ScanResponseSchema::Encode(s.get(), more, next, pairs);
+	SetMsg(move(s));
+	}
 
-	SetMsg(ss.str());
+void nnc::AtomicResponse::DoPrepare()
+	{
+	auto s = pooled_string();
+	AtomicResponseSchema::Encode(s.get(), applied, sequence,
+	                             Maybe<value_type>{has_val, val});
+	SetMsg(move(s));
+	}
+
+void nnc::TopicIdResponse::DoPrepare()
+	{
+	auto s = pooled_string();
+	TopicIdResponseSchema::Encode(s.get(), topic_id);
+	SetMsg(move(s));
 	}
 
 void nnc::InvalidRequestResponse::DoPrepare()
 	{
-	stringstream ss;
-	ss << "INVALID " << reason;
-	SetMsg(ss.str());
+	auto s = pooled_string();
+	InvalidResponseSchema::Encode(s.get(), reason);
+	SetMsg(move(s));
 	}
 
-unique_ptr<Publication> nnc::Publication::Parse(const char* msg, size_t size)
+static const char* find_last_space(const char* msg, size_t size)
+	{
+	while ( size > 0 )
+		{
+		--size;
+
+		if ( msg[size] == ' ' )
+			return msg + size;
+		}
+
+	return nullptr;
+	}
+
+// Keyed publications: "<topic> K<key> <type> <seq>[ <fields>] <key size>".
+static unique_ptr<Publication> parse_keyed_publication(const string& topic,
+                                                       const char* msg,
+                                                       size_t size)
 	{
-	const char* p = find_space(msg, size);
+	const char* p = find_last_space(msg, size);
 
 	if ( ! p )
 		return nullptr;
 
-	size_t n = p - msg;
-	string topic(msg, n);
-	msg += n + 1;
-	size -= n + 1;
+	const char* trailer = p + 1;
+	size_t trailer_size = msg + size - trailer;
+	size = p - msg;
+	uint64_t key_size;
+
+	try
+		{
+		key_size = unserialize_uint64(&trailer, &trailer_size);
+		}
+	catch ( parse_error& ) { return nullptr; }
+
+	if ( key_size > size )
+		return nullptr;
 
-	p = find_space(msg, size);
+	key_type key(msg, key_size);
+	msg += key_size;
+	size -= key_size;
 
-	if ( ! p )
+	if ( size == 0 || msg[0] != ' ' )
 		return nullptr;
 
-	n = p - msg;
-	string type(msg, n);
-	msg += n + 1;
-	size -= n + 1;
+	++msg;
+	--size;
+
+	if ( unserialize_opcode(&msg, &size) != ValUpdatePublicationSchema::code )
+		return nullptr;
 
 	uint64_t seq;
+	Maybe<value_type> val;
 
 	try
 		{
-		seq = unserialize_uint64(&msg, &size);
+		ValUpdatePublicationSchema::Decode(&msg, &size, &seq, &val);
 		}
 	catch ( parse_error& ) { return nullptr; }
 
-	if ( type == "UPDATE" )
-		{
-		if ( size == 0 || msg[0] != ' ' )
-			return nullptr;
+	return unique_ptr<Publication>(
+	            new ValUpdatePublication(topic, key,
+	                                     val.present ? &val.val : nullptr,
+	                                     seq));
+	}
 
-		++msg;
-		--size;
+static unique_ptr<Publication> parse_publication(const string& topic,
+                                                 const char* msg, size_t size)
+	{
+	if ( size > 0 && msg[0] == 'K' )
+		return parse_keyed_publication(topic, msg + 1, size - 1);
+
+	// Topic-wide publications: "<topic> * <type> <seq>[ <fields>]".
+	if ( size < 2 || msg[0] != '*' || msg[1] != ' ' )
+		return nullptr;
+
+	msg += 2;
+	size -= 2;
+	uint64_t type = unserialize_opcode(&msg, &size);
+	uint64_t seq;
+
+	try
+		{
+		switch ( type ) {
+		case ClearPublicationSchema::code:
+			ClearPublicationSchema::Decode(&msg, &size, &seq);
+			return unique_ptr<Publication>(new ClearPublication(topic, seq));
 
-		key_type key;
+		case DropPublicationSchema::code:
+			DropPublicationSchema::Decode(&msg, &size, &seq);
+			return unique_ptr<Publication>(new DropPublication(topic, seq));
 
-		try
+		case HeartbeatPublicationSchema::code:
 			{
-			key = unserialize_key(&msg, &size);
-			}
-		catch ( parse_error& ) { return nullptr; }
+			vector<pair<key_type, uint64_t>> counts;
+			HeartbeatPublicationSchema::Decode(&msg, &size, &seq, &counts);
+			unique_ptr<HeartbeatPublication> rval(
+			        new HeartbeatPublication(topic, seq));
 
-		if ( size == 0 )
-			return unique_ptr<Publication>(
-			            new ValUpdatePublication(topic, key, nullptr, seq));
+			for ( const auto& c : counts )
+				rval->Add(c.first, c.second);
 
-		if ( msg[0] != ' ' )
-			return nullptr;
+			return move(rval);
+			}
 
-		++msg;
-		--size;
+		case CounterPublicationSchema::code:
+			{
+			string node;
+			vector<CounterPublication::Entry> entries;
+			CounterPublicationSchema::Decode(&msg, &size, &seq, &node,
+			                                 &entries);
+			unique_ptr<CounterPublication> rval(
+			        new CounterPublication(topic, seq, node));
+
+			for ( const auto& e : entries )
+				rval->Add(e.key, e.state, e.total);
 
-		value_type val;
+			return move(rval);
+			}
 
-		try
+		case BatchPublicationSchema::code:
 			{
-			val = unserialize_val(&msg, &size);
+			vector<BatchEntry> entries;
+			BatchPublicationSchema::Decode(&msg, &size, &seq, &entries);
+			unique_ptr<BatchPublication> rval(
+			        new BatchPublication(topic, seq));
+
+			for ( const auto& e : entries )
+				rval->Add(e.key, e.exists ? &e.val : nullptr);
+
+			return move(rval);
 			}
-		catch ( parse_error& ) { return nullptr; }
 
-		return unique_ptr<Publication>(
-		            new ValUpdatePublication(topic, key, &val, seq));
+		default:
+			return nullptr;
 		}
+		}
+	catch ( parse_error& ) { return nullptr; }
+	}
+
+unique_ptr<Publication> nnc::Publication::Parse(const char* msg, size_t size)
+	{
+	string topic;
+	uint32_t topic_id;
+	unique_ptr<Publication> rval;
 
-	if ( type == "CLEAR" )
-		return unique_ptr<Publication>(new ClearPublication(topic, seq));
+	// Publications are always about a topic that's been assigned an ID.
+	if ( unserialize_topic(&msg, &size, &topic, &topic_id) && topic_id )
+		rval = parse_publication(topic, msg, size);
 
-	return nullptr;
+	if ( rval )
+		rval->SetTopicId(topic_id);
+
+	Metrics::Add(rval ? METRIC_PUBLICATIONS_PARSED
+	                  : METRIC_PUBLICATIONS_INVALID);
+	return rval;
 	}
 
-void nnc::ValUpdatePublication::DoPrepare()
+vector<string> nnc::Publication::Subscriptions(uint32_t topic_id,
+                                               const key_type& key_prefix)
 	{
-	stringstream ss;
-	ss << Topic() << " UPDATE " << Sequence() << " ";
-	serialize_key(ss, key);
+	string t = encode_topic_id(topic_id);
 
-	if ( val )
-		{
-		ss << " ";
-		serialize_val(ss, *val);
-		}
+	if ( key_prefix.empty() )
+		return {t + " "};
 
-	SetMsg(ss.str());
+	return {t + " *", t + " K" + key_prefix};
 	}
 
-void nnc::ClearPublication::DoPrepare()
+string nnc::Publication::KeySubscription(uint32_t topic_id, const key_type& key)
 	{
-	stringstream ss;
-	ss << Topic() << " CLEAR " << Sequence();
-	SetMsg(ss.str());
+	return encode_topic_id(topic_id) + " K" + key + " ";
 	}
 
-unique_ptr<Update> nnc::Update::Parse(const char* msg, size_t size)
+void nnc::ValUpdatePublication::DoPrepare()
 	{
-	const char* p = find_space(msg, size);
+	auto s = pooled_string();
+	s->append(encode_topic_id(TopicId()));
+	s->append(" K");
+	s->append(key);
+	s->push_back(' ');
+	ValUpdatePublicationSchema::Encode(s.get(), Sequence(),
+	                                   Maybe<value_type>{has_val, val});
+	s->push_back(' ');
+	serialize_uint64(s.get(), key.size());
+	SetMsg(move(s));
+	}
 
-	if ( ! p )
-		return nullptr;
+void nnc::CounterPublication::DoPrepare()
+	{
+	auto s = pooled_string();
+	s->append(encode_topic_id(TopicId()));
+	s->append(" * ");
+	CounterPublicationSchema::Encode(s.get(), Sequence(), node, entries);
+	SetMsg(move(s));
+	}
 
-	size_t n = p - msg;
-	string topic(msg, n);
-	msg += n + 1;
-	size -= n + 1;
+bool nnc::CounterPublication::DoApply(kv_store_type& store,
+                                      const key_type& key_prefix) const
+	{
+	for ( const auto& e : entries )
+		if ( e.key.compare(0, key_prefix.size(), key_prefix) == 0 )
+			store[e.key] = e.total;
 
-	p = find_space(msg, size);
+	return true;
+	}
 
-	if ( ! p )
-		return nullptr;
+bool nnc::CounterPublication::DoChangedKeys(vector<const key_type*>* keys) const
+	{
+	for ( const auto& e : entries )
+		keys->push_back(&e.key);
 
-	n = p - msg;
-	string type(msg, n);
-	msg += n + 1;
-	size -= n + 1;
+	return true;
+	}
 
-	if ( type == "CLEAR" )
-		return unique_ptr<Update>(new ClearUpdate(topic));
+void nnc::BatchPublication::DoPrepare()
+	{
+	auto s = pooled_string();
+	s->append(encode_topic_id(TopicId()));
+	s->append(" * ");
+	BatchPublicationSchema::Encode(s.get(), Sequence(), entries);
+	SetMsg(move(s));
+	}
 
-	if ( type == "REMOVE" )
+bool nnc::BatchPublication::DoApply(kv_store_type& store,
+                                    const key_type& key_prefix) const
+	{
+	for ( const auto& e : entries )
 		{
-		key_type key;
+		if ( e.key.compare(0, key_prefix.size(), key_prefix) != 0 )
+			continue;
+
+		if ( e.exists )
+			store[e.key] = e.val;
+		else
+			store.erase(e.key);
+		}
+
+	return true;
+	}
+
+bool nnc::BatchPublication::DoChangedKeys(vector<const key_type*>* keys) const
+	{
+	for ( const auto& e : entries )
+		keys->push_back(&e.key);
+
+	return true;
+	}
 
-		try
+void nnc::HeartbeatPublication::DoPrepare()
+	{
+	auto s = pooled_string();
+	s->append(encode_topic_id(TopicId()));
+	s->append(" * ");
+	HeartbeatPublicationSchema::Encode(s.get(), Sequence(), counts);
+	SetMsg(move(s));
+	}
+
+bool nnc::HeartbeatPublication::Count(const key_type& key_prefix,
+                                      uint64_t* count) const
+	{
+	for ( const auto& c : counts )
+		if ( c.first == key_prefix )
 			{
-			key = unserialize_key(&msg, &size);
+			*count = c.second;
+			return true;
 			}
-		catch ( parse_error& ) { return nullptr; }
 
-		return unique_ptr<Update>(new RemoveUpdate(topic, key));
-		}
+	return false;
+	}
+
+void nnc::DropPublication::DoPrepare()
+	{
+	auto s = pooled_string();
+	s->append(encode_topic_id(TopicId()));
+	s->append(" * ");
+	DropPublicationSchema::Encode(s.get(), Sequence());
+	SetMsg(move(s));
+	}
+
+void nnc::ClearPublication::DoPrepare()
+	{
+	auto s = pooled_string();
+	s->append(encode_topic_id(TopicId()));
+	s->append(" * ");
+	ClearPublicationSchema::Encode(s.get(), Sequence());
+	SetMsg(move(s));
+	}
 
-	kv_pair kv;
+static unique_ptr<Update> parse_update(const string& topic, const char* msg,
+                                       size_t size)
+	{
+	uint64_t type = unserialize_opcode(&msg, &size);
 
 	try
 		{
-		kv = unserialize_kv_pair(&msg, &size);
+		switch ( type ) {
+		case InsertUpdateSchema::code:
+			{
+			kv_pair kv;
+			InsertUpdateSchema::Decode(&msg, &size, &kv.first, &kv.second);
+			return unique_ptr<Update>(new InsertUpdate(topic, kv.first,
+			                                           kv.second));
+			}
+
+		case RemoveUpdateSchema::code:
+			{
+			key_type key;
+			RemoveUpdateSchema::Decode(&msg, &size, &key);
+			return unique_ptr<Update>(new RemoveUpdate(topic, key));
+			}
+
+		case IncrementUpdateSchema::code:
+			{
+			kv_pair kv;
+			IncrementUpdateSchema::Decode(&msg, &size, &kv.first, &kv.second);
+			return unique_ptr<Update>(new IncrementUpdate(topic, kv.first,
+			                                              kv.second));
+			}
+
+		case DecrementUpdateSchema::code:
+			{
+			kv_pair kv;
+			DecrementUpdateSchema::Decode(&msg, &size, &kv.first, &kv.second);
+			return unique_ptr<Update>(new DecrementUpdate(topic, kv.first,
+			                                              kv.second));
+			}
+
+		case ClearUpdateSchema::code:
+			return unique_ptr<Update>(new ClearUpdate(topic));
+
+		case CounterUpdateSchema::code:
+			{
+			string node;
+			pn_counter_list states;
+			CounterUpdateSchema::Decode(&msg, &size, &node, &states);
+			return unique_ptr<Update>(new CounterUpdate(topic, node,
+			                                            move(states)));
+			}
+
+		case BatchUpdateSchema::code:
+			{
+			vector<WriteBatch::Op> ops;
+			BatchUpdateSchema::Decode(&msg, &size, &ops);
+			WriteBatch batch;
+
+			for ( auto& op : ops )
+				{
+				switch ( op.type ) {
+				case WriteBatch::INSERT:
+					batch.Insert(op.key, op.val);
+					break;
+				case WriteBatch::REMOVE:
+					batch.Remove(op.key);
+					break;
+				case WriteBatch::INCREMENT:
+					batch.Increment(op.key, op.val);
+					break;
+				case WriteBatch::DECREMENT:
+					batch.Decrement(op.key, op.val);
+					break;
+				}
+				}
+
+			return unique_ptr<Update>(new BatchUpdate(topic, move(batch)));
+			}
+
+		default:
+			{
+			int op = atomic_op_from_code(type);
+
+			if ( op < 0 )
+				return nullptr;
+
+			kv_pair kv;
+			value_type expected;
+			unserialize_atomic_args(AtomicOp(op), &msg, &size, &kv,
+			                        &expected);
+			return unique_ptr<Update>(new AtomicUpdate(topic, AtomicOp(op),
+			                                           kv.first, kv.second,
+			                                           expected));
+			}
+		}
 		}
 	catch ( parse_error& ) { return nullptr; }
+	}
 
-	if ( type == "INSERT" )
-		return unique_ptr<Update>(new InsertUpdate(topic, kv.first, kv.second));
+unique_ptr<Update> nnc::Update::Parse(const char* msg, size_t size)
+	{
+	string topic;
+	uint32_t topic_id;
+	unique_ptr<Update> rval;
 
-	if ( type == "+=" )
-		return unique_ptr<Update>(new IncrementUpdate(topic, kv.first,
-		                                              kv.second));
+	if ( unserialize_topic(&msg, &size, &topic, &topic_id) )
+		rval = parse_update(topic, msg, size);
 
-	if ( type == "-=" )
-		return unique_ptr<Update>(new DecrementUpdate(topic, kv.first,
-		                                              kv.second));
+	if ( rval )
+		rval->SetTopicId(topic_id);
 
-	return nullptr;
+	Metrics::Add(rval ? METRIC_UPDATES_PARSED : METRIC_UPDATES_INVALID);
+	return rval;
 	}
 
 void nnc::InsertUpdate::DoPrepare()
 	{
-	stringstream ss;
-	ss << Topic() << " INSERT ";
-	serialize_kv_pair(ss, key, val);
-	SetMsg(ss.str());
+	auto s = pooled_string();
+	serialize_topic(s.get(), Topic(), TopicId());
+	s->push_back(' ');
+	InsertUpdateSchema::Encode(s.get(), key, val);
+	SetMsg(move(s));
 	}
 
 void nnc::RemoveUpdate::DoPrepare()
 	{
-	stringstream ss;
-	ss << Topic() << " REMOVE ";
-	serialize_key(ss, key);
-	SetMsg(ss.str());
+	auto s = pooled_string();
+	serialize_topic(s.get(), Topic(), TopicId());
+	s->push_back(' ');
+	RemoveUpdateSchema::Encode(s.get(), key);
+	SetMsg(move(s));
 	}
 
 void nnc::IncrementUpdate::DoPrepare()
 	{
-	stringstream ss;
-	ss << Topic() << " += ";
-	serialize_kv_pair(ss, key, by);
-	SetMsg(ss.str());
+	auto s = pooled_string();
+	serialize_topic(s.get(), Topic(), TopicId());
+	s->push_back(' ');
+	IncrementUpdateSchema::Encode(s.get(), key, by);
+	SetMsg(move(s));
 	}
 
 void nnc::DecrementUpdate::DoPrepare()
 	{
-	stringstream ss;
-	ss << Topic() << " -= ";
-	serialize_kv_pair(ss, key, by);
-	SetMsg(ss.str());
+	auto s = pooled_string();
+	serialize_topic(s.get(), Topic(), TopicId());
+	s->push_back(' ');
+	DecrementUpdateSchema::Encode(s.get(), key, by);
+	SetMsg(move(s));
+	}
+
+void nnc::AtomicUpdate::DoPrepare()
+	{
+	auto s = pooled_string();
+	serialize_topic(s.get(), Topic(), TopicId());
+	s->push_back(' ');
+	serialize_atomic_op(s.get(), op, key, operand, expected);
+	SetMsg(move(s));
+	}
+
+void nnc::CounterUpdate::DoPrepare()
+	{
+	auto s = pooled_string();
+	serialize_topic(s.get(), Topic(), TopicId());
+	s->push_back(' ');
+	CounterUpdateSchema::Encode(s.get(), node, states);
+	SetMsg(move(s));
+	}
+
+void nnc::BatchUpdate::DoPrepare()
+	{
+	auto s = pooled_string();
+	serialize_topic(s.get(), Topic(), TopicId());
+	s->push_back(' ');
+	BatchUpdateSchema::Encode(s.get(), batch.Ops());
+	SetMsg(move(s));
 	}
 
 void nnc::ClearUpdate::DoPrepare()
 	{
-	stringstream ss;
-	ss << Topic() << " CLEAR";
-	SetMsg(ss.str());
+	auto s = pooled_string();
+	serialize_topic(s.get(), Topic(), TopicId());
+	s->push_back(' ');
+	ClearUpdateSchema::Encode(s.get());
+	SetMsg(move(s));
 	}
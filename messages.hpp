@@ -3,8 +3,10 @@
 
 #include "type_aliases.hpp"
 #include "frontend.hpp"
+#include "pool.hpp"
 
 #include <string>
+#include <vector>
 #include <exception>
 #include <memory>
 #include <sys/time.h>
@@ -16,44 +18,149 @@ class Response;
 class parse_error : public std::exception {
 };
 
+// Messages name their topic either by string or, once the authoritative side
+// has assigned one, by a numeric ID encoded as '#' followed by 4 big-endian
+// bytes.  Topic names therefore can't start with '#'.  ID 0 means unassigned.
+// Nor can they start with '!', which marks traced requests.
+std::string encode_topic_id(uint32_t topic_id);
+
+// The response to a traced request, with the server's stamps in front:
+// "!<received> <processed> <reply sent> <response>".
+std::string encode_traced_response(const std::string& response,
+                                   const RequestTrace& trace);
+
+// Skips past the server's stamps in front of a response, if any, filling them
+// in.  Returns false for a malformed prefix.
+bool decode_traced_response(const char** msg, size_t* size,
+                            RequestTrace* trace);
+
+// The concrete type of a message, which message_cast() checks in place of
+// RTTI.
+enum MessageType {
+	MESSAGE_LOOKUP_REQUEST,
+	MESSAGE_HAS_KEY_REQUEST,
+	MESSAGE_SIZE_REQUEST,
+	MESSAGE_SCAN_REQUEST,
+	MESSAGE_ATOMIC_REQUEST,
+	MESSAGE_SNAPSHOT_REQUEST,
+	MESSAGE_TOPIC_ID_REQUEST,
+	MESSAGE_FETCH_REQUEST,
+	MESSAGE_STATS_REQUEST,
+	MESSAGE_BATCH_REQUEST,
+	MESSAGE_LOOKUP_RESPONSE,
+	MESSAGE_HAS_KEY_RESPONSE,
+	MESSAGE_SIZE_RESPONSE,
+	MESSAGE_STATS_RESPONSE,
+	MESSAGE_SNAPSHOT_RESPONSE,
+	MESSAGE_ATOMIC_RESPONSE,
+	MESSAGE_TOPIC_ID_RESPONSE,
+	MESSAGE_SCAN_RESPONSE,
+	MESSAGE_ENCODED_RESPONSE,
+	MESSAGE_FETCH_RESPONSE,
+	MESSAGE_BATCH_RESPONSE,
+	MESSAGE_INVALID_REQUEST_RESPONSE,
+	MESSAGE_VAL_UPDATE_PUBLICATION,
+	MESSAGE_CLEAR_PUBLICATION,
+	MESSAGE_BATCH_PUBLICATION,
+	MESSAGE_COUNTER_PUBLICATION,
+	MESSAGE_HEARTBEAT_PUBLICATION,
+	MESSAGE_DROP_PUBLICATION,
+	MESSAGE_INSERT_UPDATE,
+	MESSAGE_REMOVE_UPDATE,
+	MESSAGE_INCREMENT_UPDATE,
+	MESSAGE_DECREMENT_UPDATE,
+	MESSAGE_ATOMIC_UPDATE,
+	MESSAGE_BATCH_UPDATE,
+	MESSAGE_COUNTER_UPDATE,
+	MESSAGE_CLEAR_UPDATE,
+};
+
 class Message {
 public:
 
-	Message() = default;
+	Message(MessageType arg_type)
+		: type(arg_type) {}
 
 	virtual ~Message() {}
 
+	// Messages come and go with every change, so their memory is pooled.
+	static void* operator new(size_t size)
+		{ return pool_allocate(size); }
+
+	static void operator delete(void* p, size_t size)
+		{ pool_free(p, size); }
+
 	const std::string& Msg()
-		{ if ( message.empty() ) Prepare(); return message; }
+		{ if ( ! message ) Prepare(); return *message; }
+
+	// The encoded form is shared so that it can be cached and sent again
+	// without copying (e.g. full snapshots).
+	std::shared_ptr<const std::string> SharedMsg()
+		{ if ( ! message ) Prepare(); return message; }
+
+	void SetMsg(std::string arg_message)
+		{ message = make_pooled<const std::string>(std::move(arg_message)); }
 
-	void SetMsg(const std::string& arg_message)
-		{ message = arg_message; }
+	void SetMsg(std::shared_ptr<const std::string> arg_message)
+		{ message = std::move(arg_message); }
 
 	void Prepare()
 		{ DoPrepare(); }
 
+	MessageType Type() const
+		{ return type; }
+
 private:
 
 	virtual void DoPrepare() = 0;
 
-	std::string message;
+	std::shared_ptr<const std::string> message;
+	MessageType type;
 };
 
+// The message as a T, or null if it's of another type.  Responses are matched
+// to requests with this on every round trip, so it compares the type tag each
+// concrete class declares instead of going through dynamic_cast.
+template<class T>
+T* message_cast(Message* m)
+	{ return m && m->Type() == T::message_type ? static_cast<T*>(m) : nullptr; }
+
+template<class T>
+const T* message_cast(const Message* m)
+	{
+	return m && m->Type() == T::message_type ? static_cast<const T*>(m)
+	                                         : nullptr;
+	}
+
 // Sent on request socket of non-authoritative backend, and read from reply
 // socket of authoritative backend.
 class Request : public Message {
 public:
 
-	Request(const std::string& topic, double timeout);
+	Request(MessageType type, const std::string& topic, double timeout);
 
 	virtual ~Request() {}
 
 	const std::string& Topic() const
 		{ return topic; }
 
+	uint32_t TopicId() const
+		{ return topic_id; }
+
+	void SetTopicId(uint32_t arg_topic_id)
+		{ topic_id = arg_topic_id; }
+
 	bool TimedOut() const
 		{ return DoTimedOut(); }
 
+	// Whether the request is subject to its timeout at all.
+	virtual bool Expires() const
+		{ return true; }
+
+	// Whether the backend may send the request as part of a BatchRequest.
+	virtual bool Batchable() const
+		{ return false; }
+
 	double CreationTime() const
 		{ return creation_time; }
 
@@ -68,14 +175,32 @@ public:
 	bool Sent() const
 		{ return sent; }
 
+	// Traced requests collect stamps as they go through the backends.
+	bool Traced() const
+		{ return traced; }
+
+	void SetTraced(bool arg_traced)
+		{ traced = arg_traced; }
+
+	RequestTrace& Trace()
+		{ return trace; }
+
+	const RequestTrace& Trace() const
+		{ return trace; }
+
 	std::unique_ptr<Response>
-	Process(const AuthoritativeFrontend* frontend) const
+	Process(AuthoritativeFrontend* frontend) const
 		{ return DoProcess(frontend); }
 
 	bool Process(std::unique_ptr<Response> response,
 	             NonAuthoritativeFrontend* frontend) const
 		{ return DoProcess(move(response), frontend); }
 
+	// Answers from a replica's store, as of its sequence.  Returns null for
+	// requests only the authoritative side can answer, e.g. atomics.
+	std::unique_ptr<Response> ProcessRead(const Frontend* frontend) const
+		{ return DoProcessRead(frontend); }
+
 	static std::unique_ptr<Request> Parse(const char* msg, size_t size);
 
 protected:
@@ -85,32 +210,46 @@ protected:
 private:
 
 	virtual std::unique_ptr<Response>
-	        DoProcess(const AuthoritativeFrontend* frontend) const = 0;
+	        DoProcess(AuthoritativeFrontend* frontend) const = 0;
 
 	virtual bool DoProcess(std::unique_ptr<Response> response,
 	                       NonAuthoritativeFrontend* frontend) const = 0;
 
+	virtual std::unique_ptr<Response>
+	        DoProcessRead(const Frontend* frontend) const
+		{ return nullptr; }
+
 	bool sent = false;
+	bool traced = false;
+	RequestTrace trace;
 	std::string topic;
+	uint32_t topic_id = 0;
 	double creation_time;
 	double timeout;
 };
 
+// Receives the stamps of each traced request once it's answered or timed out.
+using trace_cb = std::function<void(const Request&, const RequestTrace&)>;
+
 class LookupRequest : public Request {
 public:
 
+	static const MessageType message_type = MESSAGE_LOOKUP_REQUEST;
+
 	LookupRequest(const std::string& topic, const key_type& arg_key,
 	              double timeout, lookup_cb arg_cb)
-		: Request(topic, timeout), key(arg_key), cb(arg_cb) {}
+		: Request(message_type, topic, timeout), key(arg_key), cb(arg_cb) {}
 
 private:
 
 	virtual void DoPrepare() override;
 	virtual bool DoTimedOut() const override;
 	virtual std::unique_ptr<Response>
-	        DoProcess(const AuthoritativeFrontend* frontend) const override;
+	        DoProcess(AuthoritativeFrontend* frontend) const override;
 	virtual bool DoProcess(std::unique_ptr<Response> response,
 	                       NonAuthoritativeFrontend* frontend) const override;
+	virtual std::unique_ptr<Response>
+	        DoProcessRead(const Frontend* frontend) const override;
 
 	key_type key;
 	lookup_cb cb;
@@ -119,18 +258,22 @@ private:
 class HasKeyRequest : public Request {
 public:
 
+	static const MessageType message_type = MESSAGE_HAS_KEY_REQUEST;
+
 	HasKeyRequest(const std::string& topic, const key_type& arg_key,
 	              double timeout, haskey_cb arg_cb)
-		: Request(topic, timeout), key(arg_key), cb(arg_cb) {}
+		: Request(message_type, topic, timeout), key(arg_key), cb(arg_cb) {}
 
 private:
 
 	virtual void DoPrepare() override;
 	virtual bool DoTimedOut() const override;
 	virtual std::unique_ptr<Response>
-	        DoProcess(const AuthoritativeFrontend* frontend) const override;
+	        DoProcess(AuthoritativeFrontend* frontend) const override;
 	virtual bool DoProcess(std::unique_ptr<Response> response,
 	                       NonAuthoritativeFrontend* frontend) const override;
+	virtual std::unique_ptr<Response>
+	        DoProcessRead(const Frontend* frontend) const override;
 
 	key_type key;
 	haskey_cb cb;
@@ -139,26 +282,107 @@ private:
 class SizeRequest : public Request {
 public:
 
+	static const MessageType message_type = MESSAGE_SIZE_REQUEST;
+
 	SizeRequest(const std::string& topic, double timeout, size_cb arg_cb)
-		: Request(topic, timeout), cb(arg_cb) {}
+		: Request(message_type, topic, timeout), cb(arg_cb) {}
 
 private:
 
 	virtual void DoPrepare() override;
 	virtual bool DoTimedOut() const override;
 	virtual std::unique_ptr<Response>
-	        DoProcess(const AuthoritativeFrontend* frontend) const override;
+	        DoProcess(AuthoritativeFrontend* frontend) const override;
 	virtual bool DoProcess(std::unique_ptr<Response> response,
 	                       NonAuthoritativeFrontend* frontend) const override;
+	virtual std::unique_ptr<Response>
+	        DoProcessRead(const Frontend* frontend) const override;
 
 	size_cb cb;
 };
 
+class ScanRequest : public Request {
+public:
+
+	static const MessageType message_type = MESSAGE_SCAN_REQUEST;
+
+	ScanRequest(const std::string& topic, const key_type& arg_begin,
+	            const key_type& arg_end, uint64_t arg_limit, double timeout,
+	            scan_cb arg_cb)
+		: Request(message_type, topic, timeout), begin(arg_begin), end(arg_end),
+		  limit(arg_limit), cb(arg_cb) {}
+
+private:
+
+	virtual void DoPrepare() override;
+	virtual bool DoTimedOut() const override;
+	virtual std::unique_ptr<Response>
+	        DoProcess(AuthoritativeFrontend* frontend) const override;
+	virtual bool DoProcess(std::unique_ptr<Response> response,
+	                       NonAuthoritativeFrontend* frontend) const override;
+	virtual std::unique_ptr<Response>
+	        DoProcessRead(const Frontend* frontend) const override;
+
+	key_type begin;
+	key_type end;
+	uint64_t limit;
+	scan_cb cb;
+};
+
+class AtomicRequest : public Request {
+public:
+
+	static const MessageType message_type = MESSAGE_ATOMIC_REQUEST;
+
+	AtomicRequest(const std::string& topic, AtomicOp arg_op,
+	              const key_type& arg_key, const value_type& arg_operand,
+	              const value_type& arg_expected, double timeout,
+	              atomic_cb arg_cb)
+		: Request(message_type, topic, timeout), op(arg_op), key(arg_key),
+		  operand(arg_operand), expected(arg_expected), cb(arg_cb) {}
+
+private:
+
+	virtual void DoPrepare() override;
+	virtual bool DoTimedOut() const override;
+	virtual std::unique_ptr<Response>
+	        DoProcess(AuthoritativeFrontend* frontend) const override;
+	virtual bool DoProcess(std::unique_ptr<Response> response,
+	                       NonAuthoritativeFrontend* frontend) const override;
+
+	AtomicOp op;
+	key_type key;
+	value_type operand;
+	value_type expected;
+	atomic_cb cb;
+};
+
 class SnapshotRequest : public Request {
 public:
 
-	SnapshotRequest(const std::string& topic)
-		: Request(topic, 0) {}
+	static const MessageType message_type = MESSAGE_SNAPSHOT_REQUEST;
+
+	// A non-empty key prefix limits the snapshot to keys starting with it.
+	// first_buffered is the sequence of the oldest publication the
+	// requester holds, or 0 if none: a snapshot no older than the one just
+	// before it still brings the requester up to date.
+	SnapshotRequest(const std::string& topic,
+	                const key_type& arg_key_prefix = key_type(),
+	                uint64_t arg_first_buffered = 0)
+		: Request(message_type, topic, 0), key_prefix(arg_key_prefix),
+		  first_buffered(arg_first_buffered) {}
+
+	const key_type& KeyPrefix() const
+		{ return key_prefix; }
+
+	uint64_t FirstBuffered() const
+		{ return first_buffered; }
+
+	virtual bool Expires() const override
+		{ return false; }
+
+	virtual bool Batchable() const override
+		{ return true; }
 
 private:
 
@@ -167,11 +391,147 @@ private:
 		{ return false; }
 
 	virtual std::unique_ptr<Response>
-	        DoProcess(const AuthoritativeFrontend* frontend) const override;
+	        DoProcess(AuthoritativeFrontend* frontend) const override;
 	virtual bool DoProcess(std::unique_ptr<Response> response,
 	                       NonAuthoritativeFrontend* frontend) const override;
+	virtual std::unique_ptr<Response>
+	        DoProcessRead(const Frontend* frontend) const override;
 
-	std::string topic;
+	key_type key_prefix;
+	uint64_t first_buffered;
+};
+
+// Asks for the numeric ID of a topic, always naming it by string.
+class TopicIdRequest : public Request {
+public:
+
+	static const MessageType message_type = MESSAGE_TOPIC_ID_REQUEST;
+
+	TopicIdRequest(const std::string& topic)
+		: Request(message_type, topic, 0) {}
+
+	virtual bool Expires() const override
+		{ return false; }
+
+	virtual bool Batchable() const override
+		{ return true; }
+
+private:
+
+	virtual void DoPrepare() override;
+	virtual bool DoTimedOut() const override
+		{ return false; }
+
+	virtual std::unique_ptr<Response>
+	        DoProcess(AuthoritativeFrontend* frontend) const override;
+	virtual bool DoProcess(std::unique_ptr<Response> response,
+	                       NonAuthoritativeFrontend* frontend) const override;
+	virtual std::unique_ptr<Response>
+	        DoProcessRead(const Frontend* frontend) const override;
+};
+
+// Asks for the current state of some keys, for a partial replica to cache.
+// Answered with a FetchResponse.
+class FetchRequest : public Request {
+public:
+
+	static const MessageType message_type = MESSAGE_FETCH_REQUEST;
+
+	FetchRequest(const std::string& topic, std::vector<key_type> arg_keys)
+		: Request(message_type, topic, 0), keys(std::move(arg_keys)) {}
+
+	const std::vector<key_type>& Keys() const
+		{ return keys; }
+
+	// Lookups waiting on the keys time out on their own.
+	virtual bool Expires() const override
+		{ return false; }
+
+	virtual bool Batchable() const override
+		{ return true; }
+
+private:
+
+	virtual void DoPrepare() override;
+	virtual bool DoTimedOut() const override
+		{ return false; }
+
+	virtual std::unique_ptr<Response>
+	        DoProcess(AuthoritativeFrontend* frontend) const override;
+	virtual bool DoProcess(std::unique_ptr<Response> response,
+	                       NonAuthoritativeFrontend* frontend) const override;
+	virtual std::unique_ptr<Response>
+	        DoProcessRead(const Frontend* frontend) const override;
+
+	std::vector<key_type> keys;
+};
+
+// Asks an authoritative backend for its StatsResponse.  An empty topic, sent
+// as "*", covers all of the backend's topics.  Backends answer it themselves,
+// frontends alone only know their store.
+class StatsRequest : public Request {
+public:
+
+	static const MessageType message_type = MESSAGE_STATS_REQUEST;
+
+	StatsRequest(const std::string& topic, double timeout, stats_cb arg_cb)
+		: Request(message_type, topic, timeout), cb(arg_cb) {}
+
+private:
+
+	virtual void DoPrepare() override;
+	virtual bool DoTimedOut() const override;
+	virtual std::unique_ptr<Response>
+	        DoProcess(AuthoritativeFrontend* frontend) const override;
+	virtual bool DoProcess(std::unique_ptr<Response> response,
+	                       NonAuthoritativeFrontend* frontend) const override;
+
+	stats_cb cb;
+};
+
+// Several requests of different topics sent as one, so that joining many
+// topics takes a round trip per step rather than one per topic.  Backends
+// answer with a BatchResponse holding each request's response in turn.
+// Sent under the "*" topic.
+class BatchRequest : public Request {
+public:
+
+	static const MessageType message_type = MESSAGE_BATCH_REQUEST;
+
+	BatchRequest()
+		: Request(message_type, "", 0) {}
+
+	// Only before the message is prepared.
+	void Add(std::unique_ptr<Request> request)
+		{ requests.push_back(std::move(request)); }
+
+	const std::vector<std::unique_ptr<Request>>& Requests() const
+		{ return requests; }
+
+	virtual bool Expires() const override
+		{ return false; }
+
+	// Hands each request its part of a BatchResponse, along with the
+	// frontend 'find' returns for the request's topic.  A response of
+	// another type fails all of them.
+	void ProcessEach(std::unique_ptr<Response> response,
+	                 const std::function<NonAuthoritativeFrontend*(
+	                         const std::string&)>& find) const;
+
+private:
+
+	virtual void DoPrepare() override;
+	virtual bool DoTimedOut() const override
+		{ return false; }
+
+	// Backends answer each request of the batch themselves.
+	virtual std::unique_ptr<Response>
+	        DoProcess(AuthoritativeFrontend* frontend) const override
+		{ return nullptr; }
+	virtual bool DoProcess(std::unique_ptr<Response> response,
+	                       NonAuthoritativeFrontend* frontend) const override;
+
+	std::vector<std::unique_ptr<Request>> requests;
 };
 
 // Sent on reply socket of authoritative backend, and read from request socket
@@ -179,6 +539,9 @@ private:
 class Response : public Message {
 public:
 
+	Response(MessageType type)
+		: Message(type) {}
+
 	virtual ~Response() {}
 
 	static std::unique_ptr<Response> Parse(const char* msg, size_t size);
@@ -187,25 +550,31 @@ public:
 class LookupResponse : public Response {
 public:
 
+	static const MessageType message_type = MESSAGE_LOOKUP_RESPONSE;
+
 	LookupResponse(const value_type* arg_val)
-		: val(arg_val ? std::unique_ptr<value_type>(new value_type(*arg_val))
-	                  : nullptr) {}
+		: Response(message_type), has_val(arg_val),
+		  val(arg_val ? *arg_val : 0) {}
 
-	std::unique_ptr<value_type> Val()
-		{ return std::move(val); }
+	std::unique_ptr<value_type> Val() const
+		{ return std::unique_ptr<value_type>(has_val ? new value_type(val)
+		                                             : nullptr); }
 
 private:
 
 	virtual void DoPrepare() override;
 
-	std::unique_ptr<value_type> val;
+	bool has_val;
+	value_type val;
 };
 
 class HasKeyResponse : public Response {
 public:
 
+	static const MessageType message_type = MESSAGE_HAS_KEY_RESPONSE;
+
 	HasKeyResponse(bool arg_exists)
-		: exists(arg_exists) {}
+		: Response(message_type), exists(arg_exists) {}
 
 	bool Exists() const
 		{ return exists; }
@@ -220,8 +589,10 @@ private:
 class SizeResponse : public Response {
 public:
 
+	static const MessageType message_type = MESSAGE_SIZE_RESPONSE;
+
 	SizeResponse(uint64_t arg_size)
-		: size(arg_size) {}
+		: Response(message_type), size(arg_size) {}
 
 	uint64_t Size() const
 		{ return size; }
@@ -233,14 +604,40 @@ private:
 	uint64_t size;
 };
 
+// Also published on its own, with the "STATS " prefix to subscribe to, by
+// authoritative backends with a stats interval.
+class StatsResponse : public Response {
+public:
+
+	static const MessageType message_type = MESSAGE_STATS_RESPONSE;
+
+	StatsResponse(BackendStats arg_stats)
+		: Response(message_type), stats(std::move(arg_stats)) {}
+
+	const BackendStats& Stats() const
+		{ return stats; }
+
+private:
+
+	virtual void DoPrepare() override;
+
+	BackendStats stats;
+};
+
 class SnapshotResponse : public Response {
 public:
 
-	SnapshotResponse(const kv_store_type& arg_store, uint64_t arg_sequence)
-		: store(arg_store), sequence(arg_sequence) {}
+	static const MessageType message_type = MESSAGE_SNAPSHOT_RESPONSE;
+
+	SnapshotResponse(const kv_store_type& arg_store, uint64_t arg_sequence,
+	                 uint32_t arg_topic_id = 0)
+		: Response(message_type), store(arg_store), sequence(arg_sequence),
+		  topic_id(arg_topic_id) {}
 
-	SnapshotResponse(kv_store_type&& arg_store, uint64_t arg_sequence)
-		: store(arg_store), sequence(arg_sequence) {}
+	SnapshotResponse(kv_store_type&& arg_store, uint64_t arg_sequence,
+	                 uint32_t arg_topic_id = 0)
+		: Response(message_type), store(std::move(arg_store)),
+		  sequence(arg_sequence), topic_id(arg_topic_id) {}
 
 	kv_store_type&& Store()
 		{ return std::move(store); }
@@ -248,19 +645,176 @@ public:
 	uint64_t Sequence() const
 		{ return sequence; }
 
+	// Lets subscribers notice the topic's ID changed, e.g. after the
+	// authoritative side restarted.
+	uint32_t TopicId() const
+		{ return topic_id; }
+
+	// The threads parsing a large snapshot may use, including the calling
+	// one, which inserts the pairs the others decode.  0, the default,
+	// means one per core.
+	static void SetDecodeThreads(size_t n);
+
 private:
 
 	virtual void DoPrepare() override;
 
 	kv_store_type store;
 	uint64_t sequence;
+	uint32_t topic_id;
+};
+
+class AtomicResponse : public Response {
+public:
+
+	static const MessageType message_type = MESSAGE_ATOMIC_RESPONSE;
+
+	AtomicResponse(bool arg_applied, const value_type* arg_val,
+	               uint64_t arg_sequence)
+		: Response(message_type), applied(arg_applied), has_val(arg_val),
+		  val(arg_val ? *arg_val : 0), sequence(arg_sequence) {}
+
+	bool Applied() const
+		{ return applied; }
+
+	std::unique_ptr<value_type> Val() const
+		{ return std::unique_ptr<value_type>(has_val ? new value_type(val)
+		                                             : nullptr); }
+
+	uint64_t Sequence() const
+		{ return sequence; }
+
+private:
+
+	virtual void DoPrepare() override;
+
+	bool applied;
+	bool has_val;
+	value_type val;
+	uint64_t sequence;
+};
+
+class TopicIdResponse : public Response {
+public:
+
+	static const MessageType message_type = MESSAGE_TOPIC_ID_RESPONSE;
+
+	TopicIdResponse(uint32_t arg_topic_id)
+		: Response(message_type), topic_id(arg_topic_id) {}
+
+	uint32_t TopicId() const
+		{ return topic_id; }
+
+private:
+
+	virtual void DoPrepare() override;
+
+	uint32_t topic_id;
+};
+
+class ScanResponse : public Response {
+public:
+
+	static const MessageType message_type = MESSAGE_SCAN_RESPONSE;
+
+	ScanResponse(kv_pair_list&& arg_pairs, bool arg_more,
+	             const key_type& arg_next)
+		: Response(message_type), pairs(std::move(arg_pairs)), more(arg_more),
+		  next(arg_next) {}
+
+	kv_pair_list&& Pairs()
+		{ return std::move(pairs); }
+
+	bool More() const
+		{ return more; }
+
+	const key_type& Next() const
+		{ return next; }
+
+private:
+
+	virtual void DoPrepare() override;
+
+	kv_pair_list pairs;
+	bool more;
+	key_type next;
+};
+
+// A response whose encoded form was produced earlier, e.g. a cached snapshot.
+class EncodedResponse : public Response {
+public:
+
+	static const MessageType message_type = MESSAGE_ENCODED_RESPONSE;
+
+	EncodedResponse(std::shared_ptr<const std::string> msg)
+		: Response(message_type)
+		{ SetMsg(std::move(msg)); }
+
+private:
+
+	virtual void DoPrepare() override
+		{}
+};
+
+// The values of fetched keys as of a sequence number.
+class FetchResponse : public Response {
+public:
+
+	static const MessageType message_type = MESSAGE_FETCH_RESPONSE;
+
+	struct Entry {
+		key_type key;
+		bool exists;
+		value_type val;
+	};
+
+	FetchResponse(uint64_t arg_sequence)
+		: Response(message_type), sequence(arg_sequence) {}
+
+	// A null value means the key doesn't exist.
+	void Add(const key_type& key, const value_type* val)
+		{ entries.push_back({key, val != nullptr, val ? *val : 0}); }
+
+	uint64_t Sequence() const
+		{ return sequence; }
+
+	const std::vector<Entry>& Entries() const
+		{ return entries; }
+
+private:
+
+	virtual void DoPrepare() override;
+
+	uint64_t sequence;
+	std::vector<Entry> entries;
+};
+
+class BatchResponse : public Response {
+public:
+
+	static const MessageType message_type = MESSAGE_BATCH_RESPONSE;
+
+	BatchResponse(std::vector<std::unique_ptr<Response>> arg_responses)
+		: Response(message_type), responses(std::move(arg_responses)) {}
+
+	// A part that failed to parse is null.
+	std::vector<std::unique_ptr<Response>>& Responses()
+		{ return responses; }
+
+private:
+
+	virtual void DoPrepare() override;
+
+	std::vector<std::unique_ptr<Response>> responses;
 };
 
 class InvalidRequestResponse : public Response {
 public:
 
+	static const MessageType message_type = MESSAGE_INVALID_REQUEST_RESPONSE;
+
 	InvalidRequestResponse(const std::string& arg_reason = "malformed")
-		: reason(arg_reason) {}
+		: Response(message_type), reason(arg_reason) {}
 
 private:
 
@@ -274,27 +828,58 @@ private:
 class Publication : public Message {
 public:
 
-	Publication(const std::string& arg_topic, uint64_t arg_sequence)
-		: topic(arg_topic), sequence(arg_sequence) {}
+	Publication(MessageType type, const std::string& arg_topic,
+	            uint64_t arg_sequence)
+		: Message(type), topic(arg_topic), sequence(arg_sequence) {}
 
 	virtual ~Publication() {}
 
+	// Empty when received: publications always carry the topic's ID.
 	const std::string& Topic() const
 		{ return topic; }
 
+	uint32_t TopicId() const
+		{ return topic_id; }
+
+	void SetTopicId(uint32_t arg_topic_id)
+		{ topic_id = arg_topic_id; }
+
 	uint64_t Sequence() const
 		{ return sequence; }
 
-	virtual bool Apply(kv_store_type& store) const
-		{ return DoApply(store); }
+	// Publications about several keys are topic-wide, so a replica limited
+	// to a key prefix passes it along to skip the keys it doesn't hold.
+	virtual bool Apply(kv_store_type& store,
+	                   const key_type& key_prefix = key_type()) const
+		{ return DoApply(store, key_prefix); }
+
+	// Adds the keys the publication changes, or returns false if it can
+	// change any of them, like clearing the store does.
+	bool ChangedKeys(std::vector<const key_type*>* keys) const
+		{ return DoChangedKeys(keys); }
 
 	static std::unique_ptr<Publication> Parse(const char* msg, size_t size);
 
+	// Publications about a single key put the raw key directly after the
+	// topic so SUB sockets can filter on key prefixes before anything is
+	// parsed.  Everything else is marked as topic-wide.  These are the SUB
+	// socket subscriptions that select a topic, or a topic's keys starting
+	// with a given prefix.
+	static std::vector<std::string>
+	Subscriptions(uint32_t topic_id, const key_type& key_prefix);
+
+	// The subscription to publications about a single key.  Longer keys
+	// starting with the key and a space match it too.
+	static std::string KeySubscription(uint32_t topic_id, const key_type& key);
+
 private:
 
-	virtual bool DoApply(kv_store_type& store) const = 0;
+	virtual bool DoApply(kv_store_type& store,
+	                     const key_type& key_prefix) const = 0;
+	virtual bool DoChangedKeys(std::vector<const key_type*>* keys) const = 0;
 
 	std::string topic;
+	uint32_t topic_id = 0;
 	uint64_t sequence;
 };
 
@@ -303,35 +888,178 @@ private:
 class ValUpdatePublication : public Publication {
 public:
 
+	static const MessageType message_type = MESSAGE_VAL_UPDATE_PUBLICATION;
+
 	ValUpdatePublication(const std::string& topic, const key_type& arg_key,
 	                     const value_type* arg_val, uint64_t sequence)
-		: Publication(topic, sequence), key(arg_key),
-	      val(arg_val ? std::unique_ptr<value_type>(new value_type(*arg_val))
-	                  : nullptr) {}
+		: Publication(message_type, topic, sequence), key(arg_key),
+		  has_val(arg_val), val(arg_val ? *arg_val : 0) {}
+
+	const key_type& Key() const
+		{ return key; }
 
 private:
 
 	virtual void DoPrepare() override;
-	virtual bool DoApply(kv_store_type& store) const override
-		{ if ( val ) store[key] = *val.get(); else store.erase(key);
+	virtual bool DoApply(kv_store_type& store,
+	                     const key_type& key_prefix) const override
+		{ if ( has_val ) store[key] = val; else store.erase(key);
 		  return true; }
+	virtual bool
+	DoChangedKeys(std::vector<const key_type*>* keys) const override
+		{ keys->push_back(&key); return true; }
 
 	key_type key;
-	std::unique_ptr<value_type> val;
+	bool has_val;
+	value_type val;
 };
 
 class ClearPublication : public Publication {
 public:
 
+	static const MessageType message_type = MESSAGE_CLEAR_PUBLICATION;
+
 	ClearPublication(const std::string& topic, uint64_t sequence)
-		: Publication(topic, sequence) {}
+		: Publication(message_type, topic, sequence) {}
 
-	virtual bool DoApply(kv_store_type& store) const override
+	virtual bool DoApply(kv_store_type& store,
+	                     const key_type& key_prefix) const override
 		{ store.clear(); return true; }
 
 private:
 
 	virtual void DoPrepare() override;
+	virtual bool
+	DoChangedKeys(std::vector<const key_type*>* keys) const override
+		{ return false; }
+};
+
+// The resulting values of all keys a WriteBatch changed.
+class BatchPublication : public Publication {
+public:
+
+	static const MessageType message_type = MESSAGE_BATCH_PUBLICATION;
+
+	BatchPublication(const std::string& topic, uint64_t sequence)
+		: Publication(message_type, topic, sequence) {}
+
+	// A null value means the key was removed.
+	void Add(const key_type& key, const value_type* val)
+		{ entries.push_back({key, val != nullptr, val ? *val : 0}); }
+
+private:
+
+	struct Entry {
+		key_type key;
+		bool exists;
+		value_type val;
+	};
+
+	virtual void DoPrepare() override;
+	virtual bool DoApply(kv_store_type& store,
+	                     const key_type& key_prefix) const override;
+	virtual bool
+	DoChangedKeys(std::vector<const key_type*>* keys) const override;
+
+	std::vector<Entry> entries;
+};
+
+// Totals of PN-counters after merging one node's states.  The node's merged
+// state is included so it can tell which of its own counts are reflected.
+class CounterPublication : public Publication {
+public:
+
+	static const MessageType message_type = MESSAGE_COUNTER_PUBLICATION;
+
+	struct Entry {
+		key_type key;
+		pn_counter state;
+		value_type total;
+	};
+
+	CounterPublication(const std::string& topic, uint64_t sequence,
+	                   const std::string& arg_node)
+		: Publication(message_type, topic, sequence), node(arg_node) {}
+
+	void Add(const key_type& key, const pn_counter& state,
+	         const value_type& total)
+		{ entries.push_back({key, state, total}); }
+
+	const std::string& Node() const
+		{ return node; }
+
+	const std::vector<Entry>& Entries() const
+		{ return entries; }
+
+private:
+
+	virtual void DoPrepare() override;
+	virtual bool DoApply(kv_store_type& store,
+	                     const key_type& key_prefix) const override;
+	virtual bool
+	DoChangedKeys(std::vector<const key_type*>* keys) const override;
+
+	std::string node;
+	std::vector<Entry> entries;
+};
+
+// Published topic-wide now and then.  A replica limited to a key prefix
+// sees only some sequence numbers, so it can't tell a missed publication
+// from one that wasn't for it.  Instead it compares how many it applied
+// between heartbeats with how many there were, by the counts heartbeats
+// carry for each prefix the publisher tracks.
+class HeartbeatPublication : public Publication {
+public:
+
+	static const MessageType message_type = MESSAGE_HEARTBEAT_PUBLICATION;
+
+	// The sequence is the topic's as of the heartbeat.
+	HeartbeatPublication(const std::string& topic, uint64_t sequence)
+		: Publication(message_type, topic, sequence) {}
+
+	// The number of publications about keys starting with the prefix since
+	// the publisher began tracking it.
+	void Add(const key_type& key_prefix, uint64_t count)
+		{ counts.emplace_back(key_prefix, count); }
+
+	// Returns false if the prefix isn't tracked.
+	bool Count(const key_type& key_prefix, uint64_t* count) const;
+
+private:
+
+	virtual void DoPrepare() override;
+	virtual bool DoApply(kv_store_type& store,
+	                     const key_type& key_prefix) const override
+		{ return false; }
+	virtual bool
+	DoChangedKeys(std::vector<const key_type*>* keys) const override
+		{ return true; }
+
+	std::vector<std::pair<key_type, uint64_t>> counts;
+};
+
+// Published topic-wide after the publisher's queue dropped publications of
+// the topic.  Replicas that can't tell a gap in sequence numbers from
+// publications not meant for them learn that some up to the marker's
+// sequence may be lost.
+class DropPublication : public Publication {
+public:
+
+	static const MessageType message_type = MESSAGE_DROP_PUBLICATION;
+
+	// The sequence is the topic's as of the marker.
+	DropPublication(const std::string& topic, uint64_t sequence)
+		: Publication(message_type, topic, sequence) {}
+
+private:
+
+	virtual void DoPrepare() override;
+	virtual bool DoApply(kv_store_type& store,
+	                     const key_type& key_prefix) const override
+		{ return false; }
+	virtual bool
+	DoChangedKeys(std::vector<const key_type*>* keys) const override
+		{ return true; }
 };
 
 // Pushed on to pipeline socket by non-authoritative backend, pulled from
@@ -339,8 +1067,8 @@ private:
 class Update : public Message {
 public:
 
-	Update(const std::string& arg_topic)
-		: topic(arg_topic) {}
+	Update(MessageType type, const std::string& arg_topic)
+		: Message(type), topic(arg_topic) {}
 
 	virtual ~Update() {}
 
@@ -350,6 +1078,17 @@ public:
 	const std::string& Topic() const
 		{ return topic; }
 
+	uint32_t TopicId() const
+		{ return topic_id; }
+
+	void SetTopicId(uint32_t arg_topic_id)
+		{ topic_id = arg_topic_id; }
+
+	// Updates that set a key's whole state name it, so a queue can conflate
+	// them: a later one for the key makes an earlier one redundant.
+	virtual const key_type* OverwrittenKey() const
+		{ return nullptr; }
+
 	static std::unique_ptr<Update> Parse(const char* msg, size_t size);
 
 private:
@@ -357,14 +1096,20 @@ private:
 	virtual bool DoProcess(AuthoritativeFrontend* frontend) const = 0;
 
 	std::string topic;
+	uint32_t topic_id = 0;
 };
 
 class InsertUpdate : public Update {
 public:
 
+	static const MessageType message_type = MESSAGE_INSERT_UPDATE;
+
 	InsertUpdate(const std::string& topic, const key_type& arg_key,
 	             const value_type& arg_val)
-	    : Update(topic), key(arg_key), val(arg_val) {}
+	    : Update(message_type, topic), key(arg_key), val(arg_val) {}
+
+	virtual const key_type* OverwrittenKey() const override
+		{ return &key; }
 
 private:
 
@@ -380,8 +1125,13 @@ private:
 class RemoveUpdate : public Update {
 public:
 
+	static const MessageType message_type = MESSAGE_REMOVE_UPDATE;
+
 	RemoveUpdate(const std::string& topic, const key_type& arg_key)
-	    : Update(topic), key(arg_key) {}
+	    : Update(message_type, topic), key(arg_key) {}
+
+	virtual const key_type* OverwrittenKey() const override
+		{ return &key; }
 
 private:
 
@@ -396,9 +1146,11 @@ private:
 class IncrementUpdate : public Update {
 public:
 
+	static const MessageType message_type = MESSAGE_INCREMENT_UPDATE;
+
 	IncrementUpdate(const std::string& topic, const key_type& arg_key,
 	                const value_type& arg_by)
-	    : Update(topic), key(arg_key), by(arg_by) {}
+	    : Update(message_type, topic), key(arg_key), by(arg_by) {}
 
 private:
 
@@ -414,9 +1166,11 @@ private:
 class DecrementUpdate : public Update {
 public:
 
+	static const MessageType message_type = MESSAGE_DECREMENT_UPDATE;
+
 	DecrementUpdate(const std::string& topic, const key_type& arg_key,
 	                const value_type& arg_by)
-		: Update(topic), key(arg_key), by(arg_by) {}
+		: Update(message_type, topic), key(arg_key), by(arg_by) {}
 
 private:
 
@@ -429,11 +1183,80 @@ private:
 	value_type by;
 };
 
+class AtomicUpdate : public Update {
+public:
+
+	static const MessageType message_type = MESSAGE_ATOMIC_UPDATE;
+
+	AtomicUpdate(const std::string& topic, AtomicOp arg_op,
+	             const key_type& arg_key, const value_type& arg_operand,
+	             const value_type& arg_expected)
+		: Update(message_type, topic), op(arg_op), key(arg_key),
+		  operand(arg_operand), expected(arg_expected) {}
+
+private:
+
+	virtual void DoPrepare() override;
+
+	virtual bool DoProcess(AuthoritativeFrontend* frontend) const override
+		{ return frontend->Atomic(op, key, operand, expected); }
+
+	AtomicOp op;
+	key_type key;
+	value_type operand;
+	value_type expected;
+};
+
+class BatchUpdate : public Update {
+public:
+
+	static const MessageType message_type = MESSAGE_BATCH_UPDATE;
+
+	BatchUpdate(const std::string& topic, const WriteBatch& arg_batch)
+		: Update(message_type, topic), batch(arg_batch) {}
+
+	BatchUpdate(const std::string& topic, WriteBatch&& arg_batch)
+		: Update(message_type, topic), batch(std::move(arg_batch)) {}
+
+private:
+
+	virtual void DoPrepare() override;
+
+	virtual bool DoProcess(AuthoritativeFrontend* frontend) const override
+		{ return frontend->Write(batch); }
+
+	WriteBatch batch;
+};
+
+// A node's PN-counter states for the keys it counted since its last flush.
+class CounterUpdate : public Update {
+public:
+
+	static const MessageType message_type = MESSAGE_COUNTER_UPDATE;
+
+	CounterUpdate(const std::string& topic, const std::string& arg_node,
+	              pn_counter_list&& arg_states)
+		: Update(message_type, topic), node(arg_node),
+		  states(std::move(arg_states)) {}
+
+private:
+
+	virtual void DoPrepare() override;
+
+	virtual bool DoProcess(AuthoritativeFrontend* frontend) const override
+		{ return frontend->MergeCounters(node, states); }
+
+	std::string node;
+	pn_counter_list states;
+};
+
 class ClearUpdate : public Update {
 public:
 
+	static const MessageType message_type = MESSAGE_CLEAR_UPDATE;
+
 	ClearUpdate(const std::string& topic)
-		: Update(topic) {}
+		: Update(message_type, topic) {}
 
 private:
 
@@ -0,0 +1,263 @@
+#include "metrics.hpp"
+#include "util.hpp"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+using namespace nnc;
+
+static const char* counter_names[NUM_METRICS_COUNTERS] = {
+	"requests_parsed",
+	"requests_invalid",
+	"responses_parsed",
+	"responses_invalid",
+	"updates_parsed",
+	"updates_invalid",
+	"publications_parsed",
+	"publications_invalid",
+	"bytes_received",
+	"bytes_sent",
+	"updates_applied",
+	"updates_rejected",
+	"publications_created",
+	"publications_applied",
+	"publications_duplicate",
+	"snapshots_served",
+	"snapshot_cache_hits",
+	"snapshots_applied",
+	"resyncs",
+	"request_timeouts",
+	"publication_queue_rejects",
+	"publication_queue_drops",
+	"publication_queue_blocks",
+	"update_queue_rejects",
+	"update_queue_drops",
+	"update_queue_conflations",
+	"update_queue_blocks",
+	"request_queue_rejects",
+	"request_queue_blocks",
+	"replica_reads",
+	"replica_reads_rejected",
+	"frames_relayed",
+	"relay_drops",
+	"partial_hits",
+	"partial_misses",
+	"partial_evictions",
+	"prefix_gaps",
+};
+
+static const char* gauge_names[NUM_METRICS_GAUGES] = {
+	"publications_queued",
+	"updates_queued",
+	"requests_queued",
+	"publications_queued_bytes",
+	"updates_queued_bytes",
+	"requests_queued_bytes",
+};
+
+static const char* histogram_names[NUM_METRICS_HISTOGRAMS] = {
+	"process_io_ns",
+	"snapshot_bytes",
+	"snapshot_encode_ns",
+};
+
+const char* nnc::metrics_name(MetricsCounter c)
+	{
+	return counter_names[c];
+	}
+
+const char* nnc::metrics_name(MetricsGauge g)
+	{
+	return gauge_names[g];
+	}
+
+const char* nnc::metrics_name(MetricsHistogram h)
+	{
+	return histogram_names[h];
+	}
+
+uint64_t nnc::MetricsSnapshot::Histogram::Percentile(double percentile) const
+	{
+	if ( count == 0 )
+		return 0;
+
+	double p = min(max(percentile, 0.0), 100.0);
+	uint64_t rank = max<uint64_t>(ceil(p / 100 * count), 1);
+	uint64_t seen = 0;
+
+	for ( int i = 0; i < num_buckets; ++i )
+		{
+		seen += buckets[i];
+
+		if ( seen >= rank )
+			return i == 0 ? 0 : i == 64 ? UINT64_MAX : (uint64_t(1) << i) - 1;
+		}
+
+	return UINT64_MAX;
+	}
+
+void nnc::MetricsSnapshot::Print(FILE* f) const
+	{
+	for ( int i = 0; i < NUM_METRICS_COUNTERS; ++i )
+		fprintf(f, "nanoclone_%s %" PRIi64 "\n", counter_names[i], counters[i]);
+
+	for ( int i = 0; i < NUM_METRICS_GAUGES; ++i )
+		fprintf(f, "nanoclone_%s %" PRIi64 "\n", gauge_names[i], gauges[i]);
+
+	for ( int i = 0; i < NUM_METRICS_HISTOGRAMS; ++i )
+		{
+		const Histogram& h = histograms[i];
+		const char* n = histogram_names[i];
+		fprintf(f, "nanoclone_%s_count %" PRIu64 "\n", n, h.count);
+		fprintf(f, "nanoclone_%s_sum %" PRIu64 "\n", n, h.sum);
+
+		for ( double p : {50.0, 90.0, 99.0} )
+			fprintf(f, "nanoclone_%s_p%g %" PRIu64 "\n", n, p,
+			        h.Percentile(p));
+		}
+
+	fprintf(f, "nanoclone_interval_seconds %.3f\n", interval);
+	}
+
+namespace nnc {
+
+// Folds a thread's shard into the retired totals when the thread exits.
+struct ShardOwner {
+	~ShardOwner()
+		{ if ( shard ) Metrics::RetireShard(shard); }
+
+	MetricsShard* shard = nullptr;
+};
+
+} // namespace nnc
+
+thread_local MetricsShard* nnc::Metrics::local_shard = nullptr;
+
+static mutex registry_mutex;
+static vector<MetricsShard*> live_shards;
+// Totals of shards of exited threads.
+static MetricsSnapshot retired;
+// Totals as of the last reset, subtracted from later snapshots.
+static MetricsSnapshot baseline;
+static double reset_time = current_time();
+
+nnc::MetricsShard::MetricsShard()
+	{
+	for ( auto& c : counters )
+		c = 0;
+
+	for ( auto& g : gauges )
+		g = 0;
+
+	for ( auto& h : histograms )
+		{
+		for ( auto& b : h.buckets )
+			b = 0;
+
+		h.sum = 0;
+		}
+	}
+
+static void sum(const MetricsShard& shard, MetricsSnapshot* s)
+	{
+	auto relaxed = memory_order_relaxed;
+
+	for ( int i = 0; i < NUM_METRICS_COUNTERS; ++i )
+		s->counters[i] += shard.counters[i].load(relaxed);
+
+	for ( int i = 0; i < NUM_METRICS_GAUGES; ++i )
+		s->gauges[i] += shard.gauges[i].load(relaxed);
+
+	for ( int i = 0; i < NUM_METRICS_HISTOGRAMS; ++i )
+		{
+		MetricsSnapshot::Histogram& h = s->histograms[i];
+
+		for ( int j = 0; j < MetricsSnapshot::Histogram::num_buckets; ++j )
+			{
+			uint64_t n = shard.histograms[i].buckets[j].load(relaxed);
+			h.buckets[j] += n;
+			h.count += n;
+			}
+
+		h.sum += shard.histograms[i].sum.load(relaxed);
+		}
+	}
+
+MetricsShard* nnc::Metrics::NewShard()
+	{
+	static thread_local ShardOwner owner;
+	owner.shard = local_shard = new MetricsShard;
+	lock_guard<mutex> lock(registry_mutex);
+	live_shards.push_back(local_shard);
+	return local_shard;
+	}
+
+void nnc::Metrics::RetireShard(MetricsShard* shard)
+	{
+	lock_guard<mutex> lock(registry_mutex);
+	sum(*shard, &retired);
+	live_shards.erase(find(live_shards.begin(), live_shards.end(), shard));
+	local_shard = nullptr;
+	delete shard;
+	}
+
+// Called with the registry locked.
+static MetricsSnapshot totals()
+	{
+	MetricsSnapshot rval = retired;
+
+	for ( auto shard : live_shards )
+		sum(*shard, &rval);
+
+	return rval;
+	}
+
+static MetricsSnapshot since_baseline(const MetricsSnapshot& t)
+	{
+	MetricsSnapshot rval = t;
+
+	for ( int i = 0; i < NUM_METRICS_COUNTERS; ++i )
+		rval.counters[i] -= baseline.counters[i];
+
+	for ( int i = 0; i < NUM_METRICS_HISTOGRAMS; ++i )
+		{
+		MetricsSnapshot::Histogram& h = rval.histograms[i];
+		const MetricsSnapshot::Histogram& b = baseline.histograms[i];
+
+		for ( int j = 0; j < MetricsSnapshot::Histogram::num_buckets; ++j )
+			h.buckets[j] -= b.buckets[j];
+
+		h.count -= b.count;
+		h.sum -= b.sum;
+		}
+
+	rval.interval = current_time() - reset_time;
+	return rval;
+	}
+
+MetricsSnapshot nnc::Metrics::Snapshot()
+	{
+	lock_guard<mutex> lock(registry_mutex);
+	return since_baseline(totals());
+	}
+
+void nnc::Metrics::Reset()
+	{
+	lock_guard<mutex> lock(registry_mutex);
+	baseline = totals();
+	reset_time = current_time();
+	}
+
+MetricsSnapshot nnc::Metrics::SnapshotAndReset()
+	{
+	lock_guard<mutex> lock(registry_mutex);
+	MetricsSnapshot t = totals();
+	MetricsSnapshot rval = since_baseline(t);
+	baseline = t;
+	reset_time = current_time();
+	return rval;
+	}
@@ -0,0 +1,180 @@
+#ifndef NANOCLONE_METRICS_HPP
+#define NANOCLONE_METRICS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+
+namespace nnc {
+
+enum MetricsCounter {
+	METRIC_REQUESTS_PARSED,
+	METRIC_REQUESTS_INVALID,
+	METRIC_RESPONSES_PARSED,
+	METRIC_RESPONSES_INVALID,
+	METRIC_UPDATES_PARSED,
+	METRIC_UPDATES_INVALID,
+	METRIC_PUBLICATIONS_PARSED,
+	METRIC_PUBLICATIONS_INVALID,
+	METRIC_BYTES_RECEIVED,
+	METRIC_BYTES_SENT,
+	METRIC_UPDATES_APPLIED,      // Updates that changed an authoritative store.
+	METRIC_UPDATES_REJECTED,     // Updates that didn't, e.g. missing keys.
+	METRIC_PUBLICATIONS_CREATED,
+	METRIC_PUBLICATIONS_APPLIED,
+	METRIC_PUBLICATIONS_DUPLICATE,
+	METRIC_SNAPSHOTS_SERVED,
+	METRIC_SNAPSHOT_CACHE_HITS,
+	METRIC_SNAPSHOTS_APPLIED,
+	METRIC_RESYNCS,
+	METRIC_REQUEST_TIMEOUTS,
+	// What queue limits did to the messages that didn't fit.
+	METRIC_PUBLICATION_QUEUE_REJECTS,
+	METRIC_PUBLICATION_QUEUE_DROPS,
+	METRIC_PUBLICATION_QUEUE_BLOCKS,
+	METRIC_UPDATE_QUEUE_REJECTS,
+	METRIC_UPDATE_QUEUE_DROPS,
+	METRIC_UPDATE_QUEUE_CONFLATIONS,
+	METRIC_UPDATE_QUEUE_BLOCKS,
+	METRIC_REQUEST_QUEUE_REJECTS,
+	METRIC_REQUEST_QUEUE_BLOCKS,
+	METRIC_REPLICA_READS,          // Requests a read replica answered.
+	METRIC_REPLICA_READS_REJECTED, // Those it couldn't, e.g. writes.
+	METRIC_FRAMES_RELAYED,
+	METRIC_RELAY_DROPS,
+	METRIC_PARTIAL_HITS,           // Partial replica lookups held locally.
+	METRIC_PARTIAL_MISSES,         // Those that fetched from the server.
+	METRIC_PARTIAL_EVICTIONS,
+	METRIC_PREFIX_GAPS,            // Missed publications heartbeats showed.
+	NUM_METRICS_COUNTERS
+};
+
+// Gauges go up and down, like queue depths, so Reset() leaves them alone.
+enum MetricsGauge {
+	GAUGE_PUBLICATIONS_QUEUED,
+	GAUGE_UPDATES_QUEUED,
+	GAUGE_REQUESTS_QUEUED,
+	GAUGE_PUBLICATIONS_QUEUED_BYTES,
+	GAUGE_UPDATES_QUEUED_BYTES,
+	GAUGE_REQUESTS_QUEUED_BYTES,
+	NUM_METRICS_GAUGES
+};
+
+enum MetricsHistogram {
+	HIST_PROCESS_IO_NS,
+	HIST_SNAPSHOT_BYTES,
+	HIST_SNAPSHOT_ENCODE_NS,
+	NUM_METRICS_HISTOGRAMS
+};
+
+const char* metrics_name(MetricsCounter c);
+const char* metrics_name(MetricsGauge g);
+const char* metrics_name(MetricsHistogram h);
+
+struct MetricsSnapshot {
+
+	// Bucket i counts values that need i bits, i.e. [2^(i-1), 2^i).
+	struct Histogram {
+		static const int num_buckets = 65;
+
+		// Returns the upper bound of the bucket holding the percentile.
+		uint64_t Percentile(double percentile) const;
+
+		uint64_t count = 0;
+		uint64_t sum = 0;
+		uint64_t buckets[num_buckets] = {};
+	};
+
+	// Writes one "nanoclone_<name> <value>" line per metric, with a count,
+	// sum and some percentiles for histograms.
+	void Print(FILE* f) const;
+
+	int64_t counters[NUM_METRICS_COUNTERS] = {};
+	int64_t gauges[NUM_METRICS_GAUGES] = {};
+	Histogram histograms[NUM_METRICS_HISTOGRAMS];
+	// Seconds since the counters and histograms were last reset.
+	double interval = 0;
+};
+
+// One thread's metrics.  Only the owning thread writes to it.
+struct MetricsShard {
+	struct Histogram {
+		std::atomic<int64_t> buckets[MetricsSnapshot::Histogram::num_buckets];
+		std::atomic<int64_t> sum;
+	};
+
+	MetricsShard();
+
+	std::atomic<int64_t> counters[NUM_METRICS_COUNTERS];
+	std::atomic<int64_t> gauges[NUM_METRICS_GAUGES];
+	Histogram histograms[NUM_METRICS_HISTOGRAMS];
+};
+
+// Process-wide metrics.  Each thread updates its own shard without locking
+// or contended atomics; snapshots sum up the shards.
+class Metrics {
+public:
+
+	static void Add(MetricsCounter c, int64_t n = 1)
+		{ Bump(&LocalShard()->counters[c], n); }
+
+	static void AddGauge(MetricsGauge g, int64_t n)
+		{ Bump(&LocalShard()->gauges[g], n); }
+
+	static void Record(MetricsHistogram h, uint64_t value)
+		{
+		MetricsShard::Histogram& sh = LocalShard()->histograms[h];
+		Bump(&sh.buckets[value ? 64 - __builtin_clzll(value) : 0], 1);
+		Bump(&sh.sum, value);
+		}
+
+	static MetricsSnapshot Snapshot();
+
+	// Counters and histograms start over from zero.
+	static void Reset();
+
+	static MetricsSnapshot SnapshotAndReset();
+
+private:
+
+	friend struct ShardOwner;
+
+	// No read-modify-write is needed with a single writer; the atomics just
+	// keep concurrent snapshots from tearing.
+	static void Bump(std::atomic<int64_t>* a, int64_t n)
+		{ a->store(a->load(std::memory_order_relaxed) + n,
+		           std::memory_order_relaxed); }
+
+	static MetricsShard* LocalShard()
+		{ return local_shard ? local_shard : NewShard(); }
+
+	static MetricsShard* NewShard();
+	static void RetireShard(MetricsShard* shard);
+
+	static thread_local MetricsShard* local_shard;
+};
+
+// Records the time until it's destroyed, in nanoseconds.
+class MetricsTimer {
+public:
+
+	MetricsTimer(MetricsHistogram arg_histogram)
+		: histogram(arg_histogram), start(std::chrono::steady_clock::now()) {}
+
+	~MetricsTimer()
+		{
+		auto d = std::chrono::steady_clock::now() - start;
+		Metrics::Record(histogram, std::chrono::duration_cast<
+		                std::chrono::nanoseconds>(d).count());
+		}
+
+private:
+
+	MetricsHistogram histogram;
+	std::chrono::steady_clock::time_point start;
+};
+
+} // namespace nnc
+
+#endif // NANOCLONE_METRICS_HPP
@@ -0,0 +1,129 @@
+#include "pool.hpp"
+
+#include <new>
+#include <vector>
+
+using namespace std;
+using namespace nnc;
+
+static const size_t size_class = 16;
+static const size_t num_size_classes = 32;
+// Per size class and thread.
+static const size_t max_pooled_bytes = 256 * 1024;
+static const size_t max_pooled_strings = 256;
+// Strings that grew larger, e.g. for snapshots, aren't worth holding on to.
+static const size_t max_pooled_capacity = 64 * 1024;
+
+namespace {
+
+struct FreeBlock {
+	FreeBlock* next;
+};
+
+struct Pools {
+	Pools()
+		{ strings.reserve(max_pooled_strings); }
+
+	~Pools();
+
+	FreeBlock* blocks[num_size_classes] = {};
+	size_t bytes[num_size_classes] = {};
+	vector<string*> strings;
+};
+
+} // namespace
+
+// Set once the thread's pools are destroyed, after which blocks freed by
+// other thread-local destructors go straight back to the heap.
+static thread_local bool pools_destroyed = false;
+
+Pools::~Pools()
+	{
+	pools_destroyed = true;
+
+	for ( auto b : blocks )
+		while ( b )
+			{
+			FreeBlock* next = b->next;
+			::operator delete(b);
+			b = next;
+			}
+
+	for ( auto s : strings )
+		delete s;
+	}
+
+static Pools* local_pools()
+	{
+	if ( pools_destroyed )
+		return nullptr;
+
+	static thread_local Pools pools;
+	return &pools;
+	}
+
+void* nnc::pool_allocate(size_t size)
+	{
+	size_t c = size ? (size - 1) / size_class : 0;
+
+	if ( c >= num_size_classes )
+		return ::operator new(size);
+
+	Pools* p = local_pools();
+	FreeBlock* b = p ? p->blocks[c] : nullptr;
+
+	if ( ! b )
+		return ::operator new((c + 1) * size_class);
+
+	p->blocks[c] = b->next;
+	p->bytes[c] -= (c + 1) * size_class;
+	return b;
+	}
+
+void nnc::pool_free(void* ptr, size_t size)
+	{
+	size_t c = size ? (size - 1) / size_class : 0;
+	Pools* p = c < num_size_classes ? local_pools() : nullptr;
+
+	if ( ! p || p->bytes[c] >= max_pooled_bytes )
+		{
+		::operator delete(ptr);
+		return;
+		}
+
+	FreeBlock* b = static_cast<FreeBlock*>(ptr);
+	b->next = p->blocks[c];
+	p->blocks[c] = b;
+	p->bytes[c] += (c + 1) * size_class;
+	}
+
+static void recycle_string(string* s)
+	{
+	Pools* p = local_pools();
+
+	if ( ! p || p->strings.size() >= max_pooled_strings ||
+	     s->capacity() > max_pooled_capacity )
+		{
+		delete s;
+		return;
+		}
+
+	s->clear();
+	p->strings.push_back(s);
+	}
+
+shared_ptr<string> nnc::pooled_string()
+	{
+	Pools* p = local_pools();
+	string* s;
+
+	if ( p && ! p->strings.empty() )
+		{
+		s = p->strings.back();
+		p->strings.pop_back();
+		}
+	else
+		s = new string;
+
+	return shared_ptr<string>(s, recycle_string, PoolAllocator<string>());
+	}
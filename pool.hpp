@@ -0,0 +1,60 @@
+#ifndef NANOCLONE_POOL_HPP
+#define NANOCLONE_POOL_HPP
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+namespace nnc {
+
+// Thread-local free lists of small blocks, one per 16-byte size class, so
+// that objects made and dropped at a steady rate (messages, the control
+// blocks of shared pointers to them, queue nodes) reuse memory rather than
+// going through malloc.  A block freed on another thread joins that thread's
+// lists.  Each list holds a bounded amount; larger blocks come straight from
+// the heap.
+void* pool_allocate(size_t size);
+
+// The size must be the one the block was allocated with.
+void pool_free(void* p, size_t size);
+
+// An empty string that goes back to a thread-local free list, keeping its
+// capacity, when the last reference is dropped.  Messages encode into these.
+std::shared_ptr<std::string> pooled_string();
+
+template<class T>
+class PoolAllocator {
+public:
+
+	using value_type = T;
+
+	PoolAllocator() = default;
+
+	template<class U>
+	PoolAllocator(const PoolAllocator<U>&) {}
+
+	T* allocate(size_t n)
+		{ return static_cast<T*>(pool_allocate(n * sizeof(T))); }
+
+	void deallocate(T* p, size_t n)
+		{ pool_free(p, n * sizeof(T)); }
+};
+
+template<class T, class U>
+bool operator==(const PoolAllocator<T>&, const PoolAllocator<U>&)
+	{ return true; }
+
+template<class T, class U>
+bool operator!=(const PoolAllocator<T>&, const PoolAllocator<U>&)
+	{ return false; }
+
+template<class T, class... Args>
+std::shared_ptr<T> make_pooled(Args&&... args)
+	{
+	return std::allocate_shared<T>(PoolAllocator<T>(),
+	                               std::forward<Args>(args)...);
+	}
+
+} // namespace nnc
+
+#endif // NANOCLONE_POOL_HPP
@@ -1,7 +1,10 @@
 #include "server.hpp"
 #include "frontend.hpp"
 #include "backend.hpp"
+#include "util.hpp"
 
+#include <cerrno>
+#include <csignal>
 #include <sstream>
 #include <vector>
 #include <string>
@@ -22,10 +25,13 @@ static vector<string> get_addrs(unsigned long sp)
 	return {get_addr(sp), get_addr(sp + 1), get_addr(sp + 2)};
 	}
 
-int run_server(unsigned long start_port, const string& name)
+int run_server(unsigned long start_port, const string& name,
+               const ExportOptions& export_options)
 	{
 	AuthoritativeFrontend frontend("example0");
 	AuthoritativeBackend backend;
+	StoreExporter exporter(frontend, export_options);
+	StoreExporter::TriggerOnSignal(SIGUSR1);
 	vector<string> addrs = get_addrs(start_port);
 	frontend.AddBackend(&backend);
 	int64_t io_count = 0;
@@ -57,9 +63,20 @@ int run_server(unsigned long start_port, const string& name)
 			return 1;
 			}
 
+		double deadline;
+
+		if ( exporter.NextDeadline(&deadline) )
+			{
+			timeval tv = to_timeval(deadline - current_time());
+
+			if ( ! to || timercmp(&tv, to.get(), <) )
+				to.reset(new timeval(tv));
+			}
+
 		int num_ready = select(nfds, &rfds, &wfds, nullptr, to.get());
 
-		if ( num_ready < 0 )
+		// Export signals interrupt select().
+		if ( num_ready < 0 && errno != EINTR )
 			{
 			printf("Error in select()\n");
 			return 1;
@@ -71,7 +88,7 @@ int run_server(unsigned long start_port, const string& name)
 		if ( io_count % io_count_throttle == 0 )
 			frontend.Increment(io_count_key, io_count_throttle);
 
-		frontend.DumpDebug(stdout);
+		exporter.ProcessTimers();
 		}
 
 	return 0;
@@ -1,3 +1,6 @@
+#include "store_export.hpp"
+
 #include <string>
 
-int run_server(unsigned long starting_port, const std::string& name);
+int run_server(unsigned long starting_port, const std::string& name,
+               const nnc::ExportOptions& export_options);
@@ -0,0 +1,610 @@
+#include "shared_replica.hpp"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <new>
+#include <utility>
+#include <vector>
+
+using namespace std;
+using namespace nnc;
+
+static const uint64_t segment_magic = 0x6e616e6f636c6e31; // "nanocln1"
+static const uint32_t segment_version = 1;
+
+struct SegmentHeader {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t max_key_size;
+	uint64_t max_keys;
+	// A power of two, at least twice max_keys.
+	uint64_t num_slots;
+	uint64_t slot_size;
+	std::atomic<uint32_t> closed;
+	// Odd while the writer is changing anything below or in the slots.
+	alignas(64) std::atomic<uint64_t> seq;
+	uint64_t size;
+	uint64_t tombstones;
+	uint64_t sequence;
+	uint32_t synchronized;
+	uint32_t complete;
+};
+
+// Followed by max_key_size bytes for the key.
+struct Slot {
+	// 0 if empty, 1 for a tombstone, or else the key's hash.
+	uint64_t hash;
+	value_type val;
+	uint64_t key_size;
+};
+
+static const size_t header_size = (sizeof(SegmentHeader) + 63) & ~size_t(63);
+
+// Fields that readers may see change underneath them are accessed as relaxed
+// atomics; the seqlock tells whether what was read is consistent.
+template <class T>
+static T load(const T* p)
+	{
+	return __atomic_load_n(p, __ATOMIC_RELAXED);
+	}
+
+template <class T>
+static void store(T* p, T val)
+	{
+	__atomic_store_n(p, val, __ATOMIC_RELAXED);
+	}
+
+// FNV-1a, as std::hash may differ between the processes' builds.
+static uint64_t hash_key(const key_type& key)
+	{
+	uint64_t rval = 0xcbf29ce484222325;
+
+	for ( unsigned char c : key )
+		rval = (rval ^ c) * 0x100000001b3;
+
+	return rval < 2 ? rval + 2 : rval;
+	}
+
+static SegmentHeader* header(char* base)
+	{
+	return reinterpret_cast<SegmentHeader*>(base);
+	}
+
+static const SegmentHeader* header(const char* base)
+	{
+	return reinterpret_cast<const SegmentHeader*>(base);
+	}
+
+static char* slot_at(char* base, uint64_t i)
+	{
+	return base + header_size + i * header(base)->slot_size;
+	}
+
+static const char* slot_at(const char* base, uint64_t i)
+	{
+	return base + header_size + i * header(base)->slot_size;
+	}
+
+// Runs 'f' until it ran without overlapping a change by the writer.  Gives
+// up if the writer seems stuck in a change for a second.
+template <class F>
+static bool seqlock_read(const SegmentHeader* h, F f)
+	{
+	auto start = chrono::steady_clock::now();
+
+	for ( unsigned int attempts = 1; ; ++attempts )
+		{
+		uint64_t s = h->seq.load(memory_order_acquire);
+
+		if ( s & 1 )
+			{
+			if ( attempts > 64 )
+				sched_yield();
+			}
+		else
+			{
+			f();
+			atomic_thread_fence(memory_order_acquire);
+
+			if ( h->seq.load(memory_order_relaxed) == s )
+				return true;
+			}
+
+		if ( attempts % 1024 == 0 &&
+		     chrono::steady_clock::now() - start > chrono::seconds(1) )
+			return false;
+		}
+	}
+
+// Lets readers of a segment left behind, e.g. by a crashed writer, know
+// that it's being replaced.
+static void close_existing(const string& name)
+	{
+	int fd = shm_open(name.c_str(), O_RDWR, 0);
+
+	if ( fd < 0 )
+		return;
+
+	struct stat st;
+
+	if ( fstat(fd, &st) == 0 && size_t(st.st_size) >= header_size )
+		{
+		void* p = mmap(nullptr, header_size, PROT_READ | PROT_WRITE,
+		               MAP_SHARED, fd, 0);
+
+		if ( p != MAP_FAILED )
+			{
+			SegmentHeader* h = header(static_cast<char*>(p));
+
+			if ( h->magic == segment_magic )
+				h->closed.store(1, memory_order_release);
+
+			munmap(p, header_size);
+			}
+		}
+
+	close(fd);
+	}
+
+bool nnc::SharedMemoryReplica::Create(const string& arg_name, size_t max_keys,
+                                      size_t max_key_size)
+	{
+	if ( base || max_keys == 0 || max_key_size > UINT32_MAX )
+		return false;
+
+	uint64_t num_slots = 8;
+
+	while ( num_slots < max_keys * 2 )
+		num_slots *= 2;
+
+	uint64_t slot_size = (sizeof(Slot) + max_key_size + 7) & ~uint64_t(7);
+	size_t len = header_size + num_slots * slot_size;
+
+	close_existing(arg_name);
+	shm_unlink(arg_name.c_str());
+	int fd = shm_open(arg_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+
+	if ( fd < 0 )
+		return false;
+
+	// The segment starts out zeroed, so all slots are empty.
+	if ( ftruncate(fd, len) != 0 )
+		{
+		close(fd);
+		shm_unlink(arg_name.c_str());
+		return false;
+		}
+
+	void* p = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if ( p == MAP_FAILED )
+		{
+		shm_unlink(arg_name.c_str());
+		return false;
+		}
+
+	SegmentHeader* h = new (p) SegmentHeader;
+	h->version = segment_version;
+	h->max_key_size = max_key_size;
+	h->max_keys = max_keys;
+	h->num_slots = num_slots;
+	h->slot_size = slot_size;
+	h->closed.store(0, memory_order_relaxed);
+	h->seq.store(0, memory_order_relaxed);
+	h->size = h->tombstones = h->sequence = 0;
+	h->synchronized = 0;
+	h->complete = 1;
+	// Readers don't take the segment before it's set up.
+	__atomic_store_n(&h->magic, segment_magic, __ATOMIC_RELEASE);
+
+	name = arg_name;
+	base = static_cast<char*>(p);
+	length = len;
+	write_depth = 0;
+	overflow.clear();
+	return true;
+	}
+
+bool nnc::SharedMemoryReplica::Close()
+	{
+	if ( ! base )
+		return true;
+
+	header(base)->closed.store(1, memory_order_release);
+	munmap(base, length);
+	shm_unlink(name.c_str());
+	base = nullptr;
+	length = 0;
+	return true;
+	}
+
+void nnc::SharedMemoryReplica::BeginWrite()
+	{
+	if ( ! base || write_depth++ > 0 )
+		return;
+
+	SegmentHeader* h = header(base);
+	h->seq.store(h->seq.load(memory_order_relaxed) + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	}
+
+void nnc::SharedMemoryReplica::EndWrite()
+	{
+	if ( ! base || --write_depth > 0 )
+		return;
+
+	SegmentHeader* h = header(base);
+	h->seq.store(h->seq.load(memory_order_relaxed) + 1, memory_order_release);
+	}
+
+char* nnc::SharedMemoryReplica::FindSlot(const key_type& key, uint64_t hash,
+                                         bool* found) const
+	{
+	const SegmentHeader* h = header(base);
+	uint64_t mask = h->num_slots - 1;
+	char* tombstone = nullptr;
+
+	for ( uint64_t i = 0; i < h->num_slots; ++i )
+		{
+		char* s = slot_at(base, (hash + i) & mask);
+		const Slot* slot = reinterpret_cast<const Slot*>(s);
+
+		if ( slot->hash == 0 )
+			{
+			*found = false;
+			return tombstone ? tombstone : s;
+			}
+
+		if ( slot->hash == 1 )
+			{
+			if ( ! tombstone )
+				tombstone = s;
+
+			continue;
+			}
+
+		if ( slot->hash == hash && slot->key_size == key.size() &&
+		     memcmp(s + sizeof(Slot), key.data(), key.size()) == 0 )
+			{
+			*found = true;
+			return s;
+			}
+		}
+
+	*found = false;
+	return tombstone;
+	}
+
+void nnc::SharedMemoryReplica::Fill(char* s, const key_type& key,
+                                    uint64_t hash, const value_type& val)
+	{
+	SegmentHeader* h = header(base);
+	Slot* slot = reinterpret_cast<Slot*>(s);
+
+	if ( slot->hash == 1 )
+		store(&h->tombstones, h->tombstones - 1);
+
+	memcpy(s + sizeof(Slot), key.data(), key.size());
+	store(&slot->key_size, uint64_t(key.size()));
+	store(&slot->val, val);
+	store(&slot->hash, hash);
+	store(&h->size, h->size + 1);
+	}
+
+void nnc::SharedMemoryReplica::Rehash()
+	{
+	SegmentHeader* h = header(base);
+	vector<pair<key_type, value_type>> live;
+	live.reserve(h->size);
+
+	for ( uint64_t i = 0; i < h->num_slots; ++i )
+		{
+		char* s = slot_at(base, i);
+		Slot* slot = reinterpret_cast<Slot*>(s);
+
+		if ( slot->hash > 1 )
+			live.emplace_back(key_type(s + sizeof(Slot), slot->key_size),
+			                  slot->val);
+
+		store(&slot->hash, uint64_t(0));
+		}
+
+	store(&h->size, uint64_t(0));
+	store(&h->tombstones, uint64_t(0));
+
+	for ( const auto& kv : live )
+		{
+		uint64_t hash = hash_key(kv.first);
+		bool found;
+		Fill(FindSlot(kv.first, hash, &found), kv.first, hash, kv.second);
+		}
+	}
+
+void nnc::SharedMemoryReplica::UpdateComplete()
+	{
+	BeginWrite();
+	store(&header(base)->complete, uint32_t(overflow.empty()));
+	EndWrite();
+	}
+
+bool nnc::SharedMemoryReplica::Set(const key_type& key, const value_type& val)
+	{
+	if ( ! base )
+		return false;
+
+	SegmentHeader* h = header(base);
+
+	if ( key.size() > h->max_key_size )
+		{
+		overflow.insert(key);
+		UpdateComplete();
+		return false;
+		}
+
+	uint64_t hash = hash_key(key);
+	bool found;
+	char* s = FindSlot(key, hash, &found);
+	BeginWrite();
+
+	if ( found )
+		store(&reinterpret_cast<Slot*>(s)->val, val);
+	else if ( h->size == h->max_keys )
+		{
+		overflow.insert(key);
+		UpdateComplete();
+		EndWrite();
+		return false;
+		}
+	else
+		{
+		// Keep probe sequences short: some slots always stay empty.
+		if ( (h->size + h->tombstones + 1) * 4 > h->num_slots * 3 )
+			{
+			Rehash();
+			s = FindSlot(key, hash, &found);
+			}
+
+		Fill(s, key, hash, val);
+
+		if ( ! overflow.empty() && overflow.erase(key) )
+			UpdateComplete();
+		}
+
+	EndWrite();
+	return true;
+	}
+
+bool nnc::SharedMemoryReplica::Erase(const key_type& key)
+	{
+	if ( ! base )
+		return false;
+
+	if ( ! overflow.empty() && overflow.erase(key) )
+		{
+		UpdateComplete();
+		return true;
+		}
+
+	SegmentHeader* h = header(base);
+
+	if ( key.size() > h->max_key_size )
+		return false;
+
+	bool found;
+	char* s = FindSlot(key, hash_key(key), &found);
+
+	if ( ! found )
+		return false;
+
+	BeginWrite();
+	store(&reinterpret_cast<Slot*>(s)->hash, uint64_t(1));
+	store(&h->size, h->size - 1);
+	store(&h->tombstones, h->tombstones + 1);
+	EndWrite();
+	return true;
+	}
+
+void nnc::SharedMemoryReplica::Assign(const kv_store_type& kv_store,
+                                      uint64_t sequence, bool synchronized)
+	{
+	if ( ! base )
+		return;
+
+	SegmentHeader* h = header(base);
+	BeginWrite();
+
+	for ( uint64_t i = 0; i < h->num_slots; ++i )
+		store(&reinterpret_cast<Slot*>(slot_at(base, i))->hash, uint64_t(0));
+
+	store(&h->size, uint64_t(0));
+	store(&h->tombstones, uint64_t(0));
+	overflow.clear();
+
+	for ( const auto& kv : kv_store )
+		{
+		if ( kv.first.size() > h->max_key_size || h->size == h->max_keys )
+			{
+			overflow.insert(kv.first);
+			continue;
+			}
+
+		uint64_t hash = hash_key(kv.first);
+		bool found;
+		Fill(FindSlot(kv.first, hash, &found), kv.first, hash, kv.second);
+		}
+
+	store(&h->sequence, sequence);
+	store(&h->synchronized, uint32_t(synchronized));
+	store(&h->complete, uint32_t(overflow.empty()));
+	EndWrite();
+	}
+
+void nnc::SharedMemoryReplica::SetSequence(uint64_t sequence)
+	{
+	if ( ! base )
+		return;
+
+	BeginWrite();
+	store(&header(base)->sequence, sequence);
+	EndWrite();
+	}
+
+void nnc::SharedMemoryReplica::SetSynchronized(bool synchronized)
+	{
+	if ( ! base )
+		return;
+
+	BeginWrite();
+	store(&header(base)->synchronized, uint32_t(synchronized));
+	EndWrite();
+	}
+
+bool nnc::SharedMemoryReader::Open(const string& name)
+	{
+	if ( base )
+		return false;
+
+	int fd = shm_open(name.c_str(), O_RDONLY, 0);
+
+	if ( fd < 0 )
+		return false;
+
+	struct stat st;
+
+	if ( fstat(fd, &st) != 0 || size_t(st.st_size) < header_size )
+		{
+		close(fd);
+		return false;
+		}
+
+	size_t len = st.st_size;
+	void* p = mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if ( p == MAP_FAILED )
+		return false;
+
+	const SegmentHeader* h = header(static_cast<const char*>(p));
+
+	if ( __atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != segment_magic ||
+	     h->version != segment_version ||
+	     header_size + h->num_slots * h->slot_size != len )
+		{
+		munmap(p, len);
+		return false;
+		}
+
+	base = static_cast<const char*>(p);
+	length = len;
+	return true;
+	}
+
+bool nnc::SharedMemoryReader::Close()
+	{
+	if ( ! base )
+		return true;
+
+	munmap(const_cast<char*>(base), length);
+	base = nullptr;
+	length = 0;
+	return true;
+	}
+
+bool nnc::SharedMemoryReader::Valid() const
+	{
+	return base && ! header(base)->closed.load(memory_order_acquire);
+	}
+
+bool nnc::SharedMemoryReader::LookupSync(const key_type& key,
+                                         value_type* val) const
+	{
+	if ( ! base )
+		return false;
+
+	const SegmentHeader* h = header(base);
+
+	if ( key.size() > h->max_key_size )
+		return false;
+
+	uint64_t hash = hash_key(key);
+	uint64_t mask = h->num_slots - 1;
+	bool found;
+	value_type v;
+
+	auto probe = [&]()
+		{
+		found = false;
+
+		// Bounded, as a torn read may not come across an empty slot.
+		for ( uint64_t i = 0; i < h->num_slots; ++i )
+			{
+			const char* s = slot_at(base, (hash + i) & mask);
+			const Slot* slot = reinterpret_cast<const Slot*>(s);
+			uint64_t slot_hash = load(&slot->hash);
+
+			if ( slot_hash == 0 )
+				return;
+
+			if ( slot_hash == hash && load(&slot->key_size) == key.size() &&
+			     memcmp(s + sizeof(Slot), key.data(), key.size()) == 0 )
+				{
+				v = load(&slot->val);
+				found = true;
+				return;
+				}
+			}
+		};
+
+	if ( ! seqlock_read(h, probe) || ! found )
+		return false;
+
+	if ( val )
+		*val = v;
+
+	return true;
+	}
+
+size_t nnc::SharedMemoryReader::SizeSync() const
+	{
+	if ( ! base )
+		return 0;
+
+	const SegmentHeader* h = header(base);
+	uint64_t rval = 0;
+	seqlock_read(h, [&]() { rval = load(&h->size); });
+	return rval;
+	}
+
+uint64_t nnc::SharedMemoryReader::Sequence() const
+	{
+	if ( ! base )
+		return 0;
+
+	const SegmentHeader* h = header(base);
+	uint64_t rval = 0;
+	seqlock_read(h, [&]() { rval = load(&h->sequence); });
+	return rval;
+	}
+
+bool nnc::SharedMemoryReader::Synchronized() const
+	{
+	if ( ! Valid() )
+		return false;
+
+	const SegmentHeader* h = header(base);
+	bool rval = false;
+
+	if ( ! seqlock_read(h, [&]()
+	        { rval = load(&h->synchronized) && load(&h->complete); }) )
+		return false;
+
+	return rval;
+	}
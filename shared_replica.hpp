@@ -0,0 +1,116 @@
+#ifndef NANOCLONE_SHARED_REPLICA_HPP
+#define NANOCLONE_SHARED_REPLICA_HPP
+
+#include "type_aliases.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_set>
+
+namespace nnc {
+
+// A replica kept in a POSIX shared memory segment, so that the processes of
+// a host can share one subscriber's copy of a topic instead of each holding
+// and maintaining their own.  The segment is an open-addressing hash table
+// under a seqlock: the single writer bumps a sequence counter around each
+// change, and readers retry whenever it moved while they were reading.
+
+// The writing side, usually fed by a NonAuthoritativeFrontend.
+class SharedMemoryReplica {
+public:
+
+	SharedMemoryReplica() = default;
+
+	~SharedMemoryReplica()
+		{ Close(); }
+
+	// Replaces any segment of the same name.  Keys longer than
+	// max_key_size, or beyond max_keys of them, aren't stored, and the
+	// replica is marked incomplete as long as there are any.
+	bool Create(const std::string& name, size_t max_keys,
+	            size_t max_key_size = 64);
+
+	// Unlinks the segment and marks it closed for readers still mapping it.
+	bool Close();
+
+	bool Created() const
+		{ return base != nullptr; }
+
+	// Changes between the two appear to readers all at once.  May nest.
+	void BeginWrite();
+	void EndWrite();
+
+	bool Set(const key_type& key, const value_type& val);
+
+	bool Erase(const key_type& key);
+
+	// Replaces all contents.
+	void Assign(const kv_store_type& store, uint64_t sequence,
+	            bool synchronized);
+
+	void SetSequence(uint64_t sequence);
+
+	void SetSynchronized(bool synchronized);
+
+private:
+
+	// Returns the slot holding the key, or else the one to insert it at.
+	char* FindSlot(const key_type& key, uint64_t hash, bool* found) const;
+
+	void Fill(char* slot, const key_type& key, uint64_t hash,
+	          const value_type& val);
+
+	// Rebuilds the table without tombstones.
+	void Rehash();
+
+	void UpdateComplete();
+
+	std::string name;
+	char* base = nullptr;
+	size_t length = 0;
+	int write_depth = 0;
+	// Keys that didn't fit.
+	std::unordered_set<key_type> overflow;
+};
+
+// Maps a SharedMemoryReplica read-only.  Reads involve no IPC or locking,
+// just a retry if they raced with the writer.  A writer that dies during a
+// change makes reads fail rather than hang.
+class SharedMemoryReader {
+public:
+
+	SharedMemoryReader() = default;
+
+	~SharedMemoryReader()
+		{ Close(); }
+
+	bool Open(const std::string& name);
+
+	bool Close();
+
+	// False once the writer closed or replaced the segment; reopen to pick
+	// up a new one.
+	bool Valid() const;
+
+	bool LookupSync(const key_type& key, value_type* val) const;
+
+	bool HasKeySync(const key_type& key) const
+		{ return LookupSync(key, nullptr); }
+
+	size_t SizeSync() const;
+
+	uint64_t Sequence() const;
+
+	// Whether the replica holds all of the topic's keys as of Sequence().
+	bool Synchronized() const;
+
+private:
+
+	const char* base = nullptr;
+	size_t length = 0;
+};
+
+} // namespace nnc
+
+#endif // NANOCLONE_SHARED_REPLICA_HPP
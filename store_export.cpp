@@ -0,0 +1,287 @@
+#include "store_export.hpp"
+#include "messages.hpp"
+#include "util.hpp"
+
+#include <algorithm>
+#include <csignal>
+#include <cstdio>
+
+using namespace std;
+using namespace nnc;
+
+// How often a background export is checked on.
+static const double background_poll_interval = 0.1;
+
+static volatile sig_atomic_t trigger_signals = 0;
+
+static void on_trigger_signal(int signo)
+	{
+	trigger_signals = trigger_signals + 1;
+	}
+
+static void put_u32(string* s, uint32_t n)
+	{
+	for ( int i = 0; i < 4; ++i )
+		s->push_back(char(n >> (8 * i)));
+	}
+
+static void put_u64(string* s, uint64_t n)
+	{
+	for ( int i = 0; i < 8; ++i )
+		s->push_back(char(n >> (8 * i)));
+	}
+
+static void put_csv_field(string* s, const string& field)
+	{
+	if ( field.find_first_of(",\"\r\n") == string::npos )
+		{
+		s->append(field);
+		return;
+		}
+
+	s->push_back('"');
+
+	for ( char c : field )
+		{
+		if ( c == '"' )
+			s->push_back('"');
+
+		s->push_back(c);
+		}
+
+	s->push_back('"');
+	}
+
+nnc::StoreExporter::StoreExporter(const Frontend& arg_frontend,
+                                  ExportOptions arg_options)
+	: frontend(arg_frontend), options(move(arg_options)),
+	  last_start(current_time()), signals_seen(trigger_signals),
+	  worker_done(false)
+	{
+	if ( options.chunk_size == 0 )
+		options.chunk_size = 1;
+	}
+
+nnc::StoreExporter::~StoreExporter()
+	{
+	Finish();
+	}
+
+bool nnc::StoreExporter::Trigger()
+	{
+	if ( Active() || options.path.empty() )
+		return false;
+
+	last_start = current_time();
+
+	if ( ! Open() )
+		{
+		++failed;
+		return false;
+		}
+
+	// The copy is what makes the export consistent while the store keeps
+	// changing under the event loop.
+	pairs = frontend.Pairs();
+	sequence = frontend.Sequence();
+	next = 0;
+
+	if ( ! WriteHeader() )
+		{
+		Close(false);
+		return false;
+		}
+
+	if ( options.background )
+		{
+		worker_done = false;
+		worker = thread([this]()
+			{
+			bool ok = true;
+
+			while ( ok && next < pairs.size() )
+				ok = WriteChunk(options.chunk_size);
+
+			worker_ok = ok;
+			worker_done = true;
+			});
+		}
+
+	return true;
+	}
+
+bool nnc::StoreExporter::TriggerOnSignal(int signo)
+	{
+	struct sigaction sa;
+	sa.sa_handler = on_trigger_signal;
+	sigemptyset(&sa.sa_mask);
+	// No SA_RESTART, so that select() returns.
+	sa.sa_flags = 0;
+	return sigaction(signo, &sa, nullptr) == 0;
+	}
+
+void nnc::StoreExporter::ProcessTimers()
+	{
+	uint32_t signals = trigger_signals;
+	bool signaled = signals != signals_seen;
+	signals_seen = signals;
+
+	if ( Active() )
+		{
+		if ( worker.joinable() )
+			{
+			if ( ! worker_done )
+				return;
+
+			worker.join();
+			Close(worker_ok);
+			}
+		else if ( ! WriteChunk(options.chunk_size) )
+			Close(false);
+		else if ( next == pairs.size() )
+			Close(true);
+
+		return;
+		}
+
+	if ( signaled || (options.interval > 0 &&
+	                  current_time() >= last_start + options.interval) )
+		Trigger();
+	}
+
+bool nnc::StoreExporter::NextDeadline(double* deadline) const
+	{
+	if ( Active() )
+		{
+		*deadline = current_time();
+
+		if ( options.background )
+			*deadline += background_poll_interval;
+
+		return true;
+		}
+
+	if ( options.interval > 0 && ! options.path.empty() )
+		{
+		*deadline = last_start + options.interval;
+		return true;
+		}
+
+	return false;
+	}
+
+void nnc::StoreExporter::Finish()
+	{
+	if ( ! Active() )
+		return;
+
+	if ( worker.joinable() )
+		{
+		worker.join();
+		Close(worker_ok);
+		return;
+		}
+
+	bool ok = true;
+
+	while ( ok && next < pairs.size() )
+		ok = WriteChunk(options.chunk_size);
+
+	Close(ok);
+	}
+
+bool nnc::StoreExporter::Open()
+	{
+	const string& path = options.path;
+	piped = false;
+
+	if ( path == "-" )
+		out = stdout;
+	else if ( path[0] == '|' )
+		{
+		out = popen(path.c_str() + 1, "w");
+		piped = true;
+		}
+	else
+		out = fopen((path + ".tmp").c_str(), "wb");
+
+	if ( ! out )
+		fprintf(stderr, "Failed to open export '%s'\n", path.c_str());
+
+	return out != nullptr;
+	}
+
+bool nnc::StoreExporter::WriteHeader()
+	{
+	buffer.clear();
+
+	if ( options.format == EXPORT_BINARY )
+		{
+		buffer.append("NNCDUMP1");
+		put_u64(&buffer, sequence);
+		put_u64(&buffer, pairs.size());
+		put_u32(&buffer, frontend.Topic().size());
+		buffer.append(frontend.Topic());
+		}
+	else
+		buffer.append("key,value\n");
+
+	return fwrite(buffer.data(), 1, buffer.size(), out) == buffer.size();
+	}
+
+bool nnc::StoreExporter::WriteChunk(size_t n)
+	{
+	size_t end = min(next + n, pairs.size());
+	buffer.clear();
+
+	for ( ; next < end; ++next )
+		{
+		const auto& kv = pairs[next];
+
+		if ( options.format == EXPORT_BINARY )
+			{
+			put_u32(&buffer, kv.first.size());
+			buffer.append(kv.first);
+			put_u64(&buffer, kv.second);
+			}
+		else
+			{
+			put_csv_field(&buffer, kv.first);
+			buffer.push_back(',');
+			buffer.append(to_string(kv.second));
+			buffer.push_back('\n');
+			}
+		}
+
+	return fwrite(buffer.data(), 1, buffer.size(), out) == buffer.size();
+	}
+
+void nnc::StoreExporter::Close(bool ok)
+	{
+	if ( out == stdout )
+		ok = fflush(out) == 0 && ok;
+	else if ( piped )
+		ok = pclose(out) == 0 && ok;
+	else
+		{
+		ok = fclose(out) == 0 && ok;
+		string tmp = options.path + ".tmp";
+
+		if ( ok )
+			ok = rename(tmp.c_str(), options.path.c_str()) == 0;
+		else
+			remove(tmp.c_str());
+		}
+
+	out = nullptr;
+	kv_pair_list().swap(pairs);
+	buffer.clear();
+
+	if ( ok )
+		++completed;
+	else
+		{
+		fprintf(stderr, "Failed to export to '%s'\n", options.path.c_str());
+		++failed;
+		}
+	}
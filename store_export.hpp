@@ -0,0 +1,109 @@
+#ifndef NANOCLONE_STORE_EXPORT_HPP
+#define NANOCLONE_STORE_EXPORT_HPP
+
+#include "type_aliases.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <thread>
+
+namespace nnc {
+
+class Frontend;
+
+enum ExportFormat {
+	// A "key,value" header, then a row per pair.  Keys containing commas,
+	// quotes or line breaks are quoted, doubling their quotes.
+	EXPORT_CSV,
+	// The magic "NNCDUMP1", then little-endian: u64 sequence, u64 pair
+	// count, u32 topic size and the topic, then per pair u32 key size, the
+	// key and an i64 value.
+	EXPORT_BINARY,
+};
+
+struct ExportOptions {
+	// "-" is stdout and "|command" pipes to the command.  A file is
+	// written under a ".tmp" suffix and renamed once complete.  Empty
+	// disables exports.
+	std::string path;
+	ExportFormat format = EXPORT_CSV;
+	// Seconds between scheduled exports; 0 exports only when triggered.
+	double interval = 0;
+	// Pairs written per ProcessTimers() call.
+	size_t chunk_size = 4096;
+	// Writes from a thread of its own, e.g. for slow pipes, rather than in
+	// chunks from the event loop.
+	bool background = false;
+};
+
+// Exports a frontend's store as of the moment an export starts, without
+// stalling the event loop for longer than it takes to copy the store's pairs.
+// Formatting and writing is spread over ProcessTimers() calls, or done by a
+// background thread.
+class StoreExporter {
+public:
+
+	StoreExporter(const Frontend& frontend, ExportOptions options);
+
+	// Finishes an export in progress.
+	~StoreExporter();
+
+	// Starts an export, unless one is still running or none is configured.
+	// Returns false if there's no export to run.
+	bool Trigger();
+
+	bool Active() const
+		{ return out != nullptr; }
+
+	// Starts scheduled exports and moves the running one along.
+	void ProcessTimers();
+
+	// When ProcessTimers() next has something to do.
+	bool NextDeadline(double* deadline) const;
+
+	// Makes all exporters start an export once the process receives the
+	// signal, e.g. SIGUSR1.  The signal interrupts select(), so event loops
+	// get to ProcessTimers() right away.
+	static bool TriggerOnSignal(int signo);
+
+	// Completes the running export, if any, before returning.
+	void Finish();
+
+	uint64_t Completed() const
+		{ return completed; }
+
+	uint64_t Failed() const
+		{ return failed; }
+
+private:
+
+	bool Open();
+	bool WriteHeader();
+	// Returns false on a write error.
+	bool WriteChunk(size_t n);
+	// Closes the output, and renames a complete file into place.
+	void Close(bool ok);
+
+	const Frontend& frontend;
+	ExportOptions options;
+	FILE* out = nullptr;
+	bool piped = false;
+	kv_pair_list pairs;
+	uint64_t sequence = 0;
+	size_t next = 0;
+	std::string buffer;
+	double last_start;
+	// The number of trigger signals received as of the last check.
+	uint32_t signals_seen;
+	uint64_t completed = 0;
+	uint64_t failed = 0;
+	std::thread worker;
+	std::atomic<bool> worker_done;
+	bool worker_ok = false;
+};
+
+} // namespace nnc
+
+#endif // NANOCLONE_STORE_EXPORT_HPP
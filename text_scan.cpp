@@ -0,0 +1,272 @@
+#include "text_scan.hpp"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define NANOCLONE_X86_DISPATCH
+#include <immintrin.h>
+#endif
+
+using namespace std;
+using namespace nnc;
+
+using find_space_fn = const char* (*)(const char*, size_t);
+
+static const char* find_space_scalar(const char* s, size_t n)
+	{
+	while ( n > 0 )
+		{
+		if ( s[0] == ' ' )
+			return s;
+
+		++s;
+		--n;
+		}
+
+	return nullptr;
+	}
+
+#ifdef __SSE2__
+static const char* find_space_sse2(const char* s, size_t n)
+	{
+	const __m128i spaces = _mm_set1_epi8(' ');
+
+	for ( ; n >= 16; s += 16, n -= 16 )
+		{
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s));
+		int m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, spaces));
+
+		if ( m )
+			return s + __builtin_ctz(m);
+		}
+
+	return find_space_scalar(s, n);
+	}
+#endif
+
+#ifdef NANOCLONE_X86_DISPATCH
+__attribute__((target("avx2")))
+static const char* find_space_avx2(const char* s, size_t n)
+	{
+	const __m256i spaces = _mm256_set1_epi8(' ');
+
+	for ( ; n >= 32; s += 32, n -= 32 )
+		{
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s));
+		uint32_t m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, spaces));
+
+		if ( m )
+			return s + __builtin_ctz(m);
+		}
+
+	// The remainder, if 16 bytes or more, in one more step.
+	if ( n >= 16 )
+		{
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s));
+		int m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+
+		if ( m )
+			return s + __builtin_ctz(m);
+
+		s += 16;
+		n -= 16;
+		}
+
+	return find_space_scalar(s, n);
+	}
+#endif
+
+static find_space_fn select_find_space()
+	{
+#ifdef NANOCLONE_X86_DISPATCH
+	// May run before the runtime initialized what the builtin checks.
+	__builtin_cpu_init();
+
+	if ( __builtin_cpu_supports("avx2") )
+		return find_space_avx2;
+#endif
+
+#ifdef __SSE2__
+	return find_space_sse2;
+#else
+	return find_space_scalar;
+#endif
+	}
+
+static const char* find_space_first_call(const char* s, size_t n);
+
+// Resolved on first use rather than during static initialization, so that
+// parsing from other static initializers works too.  Racing threads all
+// store the same function.
+static atomic<find_space_fn> find_space_impl(find_space_first_call);
+
+static const char* find_space_first_call(const char* s, size_t n)
+	{
+	find_space_fn f = select_find_space();
+	find_space_impl.store(f, memory_order_relaxed);
+	return f(s, n);
+	}
+
+const char* nnc::find_space(const char* s, size_t n)
+	{
+	return find_space_impl.load(memory_order_relaxed)(s, n);
+	}
+
+const char* nnc::text_scan_isa()
+	{
+	find_space_fn f = select_find_space();
+
+#ifdef NANOCLONE_X86_DISPATCH
+	if ( f == find_space_avx2 )
+		return "avx2";
+#endif
+
+#ifdef __SSE2__
+	if ( f == find_space_sse2 )
+		return "sse2";
+#endif
+
+	return "scalar";
+	}
+
+// Reads 8 bytes with the first in the lowest byte of the word.
+static inline uint64_t load_le64(const char* s)
+	{
+	uint64_t w;
+	memcpy(&w, s, sizeof(w));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	w = __builtin_bswap64(w);
+#endif
+	return w;
+	}
+
+static inline bool eight_digits(uint64_t w)
+	{
+	// The high nibbles must be 3, and adding 6 mustn't carry out of any of
+	// the low ones.
+	return ((w & 0xf0f0f0f0f0f0f0f0) |
+	        (((w + 0x0606060606060606) & 0xf0f0f0f0f0f0f0f0) >> 4)) ==
+	       0x3333333333333333;
+	}
+
+// Converts neighbouring digits pairwise, then the pairs into fours, and
+// the fours into the result.
+static inline uint32_t convert_eight_digits(uint64_t w)
+	{
+	const uint64_t mask = 0x000000ff000000ff;
+	const uint64_t mul1 = 100 + (1000000ULL << 32);
+	const uint64_t mul2 = 1 + (10000ULL << 32);
+
+	w -= 0x3030303030303030;
+	w = w * 10 + (w >> 8);
+	return uint32_t(((w & mask) * mul1 + ((w >> 16) & mask) * mul2) >> 32);
+	}
+
+// Converts 1 to 19 digits, which can't overflow, or returns false if there's
+// anything else among them.
+static bool parse_digits(const char* s, size_t n, uint64_t* val)
+	{
+	// The leading digits that don't fill a word are padded with zeros.
+	size_t len = (n - 1) % 8 + 1;
+	char buf[8];
+	memset(buf, '0', sizeof(buf));
+	memcpy(buf + sizeof(buf) - len, s, len);
+
+	uint64_t w = load_le64(buf);
+
+	if ( ! eight_digits(w) )
+		return false;
+
+	uint64_t rval = convert_eight_digits(w);
+
+	for ( s += len, n -= len; n > 0; s += 8, n -= 8 )
+		{
+		w = load_le64(s);
+
+		if ( ! eight_digits(w) )
+			return false;
+
+		rval = rval * 100000000 + convert_eight_digits(w);
+		}
+
+	*val = rval;
+	return true;
+	}
+
+// Does what std::sto*() does, on a terminated copy of the field.
+template<class T, class F>
+static bool parse_fallback(const char* s, size_t n, T* val, F convert)
+	{
+	char buf[64];
+	string str;
+	const char* cs = buf;
+
+	if ( n < sizeof(buf) )
+		{
+		memcpy(buf, s, n);
+		buf[n] = '\0';
+		}
+	else
+		{
+		str.assign(s, n);
+		cs = str.c_str();
+		}
+
+	int saved_errno = errno;
+	errno = 0;
+	char* end;
+	T rval = convert(cs, &end);
+	bool ok = end != cs && errno != ERANGE;
+
+	if ( errno == 0 )
+		errno = saved_errno;
+
+	if ( ok )
+		*val = rval;
+
+	return ok;
+	}
+
+bool nnc::parse_uint64(const char* s, size_t n, uint64_t* val)
+	{
+	if ( n > 0 && n <= 19 && parse_digits(s, n, val) )
+		return true;
+
+	return parse_fallback(s, n, val, [](const char* cs, char** end)
+		{ return uint64_t(strtoull(cs, end, 10)); });
+	}
+
+bool nnc::parse_int64(const char* s, size_t n, int64_t* val)
+	{
+	const char* d = s;
+	size_t m = n;
+	bool negative = m > 0 && *d == '-';
+
+	if ( negative )
+		{
+		++d;
+		--m;
+		}
+
+	uint64_t u;
+
+	// Up to 18 digits fit either way.
+	if ( m > 0 && m <= 18 && parse_digits(d, m, &u) )
+		{
+		*val = negative ? -int64_t(u) : int64_t(u);
+		return true;
+		}
+
+	return parse_fallback(s, n, val, [](const char* cs, char** end)
+		{ return int64_t(strtoll(cs, end, 10)); });
+	}
+
+bool nnc::parse_double(const char* s, size_t n, double* val)
+	{
+	return parse_fallback(s, n, val, [](const char* cs, char** end)
+		{ return strtod(cs, end); });
+	}
@@ -0,0 +1,33 @@
+#ifndef NANOCLONE_TEXT_SCAN_HPP
+#define NANOCLONE_TEXT_SCAN_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+namespace nnc {
+
+// The scanning primitives of the text protocol's parsers.  Delimiters are
+// searched for with SSE2 or AVX2, whichever the CPU supports, and plain runs
+// of digits are converted eight at a time within a 64-bit word.  Anything
+// else, e.g. a sign or an overflowing number, falls back to strtoull() and
+// friends, so results are the same as std::stoull() etc. reading the field.
+// Errors are returned rather than thrown.
+
+// Returns the first space, or nullptr if there's none.
+const char* find_space(const char* s, size_t n);
+
+// Each reads a field as the corresponding std::sto*() would read it from a
+// string holding [s, s + n): leading whitespace and trailing junk are
+// skipped.  Returns false where those would throw.
+bool parse_uint64(const char* s, size_t n, uint64_t* val);
+
+bool parse_int64(const char* s, size_t n, int64_t* val);
+
+bool parse_double(const char* s, size_t n, double* val);
+
+// The find_space() implementation in use: "avx2", "sse2" or "scalar".
+const char* text_scan_isa();
+
+} // namespace nnc
+
+#endif // NANOCLONE_TEXT_SCAN_HPP
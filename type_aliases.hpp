@@ -2,6 +2,9 @@
 #define NANOCLONE_TYPE_ALIASES
 
 #include <unordered_map>
+#include <set>
+#include <vector>
+#include <utility>
 #include <string>
 #include <functional>
 #include <cstdint>
@@ -16,12 +19,45 @@ using value_type = int64_t;
 //       e.g. leverage an external library that provides at least a persistence
 //       mechanism.
 using kv_store_type = std::unordered_map<key_type, value_type>;
+using kv_pair_list = std::vector<std::pair<key_type, value_type>>;
+
+struct key_ptr_less {
+	bool operator()(const key_type* a, const key_type* b) const
+		{ return *a < *b; }
+};
+
+// Optional ordered view of a kv_store_type's keys, for range scans.  It points
+// at the keys owned by the store's nodes rather than holding copies.
+using ordered_index_type = std::set<const key_type*, key_ptr_less>;
+
+// One node's share of a PN-counter: the totals of its increments and of its
+// decrements, both only ever growing.  Counter value is the sum of p - n over
+// all nodes, and merging states takes the maximum of each.
+struct pn_counter {
+	value_type p = 0;
+	value_type n = 0;
+};
+
+using pn_counter_list = std::vector<std::pair<key_type, pn_counter>>;
+
+// Read-modify-write operations executed on the authoritative store.
+enum AtomicOp {
+	ATOMIC_CAS,              // Set to the operand if equal to 'expected'.
+	ATOMIC_FETCH_ADD,        // Add the operand to an existing value.
+	ATOMIC_UPSERT_ADD,       // Add the operand, a missing value counts as 0.
+	ATOMIC_INSERT_IF_ABSENT, // Insert the operand if there's no value.
+	ATOMIC_MAX,              // Keep the larger of the value and operand.
+	ATOMIC_MIN,              // Keep the smaller of the value and operand.
+};
 
 enum AsyncResultCode {
 	ASYNC_TIMEOUT = -1,
 	ASYNC_SUCCESS = 0,
 	ASYNC_INVALID_REQUEST = 1,
 	ASYNC_INVALID_RESPONSE = 2,
+	// Not sent at all, e.g. no backend or a full queue.  Only awaitable
+	// queries report it; callback-based ones return false instead.
+	ASYNC_REJECTED = 3,
 };
 
 using lookup_cb = std::function<void(const key_type&,
@@ -29,6 +65,75 @@ using lookup_cb = std::function<void(const key_type&,
                                      AsyncResultCode)>;
 using haskey_cb = std::function<void(const key_type&, bool, AsyncResultCode)>;
 using size_cb = std::function<void(uint64_t, AsyncResultCode)>;
+// When 'more' is set, passing 'next' as the beginning of another scan with
+// the same end resumes after the last pair delivered.
+using scan_cb = std::function<void(kv_pair_list, bool more,
+                                   const key_type& next, AsyncResultCode)>;
+// Whether the operation's condition held, the key's resulting value, and the
+// store's sequence number after the operation.
+using atomic_cb = std::function<void(const key_type&, bool applied,
+                                     std::unique_ptr<value_type>,
+                                     uint64_t sequence, AsyncResultCode)>;
+
+// What an authoritative backend reports about one of its topics.
+struct TopicStats {
+	std::string topic;
+	uint32_t topic_id = 0;
+	uint64_t keys = 0;
+	uint64_t sequence = 0;
+	// Publications per second, measured over the last few seconds.
+	double publication_rate = 0;
+	// Topic ID requests answered, i.e. subscribers that (re)joined.
+	uint64_t joins = 0;
+	uint64_t snapshots_served = 0;
+	uint64_t snapshot_cache_hits = 0;
+	uint64_t snapshot_bytes = 0;
+	// Time spent encoding the snapshots that weren't cached.
+	double snapshot_seconds = 0;
+};
+
+struct BackendStats {
+	double uptime = 0;
+	// Peers connected to the publication socket, i.e. subscriber processes.
+	uint64_t connections = 0;
+	uint64_t publications_queued = 0;
+	std::vector<TopicStats> topics;
+};
+
+using stats_cb = std::function<void(const BackendStats&, AsyncResultCode)>;
+
+// When a traced request reached each stage, as from current_time().  The
+// server's stamps are from its own clock, so only their differences mean
+// anything next to the client's.  Stamps not reached, e.g. after a timeout,
+// are 0.
+struct RequestTrace {
+	double created = 0;
+	// Reached the front of the queue, no longer behind an in-flight request.
+	double ready = 0;
+	double sent = 0;
+	double server_received = 0;
+	double processed = 0;
+	double reply_sent = 0;
+	double received = 0;
+
+	double Queued() const
+		{ return ready - created; }
+
+	// Waiting for the request socket to accept the request.
+	double SendWait() const
+		{ return sent - ready; }
+
+	double Processing() const
+		{ return processed - server_received; }
+
+	// Sitting in the server's pending response.
+	double ReplyWait() const
+		{ return reply_sent - processed; }
+
+	// Round trip minus the time spent in the server.
+	double Network() const
+		{ return received - sent - (reply_sent - server_received); }
+};
 
 } // namespace nnc
 
@@ -1,11 +1,35 @@
 #include "util.hpp"
 
 #include <stdexcept>
+#include <cmath>
+#include <sys/time.h>
 #include <nanomsg/nn.h>
 
 using namespace std;
 using namespace nnc;
 
+double nnc::current_time()
+	{
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return tv.tv_sec + (tv.tv_usec / 1000000.0);
+	}
+
+timeval nnc::to_timeval(double seconds)
+	{
+	timeval rval;
+	rval.tv_sec = rval.tv_usec = 0;
+
+	if ( seconds < 0 )
+		return rval;
+
+	double intp, fractp;
+	fractp = modf(seconds, &intp);
+	rval.tv_sec = intp;
+	rval.tv_usec = fractp * 1000000;
+	return rval;
+	}
+
 bool nnc::safe_nn_close(int socket)
 	{
 	int rc;
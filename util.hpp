@@ -4,9 +4,16 @@
 #include <functional>
 #include <string>
 #include <vector>
+#include <sys/time.h>
 
 namespace nnc {
 
+// Wall clock time in seconds.
+double current_time();
+
+// Negative durations are clamped to zero.
+timeval to_timeval(double seconds);
+
 bool safe_nn_close(int socket);
 
 std::vector<bool> safe_nn_close(const std::vector<int>& sockets);